@@ -0,0 +1,177 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "config.h"
+#include <libes2ts/es2ts.h>
+#include "audio.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define AUDIO_INITIAL_SIZE	(16 * 1024)
+
+/* Enough of any frame to size it */
+#define AUDIO_HEADER_SIZE	7
+
+static const int adts_rates[16] = {
+	96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050,
+	16000, 12000, 11025, 8000, 7350, 0, 0, 0
+};
+
+/* kbps by frmsizecod / 2 (A/52 table 5.18) */
+static const int ac3_bitrates[19] = {
+	32, 40, 48, 56, 64, 80, 96, 112, 128, 160,
+	192, 224, 256, 320, 384, 448, 512, 576, 640
+};
+
+static const int ac3_rates[4] = { 48000, 44100, 32000, 0 };
+
+/* Size the frame at b, or return 0 if it isn't a frame header */
+static int adts_parse(struct es2ts_audio_s *p, const unsigned char *b)
+{
+	if (b[0] != 0xff || (b[1] & 0xf6) != 0xf0)
+		return 0;
+
+	int rate = adts_rates[(b[2] >> 2) & 0x0f];
+	int len = ((b[3] & 0x03) << 11) | (b[4] << 3) | (b[5] >> 5);
+	if (!rate || len < AUDIO_HEADER_SIZE)
+		return 0;
+
+	p->rate = rate;
+	p->samples = 1024 * ((b[6] & 0x03) + 1);
+
+	return len;
+}
+
+static int ac3_parse(struct es2ts_audio_s *p, const unsigned char *b)
+{
+	if (b[0] != 0x0b || b[1] != 0x77)
+		return 0;
+
+	int rate = ac3_rates[b[4] >> 6];
+	int code = b[4] & 0x3f;
+	int bsid = b[5] >> 3;
+
+	/* bsid above 10 is E-AC-3, a different frame layout */
+	if (!rate || code >= 38 || bsid > 10)
+		return 0;
+
+	/* 16 bit words per 1536 sample frame, 44.1KHz alternates to average out */
+	int words = ac3_bitrates[code >> 1] * 1000 * 96 / rate;
+	if (rate == 44100)
+		words += code & 1;
+
+	p->rate = rate;
+	p->samples = 1536;
+
+	return words * 2;
+}
+
+int es2ts_audio_alloc(struct es2ts_audio_s **r, int type)
+{
+	if ((type != AUDIO_TYPE_AAC) && (type != AUDIO_TYPE_AC3))
+		return ES2TS_INVALID_ARG;
+
+	struct es2ts_audio_s *p = calloc(1, sizeof(*p));
+	if (!p)
+		return ES2TS_ERROR;
+
+	p->ptr = malloc(AUDIO_INITIAL_SIZE);
+	if (!p->ptr) {
+		free(p);
+		return ES2TS_ERROR;
+	}
+	p->maxlen = AUDIO_INITIAL_SIZE;
+	p->type = type;
+
+	*r = p;
+	return ES2TS_OK;
+}
+
+void es2ts_audio_free(struct es2ts_audio_s *p)
+{
+	if (!p)
+		return;
+
+	free(p->ptr);
+	memset(p, 0, sizeof(*p));
+	free(p);
+}
+
+unsigned char *es2ts_audio_reserve(struct es2ts_audio_s *p, int len)
+{
+	if (p->maxlen - p->usedlen < (unsigned int)len) {
+		unsigned int maxlen = p->maxlen;
+		while (maxlen - p->usedlen < (unsigned int)len)
+			maxlen *= 2;
+
+		unsigned char *ptr = realloc(p->ptr, maxlen);
+		if (!ptr)
+			return 0;
+		p->ptr = ptr;
+		p->maxlen = maxlen;
+	}
+
+	return p->ptr + p->usedlen;
+}
+
+int es2ts_audio_commit(struct es2ts_audio_s *p, int len, es2ts_nal_au_cb cb, void *opaque)
+{
+	unsigned int i = 0;
+	int ret = ES2TS_OK;
+
+	p->usedlen += len;
+
+	while (i + AUDIO_HEADER_SIZE <= p->usedlen) {
+		int framelen;
+		if (p->type == AUDIO_TYPE_AAC)
+			framelen = adts_parse(p, p->ptr + i);
+		else
+			framelen = ac3_parse(p, p->ptr + i);
+
+		if (framelen == 0) {
+			i++;
+			continue;
+		}
+		if (i + framelen > p->usedlen)
+			break;
+
+		ret = cb(opaque, p->ptr + i, framelen, 1);
+		if (ES2TS_FAILED(ret))
+			break;
+		i += framelen;
+	}
+
+	/* Keep the partial frame, or the tail too short to check for a header */
+	memmove(p->ptr, p->ptr + i, p->usedlen - i);
+	p->usedlen -= i;
+
+	return ret;
+}
+
+void es2ts_audio_flush(struct es2ts_audio_s *p)
+{
+	p->usedlen = 0;
+}
@@ -0,0 +1,63 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef ES2TS_AUDIO_H
+#define ES2TS_AUDIO_H
+
+/* Split an ADTS AAC or AC-3 byte stream into frames for the native muxer,
+ * the audio counterpart of nal.c. Bytes that don't parse as a frame header
+ * are skipped until the stream syncs up again.
+ */
+
+#include "nal.h"
+
+#define AUDIO_TYPE_AAC		0x0f	/* ISO/IEC 13818-7 ADTS */
+#define AUDIO_TYPE_AC3		0x81	/* ATSC A/52 */
+
+struct es2ts_audio_s {
+	int type;		/* AUDIO_TYPE_* */
+
+	unsigned char *ptr;	/* Pending bitstream, a frame header first once in sync */
+	unsigned int maxlen;
+	unsigned int usedlen;
+
+	/* Of the frame being delivered, valid inside the callback */
+	int samples;		/* Per channel */
+	int rate;		/* Hz */
+};
+
+int es2ts_audio_alloc(struct es2ts_audio_s **p, int type);
+void es2ts_audio_free(struct es2ts_audio_s *p);
+
+/* As es2ts_nal_reserve() and es2ts_nal_commit(), the callback gets one frame
+ * at a time with keyframe set, every audio frame is a random access point.
+ */
+unsigned char *es2ts_audio_reserve(struct es2ts_audio_s *p, int len);
+int es2ts_audio_commit(struct es2ts_audio_s *p, int len, es2ts_nal_au_cb cb, void *opaque);
+
+/* Drop whatever is pending, a partial frame can't be decoded */
+void es2ts_audio_flush(struct es2ts_audio_s *p);
+
+#endif
@@ -0,0 +1,434 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* Throughput and latency benchmark for libes2ts.
+ *
+ * Each channel is a context fed by its own producer thread with a
+ * synthetic H264 stream (see h264gen.c). Output goes to a counting sink
+ * that times the arrival of every PES start, and of the packet completing
+ * the frame, against the moment the matching frame was enqueued. The
+ * encoder hands over a frame the moment it's captured, so the latter is
+ * glass to callback as far as the library is concerned.
+ */
+
+#include "config.h"
+#include <libes2ts/es2ts.h>
+#include <libes2ts/sink.h>
+#include "h264gen.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#define STAMP_MAX	65536		/* Frames in flight per channel */
+#define SAMPLE_MAX	(1 << 20)	/* Latency samples kept per channel */
+
+struct channel_s {
+	struct es2ts_sink_s sink;
+	struct es2ts_context_s *ctx;
+	pthread_t thread;
+
+	/* One GOP, generated up front so the generator isn't what we measure */
+	unsigned char **frame;
+	int *framelen;
+	int nr;
+
+	/* Producer */
+	uint64_t stamp[STAMP_MAX];	/* Enqueue time of frame n, ns */
+	int stamplen[STAMP_MAX];	/* and its length */
+	uint64_t frames_in;
+	uint64_t bytes_in;
+	uint64_t retries;
+
+	/* Library thread */
+	uint64_t frames_out;
+	uint64_t packets_out;
+	uint64_t callbacks;
+	uint32_t *samples;		/* Enqueue to callback latency, ns */
+	int nsamples;
+	uint32_t *complete;		/* Enqueue to the callback with the frame's last byte, ns */
+	int ncomplete;
+	uint64_t pesframe;		/* Frame in the current PES */
+	int pesbytes;			/* Of its payload seen so far, -1 once complete */
+};
+
+static int opt_channels = 1;
+static int opt_seconds = 5;
+static int opt_realtime = 0;
+static int opt_bytes = 0;
+static int opt_native = 0;
+static int opt_fast = 0;
+static int opt_lowlatency = 0;
+static int opt_engine = 0;
+static int opt_burst = 7;
+static int opt_json = 0;
+static struct h264gen_params_s opt_gen = { 640, 368, 30, 30, 8000000, 20, 1 };
+static volatile int running = 1;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void histogram_merge(struct es2ts_histogram_s *dst, const struct es2ts_histogram_s *src)
+{
+	if (src->count && (dst->count == 0 || src->min < dst->min))
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+	dst->count += src->count;
+	dst->sum += src->sum;
+	for (int i = 0; i < ES2TS_HIST_BUCKETS; i++)
+		dst->bucket[i] += src->bucket[i];
+}
+
+/* Count what comes out, time each new PES on the video PID and the packet
+ * that brings its payload up to the length of the frame enqueued
+ */
+static int bench_write(struct es2ts_sink_s *sink, const struct iovec *iov, int iovcnt)
+{
+	struct channel_s *ch = (struct channel_s *)sink;
+	uint64_t t = now_ns();
+
+	ch->callbacks++;
+	for (int i = 0; i < iovcnt; i++) {
+		const unsigned char *p = iov[i].iov_base;
+		for (size_t idx = 0; idx < iov[i].iov_len; idx += 188) {
+			const unsigned char *pkt = p + idx;
+
+			ch->packets_out++;
+			if (((pkt[1] & 0x1f) << 8 | pkt[2]) != 0x100 || !(pkt[3] & 0x10))
+				continue;
+
+			int payload = 4 + ((pkt[3] & 0x20) ? 1 + pkt[4] : 0);
+			if (pkt[1] & 0x40) {
+				uint64_t sent = ch->stamp[ch->frames_out % STAMP_MAX];
+				if (ch->nsamples < SAMPLE_MAX)
+					ch->samples[ch->nsamples++] = t - sent;
+				ch->pesframe = ch->frames_out++;
+				ch->pesbytes = 0;
+				payload += 9 + pkt[payload + 8];
+			}
+			if (ch->pesbytes < 0)
+				continue;
+
+			ch->pesbytes += 188 - payload;
+			if (ch->pesbytes >= ch->stamplen[ch->pesframe % STAMP_MAX]) {
+				uint64_t sent = ch->stamp[ch->pesframe % STAMP_MAX];
+				if (ch->ncomplete < SAMPLE_MAX)
+					ch->complete[ch->ncomplete++] = t - sent;
+				ch->pesbytes = -1;
+			}
+		}
+	}
+
+	return ES2TS_OK;
+}
+
+static void *producer(void *p)
+{
+	struct channel_s *ch = p;
+	uint64_t interval = 1000000000ULL / opt_gen.fps;
+	uint64_t next = now_ns();
+
+	while (running) {
+		int idx = ch->frames_in % opt_gen.gop;
+		unsigned char *buf = ch->frame[idx];
+		int len = ch->framelen[idx];
+		int key = (idx == 0);
+		int64_t pts = ch->frames_in * 90000 / opt_gen.fps;
+
+		if (opt_realtime) {
+			uint64_t t;
+			while ((t = now_ns()) < next)
+				usleep((next - t) / 1000);
+			next += interval;
+		}
+
+		/* Don't run further ahead of the output than we can track */
+		while (running && ch->frames_in - __atomic_load_n(&ch->frames_out, __ATOMIC_RELAXED) >= STAMP_MAX - 1)
+			usleep(100);
+
+		ch->stamplen[ch->frames_in % STAMP_MAX] = len;
+		ch->stamp[ch->frames_in % STAMP_MAX] = now_ns();
+		int ret = ES2TS_ERROR;
+		while (running) {
+			if (opt_bytes)
+				ret = es2ts_data_enqueue(ch->ctx, buf, len);
+			else
+				ret = es2ts_frame_enqueue(ch->ctx, buf, len, pts, ES2TS_NOPTS, key ? ES2TS_FRAME_KEY : 0);
+			if (ES2TS_SUCCESS(ret))
+				break;
+			ch->retries++;
+			usleep(50);
+		}
+
+		/* Stopped while retrying, the frame never went in */
+		if (ES2TS_FAILED(ret))
+			break;
+		ch->frames_in++;
+		ch->bytes_in += len;
+	}
+
+	return NULL;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -c N    channels (contexts), default 1\n"
+		"  -t S    seconds to run, default 5\n"
+		"  -n      native muxer (ES2TS_FLAG_NATIVE_MUX)\n"
+		"  -F      fast start from the first SPS / IDR (ES2TS_FLAG_FAST_START)\n"
+		"  -L      flush every access unit downstream whole (ES2TS_FLAG_LOW_LATENCY)\n"
+		"  -e N    share an engine of N workers between channels, implies -n\n"
+		"  -B N    TS packets per output burst, default 7\n"
+		"  -R      real time, enqueue at the frame rate rather than flat out\n"
+		"  -s      enqueue as a byte stream rather than with es2ts_frame_enqueue()\n"
+		"  -W W -H H -f FPS -g GOP -b BITRATE -j JITTER%%\n"
+		"          synthetic stream, default 640x368 30fps gop 30 8000000 bit/s 20%%\n"
+		"  -J      machine readable JSON on stdout\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	struct es2ts_engine_s *engine = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:t:nFLe:B:RsW:H:f:g:b:j:Jh")) != -1) {
+		switch (opt) {
+		case 'c': opt_channels = atoi(optarg); break;
+		case 't': opt_seconds = atoi(optarg); break;
+		case 'n': opt_native = 1; break;
+		case 'F': opt_fast = 1; break;
+		case 'L': opt_lowlatency = 1; break;
+		case 'e': opt_engine = atoi(optarg); opt_native = 1; break;
+		case 'B': opt_burst = atoi(optarg); break;
+		case 'R': opt_realtime = 1; break;
+		case 's': opt_bytes = 1; break;
+		case 'W': opt_gen.width = atoi(optarg); break;
+		case 'H': opt_gen.height = atoi(optarg); break;
+		case 'f': opt_gen.fps = atoi(optarg); break;
+		case 'g': opt_gen.gop = atoi(optarg); break;
+		case 'b': opt_gen.bitrate = atoi(optarg); break;
+		case 'j': opt_gen.jitter = atoi(optarg); break;
+		case 'J': opt_json = 1; break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (opt_channels <= 0 || opt_seconds <= 0 || opt_gen.jitter < 0 || opt_gen.jitter > 100) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (opt_engine && ES2TS_FAILED(es2ts_engine_alloc(&engine, opt_engine))) {
+		fprintf(stderr, "unable to allocate engine\n");
+		return 1;
+	}
+
+	struct channel_s *channels = calloc(opt_channels, sizeof(struct channel_s));
+	if (!channels)
+		return 1;
+
+	for (int i = 0; i < opt_channels; i++) {
+		struct channel_s *ch = &channels[i];
+		struct h264gen_params_s params = opt_gen;
+		struct h264gen_s *gen;
+		params.seed += i;
+
+		if (h264gen_alloc(&gen, &params) < 0) {
+			fprintf(stderr, "invalid stream parameters\n");
+			return 1;
+		}
+		ch->frame = calloc(opt_gen.gop, sizeof(unsigned char *));
+		ch->framelen = calloc(opt_gen.gop, sizeof(int));
+		for (int f = 0; f < opt_gen.gop; f++) {
+			unsigned char *buf;
+			int key;
+			ch->framelen[f] = h264gen_frame(gen, &buf, &key);
+			ch->frame[f] = malloc(ch->framelen[f]);
+			memcpy(ch->frame[f], buf, ch->framelen[f]);
+		}
+		h264gen_free(gen);
+
+		ch->nr = i;
+		ch->sink.write = bench_write;
+		ch->samples = malloc(SAMPLE_MAX * sizeof(uint32_t));
+		ch->complete = malloc(SAMPLE_MAX * sizeof(uint32_t));
+		ch->pesbytes = -1;
+		if (!ch->samples || !ch->complete ||
+			ES2TS_FAILED(es2ts_alloc_flags(&ch->ctx,
+				(opt_native ? ES2TS_FLAG_NATIVE_MUX : 0) | (opt_fast ? ES2TS_FLAG_FAST_START : 0) |
+				(opt_lowlatency ? ES2TS_FLAG_LOW_LATENCY : 0))) ||
+			ES2TS_FAILED(es2ts_output_burst_set(ch->ctx, opt_burst)) ||
+			ES2TS_FAILED(es2ts_sink_attach(ch->ctx, &ch->sink)) ||
+			(engine && ES2TS_FAILED(es2ts_engine_attach(engine, ch->ctx))) ||
+			ES2TS_FAILED(es2ts_process_start(ch->ctx))) {
+			fprintf(stderr, "unable to set up channel %d\n", i);
+			return 1;
+		}
+	}
+
+	struct rusage ru0, ru1;
+	getrusage(RUSAGE_SELF, &ru0);
+	uint64_t start = now_ns();
+
+	for (int i = 0; i < opt_channels; i++)
+		pthread_create(&channels[i].thread, NULL, producer, &channels[i]);
+
+	sleep(opt_seconds);
+	running = 0;
+	for (int i = 0; i < opt_channels; i++)
+		pthread_join(channels[i].thread, NULL);
+
+	/* Give the library a moment to drain what is queued */
+	usleep(100 * 1000);
+	double elapsed = (now_ns() - start) / 1e9;
+	getrusage(RUSAGE_SELF, &ru1);
+
+	for (int i = 0; i < opt_channels; i++)
+		es2ts_process_end(channels[i].ctx);
+	if (engine)
+		es2ts_engine_free(engine);
+
+	/* Where the library spent its time, per stage across all channels */
+	struct es2ts_stats_s *stats = calloc(2, sizeof(*stats));
+	uint64_t first_max = 0;
+	for (int i = 0; i < opt_channels; i++) {
+		es2ts_get_stats(channels[i].ctx, &stats[1]);
+		if (stats[1].first_packet > first_max)
+			first_max = stats[1].first_packet;
+		histogram_merge(&stats[0].queue, &stats[1].queue);
+		histogram_merge(&stats[0].demux, &stats[1].demux);
+		histogram_merge(&stats[0].mux, &stats[1].mux);
+		histogram_merge(&stats[0].callback, &stats[1].callback);
+	}
+#define STAGE(h, p) (es2ts_histogram_percentile(&stats[0].h, p) / 1000.0)
+
+	/* Totals across all channels */
+	uint64_t frames_in = 0, frames_out = 0, bytes_in = 0, packets = 0, callbacks = 0, retries = 0;
+	int nsamples = 0, ncomplete = 0;
+	for (int i = 0; i < opt_channels; i++) {
+		frames_in += channels[i].frames_in;
+		frames_out += channels[i].frames_out;
+		bytes_in += channels[i].bytes_in;
+		packets += channels[i].packets_out;
+		callbacks += channels[i].callbacks;
+		retries += channels[i].retries;
+		nsamples += channels[i].nsamples;
+		ncomplete += channels[i].ncomplete;
+	}
+
+	uint32_t *all = malloc((nsamples + 1) * sizeof(uint32_t));
+	int n = 0;
+	for (int i = 0; i < opt_channels; i++) {
+		memcpy(all + n, channels[i].samples, channels[i].nsamples * sizeof(uint32_t));
+		n += channels[i].nsamples;
+	}
+	qsort(all, n, sizeof(uint32_t), cmp_u32);
+#define PCT(p) (n ? all[(int)((n - 1) * (p) / 100.0)] / 1000.0 : 0.0)
+
+	uint32_t *done = malloc((ncomplete + 1) * sizeof(uint32_t));
+	int nd = 0;
+	for (int i = 0; i < opt_channels; i++) {
+		memcpy(done + nd, channels[i].complete, channels[i].ncomplete * sizeof(uint32_t));
+		nd += channels[i].ncomplete;
+	}
+	qsort(done, nd, sizeof(uint32_t), cmp_u32);
+#define DONE(p) (nd ? done[(int)((nd - 1) * (p) / 100.0)] / 1000.0 : 0.0)
+
+	double cpu = (ru1.ru_utime.tv_sec - ru0.ru_utime.tv_sec) + (ru1.ru_utime.tv_usec - ru0.ru_utime.tv_usec) / 1e6 +
+		(ru1.ru_stime.tv_sec - ru0.ru_stime.tv_sec) + (ru1.ru_stime.tv_usec - ru0.ru_stime.tv_usec) / 1e6;
+	double cpu_per_stream = cpu / elapsed / opt_channels * 100.0;
+
+	if (opt_json) {
+		printf("{\"version\":\"%s\",\"mux\":\"%s\",\"engine\":%d,\"channels\":%d,\"seconds\":%.3f,"
+			"\"realtime\":%d,\"bytestream\":%d,\"fast_start\":%d,\"low_latency\":%d,\"burst\":%d,"
+			"\"width\":%d,\"height\":%d,\"fps\":%d,\"gop\":%d,\"bitrate\":%d,"
+			"\"frames_in\":%llu,\"frames_out\":%llu,\"enqueue_retries\":%llu,"
+			"\"mbytes_per_sec\":%.3f,\"packets_per_sec\":%.1f,\"callbacks_per_sec\":%.1f,"
+			"\"cpu_percent_per_stream\":%.3f,\"first_packet_us\":%.1f,"
+			"\"latency_us\":{\"samples\":%d,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f},"
+			"\"complete_us\":{\"samples\":%d,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f},"
+			"\"stages_us\":{\"queue\":[%.1f,%.1f],\"demux\":[%.1f,%.1f],\"mux\":[%.1f,%.1f],\"callback\":[%.1f,%.1f]}}\n",
+			es2ts_get_version(), opt_native ? "native" : "libav", opt_engine, opt_channels, elapsed,
+			opt_realtime, opt_bytes, opt_fast, opt_lowlatency, opt_burst,
+			opt_gen.width, opt_gen.height, opt_gen.fps, opt_gen.gop, opt_gen.bitrate,
+			(unsigned long long)frames_in, (unsigned long long)frames_out, (unsigned long long)retries,
+			bytes_in / elapsed / 1e6, packets / elapsed, callbacks / elapsed,
+			cpu_per_stream, first_max / 1000.0,
+			n, PCT(50), PCT(90), PCT(99), PCT(99.9), PCT(100),
+			nd, DONE(50), DONE(90), DONE(99), DONE(99.9), DONE(100),
+			STAGE(queue, 50), STAGE(queue, 99), STAGE(demux, 50), STAGE(demux, 99),
+			STAGE(mux, 50), STAGE(mux, 99), STAGE(callback, 50), STAGE(callback, 99));
+	} else {
+		printf("libes2ts %s, %s mux, %d channel(s)%s, %.1f s\n", es2ts_get_version(),
+			opt_native ? "native" : "libav", opt_channels, opt_engine ? " on an engine" : "", elapsed);
+		printf("  frames    in %llu out %llu, enqueue retries %llu\n",
+			(unsigned long long)frames_in, (unsigned long long)frames_out, (unsigned long long)retries);
+		printf("  input     %.2f MB/s\n", bytes_in / elapsed / 1e6);
+		printf("  output    %.0f TS packets/s, %.0f callbacks/s\n", packets / elapsed, callbacks / elapsed);
+		printf("  cpu       %.2f%% per stream\n", cpu_per_stream);
+		printf("  start     first enqueue to first TS packet %.1f us, slowest channel\n", first_max / 1000.0);
+		printf("  latency   enqueue to callback us: p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f (%d samples)\n",
+			PCT(50), PCT(90), PCT(99), PCT(99.9), PCT(100), n);
+		printf("  complete  enqueue to last byte us: p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f (%d samples)\n",
+			DONE(50), DONE(90), DONE(99), DONE(99.9), DONE(100), nd);
+		printf("  stages    us p50/p99: queue %.1f/%.1f demux %.1f/%.1f mux %.1f/%.1f callback %.1f/%.1f\n",
+			STAGE(queue, 50), STAGE(queue, 99), STAGE(demux, 50), STAGE(demux, 99),
+			STAGE(mux, 50), STAGE(mux, 99), STAGE(callback, 50), STAGE(callback, 99));
+	}
+
+	for (int i = 0; i < opt_channels; i++) {
+		es2ts_free(channels[i].ctx);
+		for (int f = 0; f < opt_gen.gop; f++)
+			free(channels[i].frame[f]);
+		free(channels[i].frame);
+		free(channels[i].framelen);
+		free(channels[i].samples);
+		free(channels[i].complete);
+	}
+	free(channels);
+	free(stats);
+	free(all);
+	free(done);
+
+	return 0;
+}
@@ -0,0 +1,88 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "crc32.h"
+
+#include <pthread.h>
+
+#define CRC32_POLY	0x04c11db7
+
+/* table[0] is the classic byte table, table[k] advances table[k - 1] by
+ * one more zero byte, so eight input bytes fold in with eight lookups.
+ */
+static uint32_t table[8][256];
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+static void table_init(void)
+{
+	for (int b = 0; b < 256; b++) {
+		uint32_t crc = (uint32_t)b << 24;
+		for (int bit = 0; bit < 8; bit++)
+			crc = (crc & 0x80000000) ? (crc << 1) ^ CRC32_POLY : (crc << 1);
+		table[0][b] = crc;
+	}
+
+	for (int k = 1; k < 8; k++) {
+		for (int b = 0; b < 256; b++) {
+			uint32_t crc = table[k - 1][b];
+			table[k][b] = (crc << 8) ^ table[0][crc >> 24];
+		}
+	}
+}
+
+uint32_t es2ts_crc32_mpeg(const unsigned char *data, int len)
+{
+	uint32_t crc = 0xffffffff;
+
+	pthread_once(&table_once, table_init);
+
+	while (len >= 8) {
+		crc ^= ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+		crc = table[7][crc >> 24] ^ table[6][(crc >> 16) & 0xff] ^
+			table[5][(crc >> 8) & 0xff] ^ table[4][crc & 0xff] ^
+			table[3][data[4]] ^ table[2][data[5]] ^
+			table[1][data[6]] ^ table[0][data[7]];
+		data += 8;
+		len -= 8;
+	}
+
+	while (len-- > 0)
+		crc = (crc << 8) ^ table[0][(crc >> 24) ^ *data++];
+
+	return crc;
+}
+
+uint32_t es2ts_crc32_mpeg_bitwise(const unsigned char *data, int len)
+{
+	uint32_t crc = 0xffffffff;
+
+	for (int i = 0; i < len; i++) {
+		crc ^= (uint32_t)data[i] << 24;
+		for (int bit = 0; bit < 8; bit++)
+			crc = (crc & 0x80000000) ? (crc << 1) ^ CRC32_POLY : (crc << 1);
+	}
+
+	return crc;
+}
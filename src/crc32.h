@@ -0,0 +1,41 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef ES2TS_CRC32_H
+#define ES2TS_CRC32_H
+
+/* CRC-32/MPEG-2 as PSI sections carry it: polynomial 0x04c11db7, MSB
+ * first, initial value 0xffffffff, no final xor.
+ */
+
+#include <stdint.h>
+
+/* Slicing-by-8, eight bytes per step through a 8KB table */
+uint32_t es2ts_crc32_mpeg(const unsigned char *data, int len);
+
+/* Bit at a time reference, for tests and benchmarks */
+uint32_t es2ts_crc32_mpeg_bitwise(const unsigned char *data, int len);
+
+#endif
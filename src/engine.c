@@ -0,0 +1,418 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "config.h"
+#include <libes2ts/es2ts.h>
+#include "engine.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+/* A fixed pool of workers shared by many native muxing contexts.
+ * Each worker owns a run queue of contexts that have pending input.
+ * A context is queued on its home worker when upstream enqueues data,
+ * workers that run dry steal from the back of their siblings' queues.
+ * Idle workers park on a single condition variable and are woken one
+ * at a time, so a burst of enqueues doesn't wake the whole pool. While
+ * any file descriptors are watched, one idle worker waits in epoll on
+ * them instead.
+ */
+
+struct es2ts_runq_s {
+	pthread_mutex_t lock;
+	struct xorg_list list;
+	int count;
+} __attribute__((aligned(64)));
+
+struct es2ts_worker_s {
+	struct es2ts_engine_s *engine;
+	pthread_t thread;
+	int nr;
+	struct es2ts_runq_s runq;
+};
+
+struct es2ts_watch_s {
+	struct xorg_list list;
+	struct es2ts_context_s *ctx;
+	int fd;
+};
+
+struct es2ts_engine_s {
+	int nthreads;
+	struct es2ts_worker_s *workers;
+	int next;		/* Round robin home worker for newly attached contexts */
+
+	pthread_mutex_t idlelock;
+	pthread_cond_t idlecond;
+	int idle;
+	int terminate;
+
+	/* Watched descriptors, polled by at most one idle worker */
+	int epollfd;
+	int pollwake;		/* eventfd, pulls the poller out of epoll_wait() */
+	int polling;		/* Under idlelock */
+	int watched;
+	pthread_mutex_t watchlock;
+	struct xorg_list watchlist;
+};
+
+static void runq_push(struct es2ts_runq_s *q, struct es2ts_context_s *ctx)
+{
+	pthread_mutex_lock(&q->lock);
+	xorg_list_append(&ctx->runlist, &q->list);
+	__atomic_add_fetch(&q->count, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* Owner takes from the front, thieves from the back */
+static struct es2ts_context_s *runq_pop(struct es2ts_runq_s *q, int steal)
+{
+	struct es2ts_context_s *ctx = 0;
+
+	if (__atomic_load_n(&q->count, __ATOMIC_RELAXED) == 0)
+		return 0;
+
+	pthread_mutex_lock(&q->lock);
+	if (!xorg_list_is_empty(&q->list)) {
+		if (steal)
+			ctx = xorg_list_last_entry(&q->list, struct es2ts_context_s, runlist);
+		else
+			ctx = xorg_list_first_entry(&q->list, struct es2ts_context_s, runlist);
+		xorg_list_del(&ctx->runlist);
+		__atomic_sub_fetch(&q->count, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return ctx;
+}
+
+static int engine_has_work(struct es2ts_engine_s *engine)
+{
+	for (int i = 0; i < engine->nthreads; i++) {
+		if (__atomic_load_n(&engine->workers[i].runq.count, __ATOMIC_SEQ_CST))
+			return 1;
+	}
+	return 0;
+}
+
+static void engine_pollwake(struct es2ts_engine_s *engine)
+{
+	uint64_t one = 1;
+
+	if (write(engine->pollwake, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		fprintf(stderr, "unable to wake the engine poller\n");
+}
+
+static void engine_notify(struct es2ts_engine_s *engine)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&engine->idle, __ATOMIC_RELAXED) == 0)
+		return;
+
+	pthread_mutex_lock(&engine->idlelock);
+	pthread_cond_signal(&engine->idlecond);
+	if (engine->polling)
+		engine_pollwake(engine);
+	pthread_mutex_unlock(&engine->idlelock);
+}
+
+void es2ts_engine_schedule(struct es2ts_engine_s *engine, struct es2ts_context_s *ctx)
+{
+	int state = __atomic_load_n(&ctx->sched, __ATOMIC_ACQUIRE);
+	int next;
+
+	do {
+		if (state != ENGINE_SCHED_IDLE && state != ENGINE_SCHED_RUNNING)
+			return;
+		next = (state == ENGINE_SCHED_IDLE) ? ENGINE_SCHED_QUEUED : ENGINE_SCHED_DIRTY;
+	} while (!__atomic_compare_exchange_n(&ctx->sched, &state, next, 0,
+		__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	/* A running context picks up the new input itself before going idle */
+	if (next == ENGINE_SCHED_QUEUED) {
+		runq_push(&engine->workers[ctx->engine_worker].runq, ctx);
+		engine_notify(engine);
+	}
+}
+
+static void engine_run(struct es2ts_worker_s *w, struct es2ts_context_s *ctx)
+{
+	__atomic_store_n(&ctx->sched, ENGINE_SCHED_RUNNING, __ATOMIC_RELEASE);
+
+	while (1) {
+		ES2TS_TRACE(TRACE_STEP_BEGIN, ctx, w - w->engine->workers, 0);
+		int ret = es2ts_process_step(ctx, ENGINE_QUANTUM);
+		ES2TS_TRACE(TRACE_STEP_END, ctx, ret, 0);
+		if (ret == ENGINE_STEP_DONE)
+			return;
+
+		if (ret == ENGINE_STEP_MORE) {
+			/* Be fair to the other contexts, go to the back of our queue */
+			__atomic_store_n(&ctx->sched, ENGINE_SCHED_QUEUED, __ATOMIC_RELEASE);
+			runq_push(&w->runq, ctx);
+			engine_notify(w->engine);
+			return;
+		}
+
+		int state = ENGINE_SCHED_RUNNING;
+		if (__atomic_compare_exchange_n(&ctx->sched, &state, ENGINE_SCHED_IDLE, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			return;
+
+		/* Input arrived while we were draining, go round again */
+		__atomic_store_n(&ctx->sched, ENGINE_SCHED_RUNNING, __ATOMIC_RELEASE);
+	}
+}
+
+/* Wait for a watched descriptor or a pollwake and schedule whoever has input */
+static void engine_poll(struct es2ts_engine_s *engine)
+{
+	struct epoll_event events[16];
+	uint64_t v;
+
+	int n = epoll_wait(engine->epollfd, events, 16, -1);
+	for (int i = 0; i < n; i++) {
+		int fd = events[i].data.fd;
+		if (fd == engine->pollwake) {
+			if (read(fd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+				fprintf(stderr, "unable to clear the engine poller\n");
+			continue;
+		}
+
+		/* Looked up rather than carried in the event, the context may be gone */
+		struct es2ts_watch_s *watch;
+		pthread_mutex_lock(&engine->watchlock);
+		xorg_list_for_each_entry(watch, &engine->watchlist, list) {
+			if (watch->fd != fd)
+				continue;
+			if (read(fd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+				fprintf(stderr, "unable to clear a watched descriptor\n");
+			es2ts_engine_schedule(engine, watch->ctx);
+			break;
+		}
+		pthread_mutex_unlock(&engine->watchlock);
+	}
+}
+
+static void *engine_worker(void *p)
+{
+	struct es2ts_worker_s *w = p;
+	struct es2ts_engine_s *engine = w->engine;
+
+	while (1) {
+		struct es2ts_context_s *ctx = runq_pop(&w->runq, 0);
+
+		for (int i = 1; !ctx && i < engine->nthreads; i++)
+			ctx = runq_pop(&engine->workers[(w->nr + i) % engine->nthreads].runq, 1);
+
+		if (ctx) {
+			engine_run(w, ctx);
+			continue;
+		}
+
+		pthread_mutex_lock(&engine->idlelock);
+		__atomic_add_fetch(&engine->idle, 1, __ATOMIC_SEQ_CST);
+		while (!engine->terminate && !engine_has_work(engine)) {
+			if (!engine->polling && __atomic_load_n(&engine->watched, __ATOMIC_RELAXED)) {
+				engine->polling = 1;
+				pthread_mutex_unlock(&engine->idlelock);
+				engine_poll(engine);
+				pthread_mutex_lock(&engine->idlelock);
+				engine->polling = 0;
+				continue;
+			}
+			pthread_cond_wait(&engine->idlecond, &engine->idlelock);
+		}
+		__atomic_sub_fetch(&engine->idle, 1, __ATOMIC_SEQ_CST);
+		int terminate = engine->terminate;
+		pthread_mutex_unlock(&engine->idlelock);
+
+		if (terminate)
+			break;
+	}
+
+	return NULL;
+}
+
+/* Reap the first count workers, the only ones started */
+static void engine_stop(struct es2ts_engine_s *engine, int count)
+{
+	pthread_mutex_lock(&engine->idlelock);
+	engine->terminate = 1;
+	pthread_cond_broadcast(&engine->idlecond);
+	if (engine->polling)
+		engine_pollwake(engine);
+	pthread_mutex_unlock(&engine->idlelock);
+
+	for (int i = 0; i < count; i++)
+		pthread_join(engine->workers[i].thread, NULL);
+
+	pthread_cond_destroy(&engine->idlecond);
+	pthread_mutex_destroy(&engine->idlelock);
+	pthread_mutex_destroy(&engine->watchlock);
+	close(engine->pollwake);
+	close(engine->epollfd);
+}
+
+int es2ts_engine_alloc(struct es2ts_engine_s **r, int nthreads)
+{
+	if ((!r) || (nthreads <= 0))
+		return ES2TS_INVALID_ARG;
+
+	struct es2ts_engine_s *engine = calloc(1, sizeof(*engine));
+	if (!engine)
+		return ES2TS_ERROR;
+
+	engine->workers = calloc(nthreads, sizeof(struct es2ts_worker_s));
+	if (!engine->workers) {
+		free(engine);
+		return ES2TS_ERROR;
+	}
+
+	struct epoll_event ev = { .events = EPOLLIN };
+	engine->epollfd = epoll_create1(EPOLL_CLOEXEC);
+	engine->pollwake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	ev.data.fd = engine->pollwake;
+	if (engine->epollfd < 0 || engine->pollwake < 0 ||
+		epoll_ctl(engine->epollfd, EPOLL_CTL_ADD, engine->pollwake, &ev) < 0) {
+		if (engine->epollfd >= 0)
+			close(engine->epollfd);
+		if (engine->pollwake >= 0)
+			close(engine->pollwake);
+		free(engine->workers);
+		free(engine);
+		return ES2TS_ERROR;
+	}
+
+	pthread_mutex_init(&engine->idlelock, NULL);
+	pthread_cond_init(&engine->idlecond, NULL);
+	pthread_mutex_init(&engine->watchlock, NULL);
+	xorg_list_init(&engine->watchlist);
+
+	for (int i = 0; i < nthreads; i++) {
+		struct es2ts_worker_s *w = &engine->workers[i];
+		w->engine = engine;
+		w->nr = i;
+		pthread_mutex_init(&w->runq.lock, NULL);
+		xorg_list_init(&w->runq.list);
+	}
+
+	/* Workers steal across every queue, the count is fixed before any runs */
+	engine->nthreads = nthreads;
+	for (int i = 0; i < nthreads; i++) {
+		if (pthread_create(&engine->workers[i].thread, NULL, engine_worker, &engine->workers[i]) != 0) {
+			fprintf(stderr, "unable to create engine worker %d\n", i);
+			engine_stop(engine, i);
+			free(engine->workers);
+			free(engine);
+			return ES2TS_ERROR;
+		}
+	}
+
+	*r = engine;
+	return ES2TS_OK;
+}
+
+int es2ts_engine_free(struct es2ts_engine_s *engine)
+{
+	if (!engine)
+		return ES2TS_INVALID_ARG;
+
+	engine_stop(engine, engine->nthreads);
+	free(engine->workers);
+	memset(engine, 0, sizeof(*engine));
+	free(engine);
+
+	return ES2TS_OK;
+}
+
+int es2ts_engine_attach(struct es2ts_engine_s *engine, struct es2ts_context_s *ctx)
+{
+	if ((!engine) || (!ctx))
+		return ES2TS_INVALID_ARG;
+
+	/* libavformat blocks inside av_read_frame(), only native contexts can share a worker.
+	 * MPTS streams ride along with their parent.
+	 */
+	if (!(ctx->flags & ES2TS_FLAG_NATIVE_MUX) || ctx->threadRunning || ctx->parent)
+		return ES2TS_INVALID_ARG;
+
+	ctx->engine = engine;
+	ctx->engine_worker = __atomic_fetch_add(&engine->next, 1, __ATOMIC_RELAXED) % engine->nthreads;
+	ctx->sched = ENGINE_SCHED_IDLE;
+	xorg_list_init(&ctx->runlist);
+
+	return ES2TS_OK;
+}
+
+int es2ts_engine_watch(struct es2ts_engine_s *engine, struct es2ts_context_s *ctx, int fd)
+{
+	struct es2ts_watch_s *watch = calloc(1, sizeof(*watch));
+	if (!watch)
+		return ES2TS_ERROR;
+	watch->ctx = ctx;
+	watch->fd = fd;
+
+	struct epoll_event ev = { .events = EPOLLIN };
+	ev.data.fd = fd;
+	pthread_mutex_lock(&engine->watchlock);
+	if (epoll_ctl(engine->epollfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		pthread_mutex_unlock(&engine->watchlock);
+		free(watch);
+		return ES2TS_ERROR;
+	}
+	xorg_list_append(&watch->list, &engine->watchlist);
+	__atomic_add_fetch(&engine->watched, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&engine->watchlock);
+
+	/* Workers already parked on the condition variable, one becomes the poller */
+	pthread_mutex_lock(&engine->idlelock);
+	pthread_cond_signal(&engine->idlecond);
+	pthread_mutex_unlock(&engine->idlelock);
+
+	return ES2TS_OK;
+}
+
+void es2ts_engine_unwatch(struct es2ts_engine_s *engine, struct es2ts_context_s *ctx)
+{
+	struct es2ts_watch_s *watch, *tmp;
+
+	pthread_mutex_lock(&engine->watchlock);
+	xorg_list_for_each_entry_safe(watch, tmp, &engine->watchlist, list) {
+		if (watch->ctx != ctx)
+			continue;
+		epoll_ctl(engine->epollfd, EPOLL_CTL_DEL, watch->fd, 0);
+		xorg_list_del(&watch->list);
+		__atomic_sub_fetch(&engine->watched, 1, __ATOMIC_RELAXED);
+		free(watch);
+	}
+	pthread_mutex_unlock(&engine->watchlock);
+}
@@ -0,0 +1,60 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef ES2TS_ENGINE_H
+#define ES2TS_ENGINE_H
+
+/* Internal interface between the shared worker pool and the contexts it runs. */
+
+#include <libes2ts/es2ts.h>
+
+/* es2ts_context_s.sched, who owns the context right now */
+#define ENGINE_SCHED_IDLE	0	/* Nothing pending, not on any run queue */
+#define ENGINE_SCHED_QUEUED	1	/* On a run queue, waiting for a worker */
+#define ENGINE_SCHED_RUNNING	2	/* A worker is draining it */
+#define ENGINE_SCHED_DIRTY	3	/* Running, and more input arrived meanwhile */
+#define ENGINE_SCHED_DONE	4	/* Torn down, never scheduled again */
+
+/* Return values of es2ts_process_step() */
+#define ENGINE_STEP_IDLE	0	/* Input drained */
+#define ENGINE_STEP_MORE	1	/* Budget used up, input may remain */
+#define ENGINE_STEP_DONE	2	/* Context terminated and torn down */
+
+/* Bytes of input a worker processes for one context before moving on */
+#define ENGINE_QUANTUM		(256 * 1024)
+
+/* Called from es2ts.c whenever an attached context may have work */
+void es2ts_engine_schedule(struct es2ts_engine_s *engine, struct es2ts_context_s *ctx);
+
+/* A file descriptor that turns readable when ctx has input, a shared
+ * memory doorbell. An idle worker polls it and schedules ctx.
+ */
+int es2ts_engine_watch(struct es2ts_engine_s *engine, struct es2ts_context_s *ctx, int fd);
+void es2ts_engine_unwatch(struct es2ts_engine_s *engine, struct es2ts_context_s *ctx);
+
+/* Implemented in es2ts.c, run a context for up to budget input bytes without blocking */
+int es2ts_process_step(struct es2ts_context_s *ctx, int budget);
+
+#endif
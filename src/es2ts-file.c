@@ -0,0 +1,78 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libes2ts/es2ts.h>
+
+/* Offline H264 elementary stream to transport stream conversion */
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [-f] [-j threads] input.h264 output.ts\n", prog);
+	printf("  -f  fast start, drop everything before the first IDR\n");
+	printf("  -j  mux GOP aligned segments on this many threads, 0 for one per CPU\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct es2ts_file_opts_s opts;
+	struct es2ts_file_stats_s stats;
+	int opt;
+
+	memset(&opts, 0, sizeof(opts));
+	while ((opt = getopt(argc, argv, "fj:h")) != -1) {
+		switch (opt) {
+		case 'f':
+			opts.flags |= ES2TS_FLAG_FAST_START;
+			break;
+		case 'j':
+			opts.threads = atoi(optarg);
+			if (opts.threads == 0)
+				opts.threads = -1;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (argc - optind != 2) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (ES2TS_FAILED(es2ts_file_transmux(argv[optind], argv[optind + 1], &opts, &stats)))
+		return 1;
+
+	double secs = stats.elapsed_ns / 1e9;
+	printf("%s: %.1f MB in, %.1f MB out, %llu frames, %.3f s, %.1f MB/s\n",
+		argv[optind + 1], stats.bytes_in / 1e6, stats.bytes_out / 1e6,
+		(unsigned long long)stats.frames, secs, secs > 0 ? stats.bytes_in / 1e6 / secs : 0.0);
+
+	return 0;
+}
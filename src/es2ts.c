@@ -28,11 +28,24 @@
 
 #include "config.h"
 #include <libes2ts/es2ts.h>
+#include "audio.h"
+#include "engine.h"
+#include "h264.h"
+#include "nal.h"
+#include "ring.h"
+#include "shm.h"
+#include "stats.h"
+#include "trace.h"
+#include "tsmux.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <sys/time.h>
 
 /* Compatibility with older versions of ffmpeg */
@@ -41,25 +54,49 @@
 # define AV_CODEC_ID_AC3 CODEC_ID_AC3
 #endif
 
+/* TS packets per output callback, seven fill a typical 1500 byte MTU */
+#define DEFAULT_BURST	7
+
 #define MAX_BUFFERS	256
 #define MAX_BUFFER_SIZE 32768
 
-int es2ts_debug = 0;
+/* Upstream to worker transport, same capacity as the old 256 x 32KB buffer pool */
+#define RING_SIZE	(MAX_BUFFERS * MAX_BUFFER_SIZE)
+#define DESC_RING_SIZE	(4096 * sizeof(struct es2ts_desc_s))
 
-struct es2ts_buffer_s {
-	struct xorg_list list;
-	int nr;
+/* Each es2ts_producer_alloc() queue */
+#define PRODUCER_RING_SIZE	(RING_SIZE / 4)
+#define PRODUCER_DESC_RING_SIZE	(1024 * sizeof(struct es2ts_desc_s))
 
-	unsigned char *ptr;
-	unsigned int maxlen;
-	unsigned int usedlen;
-	unsigned int readptr;
+struct es2ts_producer_s {
+	struct es2ts_context_s *ctx;
+	struct es2ts_ring_s *ring;
+	struct es2ts_ring_s *descring;
+
+	/* Worker owned, the oldest descriptor taken out of descring */
+	struct es2ts_desc_s head;
+	int headvalid;
 };
 
-static struct es2ts_buffer_s *es2ts_buffer_alloc(int nr, unsigned int size);
-static void es2ts_buffer_free(struct es2ts_buffer_s *buf);
-static void es2ts_buffer_recycle(struct es2ts_buffer_s *buf);
+/* Native muxer: bytes pulled per dequeue, and the fixed frame clock (90KHz) in
+ * the absence of upstream timestamps, 30fps to match the libavformat path.
+ */
+#define NATIVE_READ_SIZE	MAX_BUFFER_SIZE
+#define NATIVE_FRAME_DURATION	(90000 / 30)
+
+/* MPTS streams take smaller bites so they interleave finely by timestamp,
+ * a few audio frames or a fraction of a second of video at a time
+ */
+#define NATIVE_AUDIO_READ_SIZE	2048
+#define NATIVE_MPTS_READ_SIZE	8192
+
+int es2ts_debug = 0;
+
 static int es2ts_data_dequeue(struct es2ts_context_s *ctx, unsigned char *data, int len);
+static void es2ts_data_wait(struct es2ts_context_s *ctx);
+static void es2ts_data_space(struct es2ts_context_s *ctx);
+static struct es2ts_desc_s *es2ts_data_peek(struct es2ts_context_s *ctx);
+static int es2ts_data_ready(struct es2ts_context_s *ctx);
 
 static const char *now(void)
 {
@@ -70,6 +107,49 @@ static const char *now(void)
 	return result;
 }
 
+/* Worker thread: ns to leave out of the stage being timed. Per thread rather
+ * than per context, an MPTS stream's mux stage nests its parent's callback.
+ */
+static __thread int64_t stats_excl;
+
+/* Time a stage from start, leaving out whatever nested work added to
+ * stats_excl meanwhile, then exclude the whole stage from its parent.
+ */
+static void stats_stage(struct es2ts_histogram_s *h, int64_t start, int64_t excl)
+{
+	int64_t dt = es2ts_stats_now() - start;
+	es2ts_histogram_record(h, dt - (stats_excl - excl));
+	stats_excl = excl + dt;
+}
+
+/* Bytes accepted from upstream, the first since start begins the time to first packet */
+static void stats_input(struct es2ts_context_s *ctx, int len, int64_t when)
+{
+	es2ts_stats_add(&ctx->stats.bytes_in, len);
+
+	/* The output, and with it the first packet, belongs to an MPTS stream's parent */
+	if (ctx->parent)
+		ctx = ctx->parent;
+
+	if (__atomic_load_n(&ctx->first_in, __ATOMIC_RELAXED) == 0) {
+		int64_t unset = 0;
+		__atomic_compare_exchange_n(&ctx->first_in, &unset, when, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	}
+}
+
+/* TS bytes handed downstream */
+static void stats_output(struct es2ts_context_s *ctx, size_t len)
+{
+	es2ts_stats_add(&ctx->stats.bytes_out, len);
+
+	if (ctx->stats.first_packet == 0) {
+		int64_t first = __atomic_load_n(&ctx->first_in, __ATOMIC_RELAXED);
+		int64_t dt = es2ts_stats_now() - first;
+		if (first)
+			__atomic_store_n(&ctx->stats.first_packet, dt > 0 ? dt : 1, __ATOMIC_RELAXED);
+	}
+}
+
 /* Read a buffer of payload (H264 nals) from an upstream source.
  * This is a blocking read routine. If we don't block libavformat eventually
  * segfaults after huge memory allocations.
@@ -77,37 +157,78 @@ static const char *now(void)
 static int ReadFunc(void *opaque, uint8_t *buf, int buf_size)
 {
 	struct es2ts_context_s *ctx = opaque;
-	if (es2ts_debug)
-		fprintf(stderr, "%s: %s(%p, %p, %d)\n", now(), __func__, ctx, buf, buf_size);
 
+	int ret = 0;
 	while (1) {
 		if (ctx->threadTerminate)
 			break;
 
-		int ret = es2ts_data_dequeue(ctx, buf, buf_size);
+		ret = es2ts_data_dequeue(ctx, buf, buf_size);
 		if (ES2TS_FAILED(ret)) {
 			//return AVERROR_EOF;
-			usleep(10 * 1000);
+			ret = 0;
+			es2ts_data_wait(ctx);
 			continue;
 		}
 
 		break;
 	}
-	if (es2ts_debug)
-		fprintf(stderr, "%s: %s(%p) complete %d bytes\n", now(), __func__, ctx, buf_size);
 
-	return buf_size;
+	return ret;
 }
 
 /* Write a buffer of payload (TS packets) to a downstream buffer */
 static int WriteFunc(void *opaque, uint8_t *buf, int buf_size)
 {
-	if (es2ts_debug)
-		fprintf(stderr, "%s: %s(%p, %p, %d)\n", now(), __func__, opaque, buf, buf_size);
 	struct es2ts_context_s *ctx = opaque;
 	if (ctx->threadTerminate)
 		return ES2TS_OK;
-	return ctx->cb(ctx, buf, buf_size);
+
+	ES2TS_TRACE(TRACE_CALLBACK_BEGIN, ctx, buf_size, 0);
+	int64_t excl = stats_excl;
+	int64_t start = es2ts_stats_now();
+	int ret;
+	if (ctx->cbv) {
+		struct iovec iov = { buf, buf_size };
+		ret = ctx->cbv(ctx, &iov, 1);
+	} else
+		ret = ctx->cb(ctx, buf, buf_size);
+	stats_stage(&ctx->stats.callback, start, excl);
+	ES2TS_TRACE(TRACE_CALLBACK_END, ctx, 0, 0);
+	stats_output(ctx, buf_size);
+
+	return ret;
+}
+
+/* Write runs of TS packets from the native muxer, one iovec per burst */
+static int WriteFuncV(void *opaque, const struct iovec *iov, int iovcnt)
+{
+	struct es2ts_context_s *ctx = opaque;
+	if (ctx->threadTerminate && !ctx->threadFlushing)
+		return ES2TS_OK;
+
+	size_t len = 0;
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	ES2TS_TRACE(TRACE_CALLBACK_BEGIN, ctx, len, 0);
+	int64_t excl = stats_excl;
+	int64_t start = es2ts_stats_now();
+	int ret = ES2TS_OK;
+	if (ctx->cbv)
+		ret = ctx->cbv(ctx, iov, iovcnt);
+	else {
+		for (int i = 0; i < iovcnt; i++) {
+			ret = ctx->cb(ctx, iov[i].iov_base, iov[i].iov_len);
+			if (ES2TS_FAILED(ret))
+				break;
+		}
+	}
+	stats_stage(&ctx->stats.callback, start, excl);
+	ES2TS_TRACE(TRACE_CALLBACK_END, ctx, 0, 0);
+	stats_output(ctx, len);
+
+	return ret;
 }
 
 /* Create the output formatted stream, based on the original input stream object */
@@ -194,10 +315,85 @@ static AVStream *add_output_stream(AVFormatContext *ofc, AVStream *input_stream)
 	return output_stream;
 }
 
+/* ES2TS_FLAG_FAST_START output stream, described by the SPS rather than a probe */
+static AVStream *add_output_stream_sps(AVFormatContext *ofc, struct es2ts_h264_sps_s *sps)
+{
+	AVCodecContext *occ;
+	AVStream *output_stream;
+
+	output_stream = avformat_new_stream(ofc, 0);
+	if (!output_stream) {
+		fprintf(stderr, "Could not allocate stream\n");
+		return 0;
+	}
+
+	occ = output_stream->codec;
+	occ->codec_id = AV_CODEC_ID_H264;
+	occ->codec_type = AVMEDIA_TYPE_VIDEO;
+	occ->width = sps->width;
+	occ->height = sps->height;
+	occ->profile = sps->profile_idc;
+	occ->level = sps->level_idc;
+
+	/* Same fixed 30fps time base as add_output_stream(), packets are stamped to match */
+	occ->time_base.den = 30;
+	occ->time_base.num = 1;
+	occ->ticks_per_frame = 1;
+	output_stream->time_base.den = 30;
+	output_stream->time_base.num = 1;
+
+	return output_stream;
+}
+
+/* The rest of process_setup() happens in process_output_start() once the first SPS arrives */
+static int process_setup_fast(struct es2ts_context_s *ctx)
+{
+	ctx->fmt = av_guess_format("mpegts", NULL, NULL);
+	if (!ctx->fmt) {
+		fprintf(stderr, "av_guess_format\n");
+		return ES2TS_ERROR;
+	}
+	ctx->octx->oformat = ctx->fmt;
+
+	ctx->video_st = 0;
+	ctx->frames = 0;
+	ctx->clk = 0;
+
+	return ES2TS_OK;
+}
+
+/* Fast start: look for an SPS in the first packets, describe the output from it
+ * and write the headers. Returns ES2TS_NO_RESOURCE while there's no SPS yet.
+ */
+static int process_output_start(struct es2ts_context_s *ctx, AVPacket *packet)
+{
+	struct es2ts_h264_sps_s sps;
+	int len;
+
+	const unsigned char *nal = es2ts_h264_nal_find(packet->data, packet->size, NAL_TYPE_SPS, &len);
+	if (!nal || ES2TS_FAILED(es2ts_h264_sps_parse(nal, len, &sps)))
+		return ES2TS_NO_RESOURCE;
+
+	ctx->frame_rate.num = sps.fps_num ? sps.fps_num : 30;
+	ctx->frame_rate.den = sps.fps_num ? sps.fps_den : 1;
+
+	ctx->video_st = add_output_stream_sps(ctx->octx, &sps);
+	if (!ctx->video_st)
+		return ES2TS_ERROR;
+
+	if (es2ts_debug)
+		fprintf(stderr, "%s: %s(%p) %dx%d profile %d level %d %d/%d fps\n", now(), __func__, ctx,
+			sps.width, sps.height, sps.profile_idc, sps.level_idc, ctx->frame_rate.num, ctx->frame_rate.den);
+
+	avformat_write_header(ctx->octx, 0);
+
+	return ES2TS_OK;
+}
+
 static int process_setup(struct es2ts_context_s *ctx)
 {
         int iReadBufSize = 7 * 188;
-        int iWriteBufSize = 7 * 188;
+        int iWriteBufSize = ctx->burst * 188;
 	int ret;
 
 	av_register_all();
@@ -241,11 +437,23 @@ static int process_setup(struct es2ts_context_s *ctx)
 
 	/* Map the custom streaming read function into the input context */
 	ctx->ictx->pb = ctx->pIOReadCtx;
-	ret = avformat_open_input(&ctx->ictx, "/tmp/dummy18491874", NULL, NULL);
+
+	AVInputFormat *ifmt = 0;
+	if (ctx->flags & ES2TS_FLAG_FAST_START) {
+		/* We know it's raw H264, don't wait on data to guess */
+		ifmt = av_find_input_format("h264");
+		ctx->ictx->probesize = 32;
+		ctx->ictx->fps_probe_size = 0;
+		ctx->ictx->max_analyze_duration = 0;
+	}
+	ret = avformat_open_input(&ctx->ictx, "/tmp/dummy18491874", ifmt, NULL);
 
 	/* And the output writing function also */
 	ctx->octx->pb = ctx->pIOWriteCtx;
 
+	if (ctx->flags & ES2TS_FLAG_FAST_START)
+		return process_setup_fast(ctx);
+
 	/* Query the input stream details */
 	ctx->options = NULL;
 	ret = avformat_find_stream_info(ctx->ictx, &ctx->options);
@@ -290,16 +498,61 @@ static int process_setup(struct es2ts_context_s *ctx)
 	return ES2TS_OK;
 }
 
+/* es2ts_frame_enqueue() timestamps, queued as frames are read by libavformat and
+ * consumed as it returns packets. The raw H264 demuxer yields one packet per
+ * access unit, in order, so the two line up.
+ */
+static void timing_push(struct es2ts_context_s *ctx, struct es2ts_desc_s *desc)
+{
+	if (ctx->timing_head - ctx->timing_tail == ES2TS_TIMING_MAX)
+		ctx->timing_tail++;
+
+	struct es2ts_timing_s *t = &ctx->timing[ctx->timing_head++ & (ES2TS_TIMING_MAX - 1)];
+	t->pts = desc->pts;
+	t->dts = desc->dts;
+	t->flags = desc->frameflags;
+}
+
+static int timing_pop(struct es2ts_context_s *ctx, struct es2ts_timing_s *t)
+{
+	if (ctx->timing_head == ctx->timing_tail)
+		return 0;
+
+	*t = ctx->timing[ctx->timing_tail++ & (ES2TS_TIMING_MAX - 1)];
+	return 1;
+}
+
 static int process_packet(struct es2ts_context_s *ctx, int *done)
 {
 	int ret = ES2TS_OK;
 
 	AVPacket packet;
 	av_init_packet(&packet);
+	ES2TS_TRACE(TRACE_DEMUX_BEGIN, ctx, 0, 0);
+	int64_t excl = stats_excl;
+	int64_t start = es2ts_stats_now();
 	*done = av_read_frame(ctx->ictx, &packet);
+	stats_stage(&ctx->stats.demux, start, excl);
+	ES2TS_TRACE(TRACE_DEMUX_END, ctx, packet.size, 0);
 	if (*done)
 		return ES2TS_OK;
 
+	if (!ctx->video_st) {
+		/* Fast start, nothing before the first SPS is decodable */
+		ret = process_output_start(ctx, &packet);
+		if (ret == ES2TS_NO_RESOURCE) {
+			/* Its timestamps go with it, or every later frame takes an earlier one's */
+			struct es2ts_timing_s skipped;
+			timing_pop(ctx, &skipped);
+			av_free_packet(&packet);
+			return ES2TS_OK;
+		}
+		if (ES2TS_FAILED(ret)) {
+			av_free_packet(&packet);
+			return ret;
+		}
+	}
+
 	//ctx->clk += 2000; /* No errors at 2000 but video stalls */
 
 	//ctx->clk += 3000; /* really close at 30fps (105ms) */
@@ -318,17 +571,43 @@ static int process_packet(struct es2ts_context_s *ctx, int *done)
 //	packet.duration = duration;
 
 	AVStream *outStream = ctx->octx->streams[0];
-	if (packet.pts != (int64_t)AV_NOPTS_VALUE) {
-		packet.pts =  av_rescale_q(packet.pts,  outStream->codec->time_base, outStream->time_base);
-		printf("pts\n");
-	}
+	struct es2ts_timing_s timing;
+	if (timing_pop(ctx, &timing)) {
+		/* Upstream stamped this frame, use that rather than guess */
+		AVRational tb = { 1, 90000 };
+		packet.pts = av_rescale_q(timing.pts, tb, outStream->time_base);
+		packet.dts = av_rescale_q(timing.dts, tb, outStream->time_base);
+		if (timing.flags & ES2TS_FRAME_KEY)
+			packet.flags |= AV_PKT_FLAG_KEY;
+	} else if (ctx->flags & ES2TS_FLAG_FAST_START) {
+		/* Nothing was probed, count frames at the SPS frame rate */
+		AVRational tb = { ctx->frame_rate.den, ctx->frame_rate.num };
+		packet.pts = av_rescale_q(ctx->frames++, tb, outStream->time_base);
+		packet.dts = packet.pts;
+	} else {
+		if (packet.pts != (int64_t)AV_NOPTS_VALUE) {
+			packet.pts =  av_rescale_q(packet.pts,  outStream->codec->time_base, outStream->time_base);
+			printf("pts\n");
+		}
 
-	if (packet.dts != (int64_t)AV_NOPTS_VALUE) {
-		packet.dts = av_rescale_q(packet.dts, outStream->codec->time_base, outStream->time_base);
-		printf("dts\n");
+		if (packet.dts != (int64_t)AV_NOPTS_VALUE) {
+			packet.dts = av_rescale_q(packet.dts, outStream->codec->time_base, outStream->time_base);
+			printf("dts\n");
+		}
 	}
 
-	ret = av_interleaved_write_frame(ctx->octx, &packet);
+	ES2TS_TRACE(TRACE_MUX_BEGIN, ctx, packet.size, packet.pts);
+	excl = stats_excl;
+	start = es2ts_stats_now();
+	if (ctx->flags & ES2TS_FLAG_LOW_LATENCY) {
+		/* Single stream, nothing to interleave. Push out the partial burst too. */
+		ret = av_write_frame(ctx->octx, &packet);
+		if (ret >= 0)
+			avio_flush(ctx->octx->pb);
+	} else
+		ret = av_interleaved_write_frame(ctx->octx, &packet);
+	stats_stage(&ctx->stats.mux, start, excl);
+	ES2TS_TRACE(TRACE_MUX_END, ctx, 0, 0);
 	if (ret < 0) {
 		fprintf(stderr, "write error\n");
 		ret = ES2TS_ERROR;
@@ -345,64 +624,285 @@ static void process_teardown(struct es2ts_context_s *ctx)
 	avformat_close_input(&ctx->ictx);
 }
 
-static struct es2ts_buffer_s *es2ts_buffer_alloc(int nr, unsigned int size)
+/* Fast start: the output opens with PAT/PMT and an IDR, drop what comes before */
+static int native_startable(struct es2ts_context_s *ctx, int keyframe)
 {
-	struct es2ts_buffer_s *buf = calloc(1, sizeof(*buf));
+	if (!ctx->started && (keyframe || !(ctx->flags & ES2TS_FLAG_FAST_START)))
+		ctx->started = 1;
 
-	if (!buf)
-		return 0;
+	return ctx->started;
+}
+
+/* One complete access unit from the NAL or audio splitter, stamp it and packetize */
+static int native_au(void *opaque, unsigned char *au, int len, int keyframe)
+{
+	struct es2ts_context_s *ctx = opaque;
+
+	if (!native_startable(ctx, keyframe))
+		return ES2TS_OK;
+
+	/* Video counts frames, audio counts samples at the rate in the frame header */
+	int64_t ts;
+	if (ctx->audio) {
+		ts = ctx->clk * 90000 / ctx->audio->rate;
+		ctx->clk += ctx->audio->samples;
+	} else {
+		ts = ctx->clk * NATIVE_FRAME_DURATION;
+		ctx->clk++;
+	}
+	ctx->dts_last = ts;
+
+	ES2TS_TRACE(TRACE_MUX_BEGIN, ctx, len, ts);
+	int64_t excl = stats_excl;
+	int64_t start = es2ts_stats_now();
+	int ret = es2ts_tsmux_write_au(ctx->tsmux, ctx->tsstream, au, len, ts, ts, keyframe);
+	stats_stage(&ctx->stats.mux, start, excl);
+	ES2TS_TRACE(TRACE_MUX_END, ctx, 0, 0);
+
+	return ret;
+}
+
+/* The splitter of ctx, NAL for video or audio frames */
+static unsigned char *native_reserve(struct es2ts_context_s *ctx, int len)
+{
+	if (ctx->audio)
+		return es2ts_audio_reserve(ctx->audio, len);
+	return es2ts_nal_reserve(ctx->nal, len);
+}
+
+static int native_commit(struct es2ts_context_s *ctx, int len)
+{
+	if (ctx->audio)
+		return es2ts_audio_commit(ctx->audio, len, native_au, ctx);
+	return es2ts_nal_commit(ctx->nal, len, native_au, ctx);
+}
+
+static int native_flush(struct es2ts_context_s *ctx)
+{
+	if (ctx->audio) {
+		es2ts_audio_flush(ctx->audio);
+		return ES2TS_OK;
+	}
+	return es2ts_nal_flush(ctx->nal, native_au, ctx);
+}
+
+/* Splitter and mux stream for one elementary stream, ctx itself or an MPTS stream */
+static int process_setup_stream(struct es2ts_context_s *ctx, struct es2ts_tsmux_s *tsmux,
+	int program, int stream_type)
+{
+	if (stream_type == ES2TS_STREAM_TYPE_H264) {
+		if (ES2TS_FAILED(es2ts_nal_alloc(&ctx->nal))) {
+			fprintf(stderr, "unable to allocate nal splitter\n");
+			return ES2TS_ERROR;
+		}
+	} else if (ES2TS_FAILED(es2ts_audio_alloc(&ctx->audio, stream_type))) {
+		fprintf(stderr, "unable to allocate audio splitter\n");
+		return ES2TS_ERROR;
+	}
 
-	buf->nr = nr;
-	buf->ptr = calloc(1, size);
-	buf->maxlen = size;
-	buf->usedlen = 0;
-	buf->readptr = 0;
+	ctx->tsmux = tsmux;
+	if (ES2TS_FAILED(es2ts_tsmux_stream_add(tsmux, program, stream_type, &ctx->tsstream))) {
+		fprintf(stderr, "unable to add program %d stream type 0x%02x\n", program, stream_type);
+		return ES2TS_ERROR;
+	}
 
-	return buf;
+	ctx->clk = 0;
+	ctx->dts_last = INT64_MIN;
+	ctx->started = 0;
+
+	return ES2TS_OK;
 }
 
-static void es2ts_buffer_free(struct es2ts_buffer_s *buf)
+static int process_setup_native(struct es2ts_context_s *ctx)
 {
+	struct es2ts_tsmux_s *tsmux;
+
+	if (ES2TS_FAILED(es2ts_tsmux_alloc(&tsmux, ctx->burst, WriteFuncV, ctx))) {
+		fprintf(stderr, "unable to allocate ts muxer\n");
+		return ES2TS_ERROR;
+	}
+	ctx->tsmux = tsmux;
+	tsmux->flush_au = !!(ctx->flags & ES2TS_FLAG_LOW_LATENCY);
+
+	if (ctx->stream_count == 0)
+		return process_setup_stream(ctx, tsmux, TS_PROGRAM_NUMBER, TS_STREAM_TYPE_H264);
+
+	for (int i = 0; i < ctx->stream_count; i++) {
+		struct es2ts_context_s *stream = ctx->streams[i];
+		if (ES2TS_FAILED(process_setup_stream(stream, tsmux, stream->program, stream->stream_type)))
+			return ES2TS_ERROR;
+	}
+
+	return ES2TS_OK;
+}
+
+/* A whole access unit from es2ts_frame_enqueue(), bypass the splitter */
+static int process_frame_native(struct es2ts_context_s *ctx, struct es2ts_desc_s *desc)
+{
+	int64_t pts = desc->pts;
+	int64_t dts = desc->dts;
+	int key = desc->frameflags & ES2TS_FRAME_KEY;
+	int len = desc->len;
+
+	/* Anything the splitter holds from es2ts_data_enqueue() ends here */
+	int ret = native_flush(ctx);
+	if (ES2TS_FAILED(ret))
+		return ret;
+
+	/* The empty splitter buffer doubles as frame scratch space */
+	unsigned char *buf = native_reserve(ctx, len);
 	if (!buf)
-		return;
+		return ES2TS_ERROR;
+
+	len = es2ts_data_dequeue(ctx, buf, len);
+	if (ES2TS_FAILED(len))
+		return len;
+
+	/* Every audio frame is a random access point */
+	if (ctx->audio)
+		key = 1;
+	if (!native_startable(ctx, key))
+		return len;
+	ctx->dts_last = dts;
+
+	ES2TS_TRACE(TRACE_MUX_BEGIN, ctx, len, pts);
+	int64_t excl = stats_excl;
+	int64_t start = es2ts_stats_now();
+	ret = es2ts_tsmux_write_au(ctx->tsmux, ctx->tsstream, buf, len, pts, dts, key);
+	stats_stage(&ctx->stats.mux, start, excl);
+	ES2TS_TRACE(TRACE_MUX_END, ctx, 0, 0);
+	if (ES2TS_FAILED(ret))
+		return ret;
+
+	return len;
+}
+
+static int process_packet_stream(struct es2ts_context_s *ctx)
+{
+	struct es2ts_desc_s *desc = es2ts_data_peek(ctx);
+	if (!desc)
+		return ES2TS_NO_RESOURCE;
+	if (desc->frame && ctx->descrem == desc->len)
+		return process_frame_native(ctx, desc);
+
+	/* Dequeue straight into the splitter, no intermediate read buffer */
+	int readlen = NATIVE_READ_SIZE;
+	if (ctx->audio)
+		readlen = NATIVE_AUDIO_READ_SIZE;
+	else if (ctx->parent)
+		readlen = NATIVE_MPTS_READ_SIZE;
+	unsigned char *buf = native_reserve(ctx, readlen);
+	if (!buf)
+		return ES2TS_ERROR;
+
+	/* ES2TS_NO_RESOURCE when idle, the caller decides whether to block */
+	int len = es2ts_data_dequeue(ctx, buf, readlen);
+	if (ES2TS_FAILED(len))
+		return len;
+
+	ES2TS_TRACE(TRACE_DEMUX_BEGIN, ctx, 0, 0);
+	int64_t excl = stats_excl;
+	int64_t start = es2ts_stats_now();
+	int ret = native_commit(ctx, len);
+	stats_stage(&ctx->stats.demux, start, excl);
+	ES2TS_TRACE(TRACE_DEMUX_END, ctx, len, 0);
+	if (ES2TS_FAILED(ret))
+		return ret;
+
+	return len;
+}
 
-	if (buf->ptr) {
-		memset(buf->ptr, 0, buf->maxlen);
-		free(buf->ptr);
+static int process_packet_native(struct es2ts_context_s *ctx, int *done)
+{
+	*done = 0;
+
+	if (ctx->stream_count == 0)
+		return process_packet_stream(ctx);
+
+	/* Interleave by timestamp, a read from whichever stream with input pending
+	 * is furthest behind
+	 */
+	struct es2ts_context_s *next = 0;
+	for (int i = 0; i < ctx->stream_count; i++) {
+		struct es2ts_context_s *stream = ctx->streams[i];
+		if (es2ts_data_ready(stream) && (!next || stream->dts_last < next->dts_last))
+			next = stream;
 	}
+	if (!next)
+		return ES2TS_NO_RESOURCE;
 
-	memset(buf, 0, sizeof(*buf));
-	free(buf);
+	return process_packet_stream(next);
 }
 
-static void es2ts_buffer_recycle(struct es2ts_buffer_s *buf)
+static void process_teardown_stream(struct es2ts_context_s *ctx)
 {
-	if ((!buf) || (!buf->ptr))
-		return;
+	if ((ctx->nal || ctx->audio) && ctx->tsstream)
+		native_flush(ctx);
+
+	es2ts_nal_free(ctx->nal);
+	ctx->nal = 0;
+	es2ts_audio_free(ctx->audio);
+	ctx->audio = 0;
+	ctx->tsstream = 0;
+}
 
-	memset(buf->ptr, 0, buf->maxlen);
-	buf->usedlen = 0;
-	buf->readptr = 0;
+static void process_teardown_native(struct es2ts_context_s *ctx)
+{
+	/* Input stopped, but what's still parsed or buffered goes out */
+	ctx->threadFlushing = 1;
+	process_teardown_stream(ctx);
+	for (int i = 0; i < ctx->stream_count; i++) {
+		process_teardown_stream(ctx->streams[i]);
+		ctx->streams[i]->tsmux = 0;
+	}
+
+	if (ctx->tsmux)
+		es2ts_tsmux_flush(ctx->tsmux);
+	es2ts_tsmux_free(ctx->tsmux);
+	ctx->tsmux = 0;
+	ctx->threadFlushing = 0;
 }
 
 int es2ts_alloc(struct es2ts_context_s **r)
+{
+	return es2ts_alloc_flags(r, 0);
+}
+
+int es2ts_alloc_flags(struct es2ts_context_s **r, unsigned int flags)
 {
 	struct es2ts_context_s *ctx = calloc(1, sizeof(struct es2ts_context_s));
 	if (!ctx)
 		return ES2TS_ERROR;
 
-	pthread_mutex_init(&ctx->listlock, NULL);
-	xorg_list_init(&ctx->listfree);
-	xorg_list_init(&ctx->listbusy);
-
-	/* Allocate all buffers */
-	for (int i = 0; i < MAX_BUFFERS; i++) {
-		struct es2ts_buffer_s *buf = es2ts_buffer_alloc(i, MAX_BUFFER_SIZE);
-		if (buf) {
-			pthread_mutex_lock(&ctx->listlock);
-			xorg_list_add(&buf->list, &ctx->listfree);
-			pthread_mutex_unlock(&ctx->listlock);
-		}
+	ctx->flags = flags;
+	ctx->burst = DEFAULT_BURST;
+	ctx->stats.queue_free_min = RING_SIZE;
+
+	pthread_mutex_init(&ctx->waitlock, NULL);
+	pthread_cond_init(&ctx->waitcond, NULL);
+
+	/* Enqueue timeouts are relative, keep wall clock steps out of them */
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&ctx->spacecond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if (es2ts_ring_alloc(&ctx->ring, RING_SIZE) < 0) {
+		free(ctx);
+		return ES2TS_NO_RESOURCE;
+	}
+	if (es2ts_ring_alloc(&ctx->descring, DESC_RING_SIZE) < 0) {
+		es2ts_ring_free(ctx->ring);
+		free(ctx);
+		return ES2TS_NO_RESOURCE;
+	}
+	ctx->timing = calloc(ES2TS_TIMING_MAX, sizeof(struct es2ts_timing_s));
+	if (!ctx->timing) {
+		es2ts_ring_free(ctx->descring);
+		es2ts_ring_free(ctx->ring);
+		free(ctx);
+		return ES2TS_NO_RESOURCE;
 	}
 
 	*r = ctx;
@@ -412,22 +912,35 @@ int es2ts_alloc(struct es2ts_context_s **r)
 
 int es2ts_free(struct es2ts_context_s *ctx)
 {
-	struct es2ts_buffer_s *buf;
 	if (!ctx)
 		return ES2TS_INVALID_ARG;
 
-	pthread_mutex_lock(&ctx->listlock);
-	while (xorg_list_is_empty(&ctx->listfree) == 0) {
-		buf = xorg_list_first_entry(&ctx->listfree, struct es2ts_buffer_s, list);
-		xorg_list_del(&buf->list);
-		es2ts_buffer_free(buf);
+	/* Hand back any referenced buffers the worker never got to */
+	if (ctx->descrem && ctx->desc.type == ES2TS_DESC_REF && ctx->desc.release)
+		ctx->desc.release(ctx, ctx->desc.ptr, ctx->desc.len, ctx->desc.opaque);
+	while (es2ts_ring_read(ctx->descring, (unsigned char *)&ctx->desc, sizeof(ctx->desc))) {
+		if (ctx->desc.type == ES2TS_DESC_REF && ctx->desc.release)
+			ctx->desc.release(ctx, ctx->desc.ptr, ctx->desc.len, ctx->desc.opaque);
 	}
-	while (xorg_list_is_empty(&ctx->listbusy) == 0) {
-		buf = xorg_list_first_entry(&ctx->listbusy, struct es2ts_buffer_s, list);
-		xorg_list_del(&buf->list);
-		es2ts_buffer_free(buf);
+
+	for (int i = 0; i < ctx->producer_count; i++) {
+		es2ts_ring_free(ctx->producers[i]->descring);
+		es2ts_ring_free(ctx->producers[i]->ring);
+		free(ctx->producers[i]);
 	}
-	pthread_mutex_unlock(&ctx->listlock);
+
+	for (int i = 0; i < ctx->stream_count; i++) {
+		es2ts_free(ctx->streams[i]);
+		free(ctx->streams[i]);
+	}
+
+	es2ts_shm_destroy(ctx->shm);
+	es2ts_ring_free(ctx->descring);
+	es2ts_ring_free(ctx->ring);
+	free(ctx->timing);
+	pthread_cond_destroy(&ctx->waitcond);
+	pthread_cond_destroy(&ctx->spacecond);
+	pthread_mutex_destroy(&ctx->waitlock);
 
 	memset(ctx, 0, sizeof(*ctx));
 
@@ -443,112 +956,526 @@ int es2ts_callback_register(struct es2ts_context_s *ctx, es2ts_callback cb)
 	return ES2TS_OK;
 }
 
+int es2ts_callback_register_v(struct es2ts_context_s *ctx, es2ts_callback_v cbv)
+{
+	if ((!ctx) || (!cbv))
+		return ES2TS_INVALID_ARG;
+
+	ctx->cbv = cbv;
+	return ES2TS_OK;
+}
+
 int es2ts_callback_unregister(struct es2ts_context_s *ctx)
 {
 	if (!ctx)
 		return ES2TS_INVALID_ARG;
 
 	ctx->cb = 0;
+	ctx->cbv = 0;
+	return ES2TS_OK;
+}
+
+int es2ts_output_burst_set(struct es2ts_context_s *ctx, int packets)
+{
+	if ((!ctx) || (packets <= 0) || (packets > MAX_BUFFER_SIZE / 188))
+		return ES2TS_INVALID_ARG;
+
+	/* Buffers are sized in es2ts_process_start() */
+	if (ctx->threadRunning)
+		return ES2TS_ERROR;
+
+	ctx->burst = packets;
 	return ES2TS_OK;
 }
 
+/* The producer holding the next sequence number, or NULL if it hasn't arrived yet */
+static struct es2ts_producer_s *es2ts_producer_next(struct es2ts_context_s *ctx)
+{
+	for (int i = 0; i < ctx->producer_count; i++) {
+		struct es2ts_producer_s *p = ctx->producers[i];
+
+		if (!p->headvalid) {
+			if (es2ts_ring_read(p->descring, (unsigned char *)&p->head, sizeof(p->head)) == 0)
+				continue;
+			p->headvalid = 1;
+		}
+		if (p->head.seq == ctx->seq_next)
+			return p;
+	}
+
+	return 0;
+}
+
+/* Worker side: whether es2ts_data_peek() would find something */
+static int es2ts_data_ready(struct es2ts_context_s *ctx)
+{
+	if (ctx->descrem || es2ts_ring_used(ctx->descring))
+		return 1;
+
+	for (int i = 0; i < ctx->stream_count; i++) {
+		if (es2ts_data_ready(ctx->streams[i]))
+			return 1;
+	}
+
+	if (ctx->shm && es2ts_shm_used(ctx->shm))
+		return 1;
+
+	return es2ts_producer_next(ctx) != 0;
+}
+
+/* The descriptor for the next input byte, loading a new one when the current is used up */
+static struct es2ts_desc_s *es2ts_data_peek(struct es2ts_context_s *ctx)
+{
+	struct es2ts_desc_s *desc = &ctx->desc;
+
+	if (ctx->descrem == 0) {
+		struct es2ts_producer_s *p;
+		unsigned int shmlen;
+		if (es2ts_ring_read(ctx->descring, (unsigned char *)desc, sizeof(*desc))) {
+			ctx->descsrc = ctx->ring;
+		} else if ((p = es2ts_producer_next(ctx))) {
+			*desc = p->head;
+			p->headvalid = 0;
+			ctx->descsrc = p->ring;
+			ctx->seq_next++;
+		} else if (ctx->shm && (shmlen = es2ts_shm_used(ctx->shm))) {
+			/* Whatever the other process has published, copied out of the mapping on dequeue */
+			memset(desc, 0, sizeof(*desc));
+			desc->type = ES2TS_DESC_SHM;
+			desc->len = shmlen > INT_MAX ? INT_MAX : shmlen;
+			desc->enqueued = es2ts_stats_now();
+			stats_input(ctx, desc->len, desc->enqueued);
+		} else
+			return 0;
+		ctx->descrem = desc->len;
+		es2ts_histogram_record(&ctx->stats.queue, es2ts_stats_now() - desc->enqueued);
+
+		/* libavformat reads frames as a byte stream, remember their timing for later */
+		if (desc->frame && !(ctx->flags & ES2TS_FLAG_NATIVE_MUX))
+			timing_push(ctx, desc);
+	}
+
+	return desc;
+}
+
 static int es2ts_data_dequeue(struct es2ts_context_s *ctx, unsigned char *data, int len)
 {
-	struct es2ts_buffer_s *buf;
-	int ret = ES2TS_OK;
+	struct es2ts_desc_s *desc;
+	int ret;
 
 	if ((!ctx) || (!data) || (len <= 0))
 		return ES2TS_INVALID_ARG;
 
-	int outputrem = len;
+	desc = &ctx->desc;
 	int idx = 0;
-	pthread_mutex_lock(&ctx->listlock);
-	while (outputrem > 0) {
-		if (xorg_list_is_empty(&ctx->listbusy)) {
-			ret = (outputrem == len)?ES2TS_NO_RESOURCE:ES2TS_OK;
+	while (idx < len) {
+		if (!es2ts_data_peek(ctx))
 			break;
-		}
 
-		buf = xorg_list_first_entry(&ctx->listbusy, struct es2ts_buffer_s, list);
-		int bufrem = buf->usedlen - buf->readptr;
+		int cplen = len - idx;
+		if (cplen > ctx->descrem)
+			cplen = ctx->descrem;
 
-		int cplen;
-		if (outputrem <= bufrem)
-			cplen = outputrem;
+		if (desc->type == ES2TS_DESC_COPY)
+			es2ts_ring_read(ctx->descsrc, data + idx, cplen);
+		else if (desc->type == ES2TS_DESC_SHM)
+			es2ts_shm_read(ctx->shm, data + idx, cplen);
 		else
-			cplen = bufrem;
-
-		memcpy(data + idx, buf->ptr + buf->readptr, cplen);
-		buf->readptr += cplen;
+			memcpy(data + idx, desc->ptr + desc->len - ctx->descrem, cplen);
 		idx += cplen;
-		outputrem -= cplen;
-
-		if (buf->readptr == buf->usedlen) {
-			if (es2ts_debug)
-				fprintf(stderr, "%s: %s(%p, %p, %d) append to free\n", now(), __func__, ctx, data, buf->usedlen);
-			xorg_list_del(&buf->list);
-			es2ts_buffer_recycle(buf);
-			xorg_list_append(&buf->list, &ctx->listfree);
+		ctx->descrem -= cplen;
+
+		if (ctx->descrem == 0 && desc->type == ES2TS_DESC_REF && desc->release) {
+			ES2TS_TRACE(TRACE_RELEASE, ctx, desc->len, 0);
+			desc->release(ctx, desc->ptr, desc->len, desc->opaque);
 		}
 	}
-	pthread_mutex_unlock(&ctx->listlock);
 
-	if (outputrem == 0)
-		ret = ES2TS_OK;
+	es2ts_stats_add(&ctx->stats.bytes_consumed, idx);
+	if (idx)
+		es2ts_data_space(ctx);
 
-	if (es2ts_debug)
-		fprintf(stderr, "%s: %s() returns %d\n", now(), __func__, ret);
+	/* Number of bytes copied, or ES2TS_NO_RESOURCE when nothing was pending */
+	ret = idx ? idx : ES2TS_NO_RESOURCE;
+
+	ES2TS_TRACE(TRACE_DEQUEUE, ctx, idx, 0);
 	return ret;
 }
 
-int es2ts_data_enqueue(struct es2ts_context_s *ctx, unsigned char *data, int len)
+/* Worker side: sleep until there's data to consume or we're asked to terminate.
+ * waiting is published before the ring is re-checked, and the producer
+ * publishes data before checking waiting, so one of the two always sees
+ * the other and a wakeup can't be lost.
+ */
+static void es2ts_data_wait(struct es2ts_context_s *ctx)
 {
-	struct es2ts_buffer_s *buf;
-	int ret = ES2TS_OK;
+	ES2TS_TRACE(TRACE_WAIT_BEGIN, ctx, 0, 0);
+	int64_t start = es2ts_stats_now();
+
+	pthread_mutex_lock(&ctx->waitlock);
+	__atomic_store_n(&ctx->waiting, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	while (!ctx->threadTerminate && !es2ts_data_ready(ctx)) {
+		if (ctx->shm) {
+			/* The other process can only ring the doorbell, so local wakeups do too */
+			pthread_mutex_unlock(&ctx->waitlock);
+			es2ts_shm_doorbell_wait(ctx->shm);
+			pthread_mutex_lock(&ctx->waitlock);
+		} else
+			pthread_cond_wait(&ctx->waitcond, &ctx->waitlock);
+	}
+	__atomic_store_n(&ctx->waiting, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&ctx->waitlock);
 
-	if ((!ctx) || (!data) || (len <= 0))
-		return ES2TS_INVALID_ARG;
+	/* Blocked, not demuxing */
+	stats_excl += es2ts_stats_now() - start;
+	ES2TS_TRACE(TRACE_WAIT_END, ctx, 0, 0);
+}
 
-	if (es2ts_debug)
-		fprintf(stderr, "%s: %s(%p, %p, %d)\n", now(), __func__, ctx, data, len);
+/* Producer side: only pay for the mutex and signal when the worker is asleep */
+static void es2ts_data_wake(struct es2ts_context_s *ctx)
+{
+	/* An MPTS stream is consumed by its parent's worker */
+	if (ctx->parent)
+		ctx = ctx->parent;
 
-	int inputrem = len;
-	int idx = 0;
-	pthread_mutex_lock(&ctx->listlock);
-	while (1) {
-		if (xorg_list_is_empty(&ctx->listfree)) {
-			ret = ES2TS_ERROR;
+	if (ctx->engine) {
+		if (ctx->threadRunning)
+			es2ts_engine_schedule(ctx->engine, ctx);
+		return;
+	}
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ctx->waiting, __ATOMIC_RELAXED) == 0)
+		return;
+
+	if (ctx->shm) {
+		es2ts_shm_doorbell_ring(ctx->shm);
+		return;
+	}
+
+	pthread_mutex_lock(&ctx->waitlock);
+	pthread_cond_signal(&ctx->waitcond);
+	pthread_mutex_unlock(&ctx->waitlock);
+}
+
+/* Either side: tell upstream once per crossing of a watermark */
+static void es2ts_watermark_check(struct es2ts_context_s *ctx)
+{
+	es2ts_watermark_callback cb = __atomic_load_n(&ctx->wmcb, __ATOMIC_ACQUIRE);
+	if (!cb)
+		return;
+
+	uint64_t in = __atomic_load_n(&ctx->stats.bytes_in, __ATOMIC_RELAXED);
+	uint64_t consumed = __atomic_load_n(&ctx->stats.bytes_consumed, __ATOMIC_RELAXED);
+	uint64_t queued = in > consumed ? in - consumed : 0;
+
+	int level = __atomic_load_n(&ctx->wmlevel, __ATOMIC_RELAXED);
+	int next;
+	if (level == ES2TS_WATERMARK_LOW && queued >= ctx->wmhigh)
+		next = ES2TS_WATERMARK_HIGH;
+	else if (level == ES2TS_WATERMARK_HIGH && queued <= ctx->wmlow)
+		next = ES2TS_WATERMARK_LOW;
+	else
+		return;
+
+	/* Producer and worker may both see the crossing, one of them reports it */
+	if (__atomic_compare_exchange_n(&ctx->wmlevel, &level, next, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		ES2TS_TRACE(TRACE_WATERMARK, ctx, next, queued);
+		cb(ctx, next, queued);
+	}
+}
+
+/* Worker side: input was consumed, wake any enqueue waiting for room.
+ * The same handshake as es2ts_data_wait() / es2ts_data_wake() in reverse.
+ */
+static void es2ts_data_space(struct es2ts_context_s *ctx)
+{
+	es2ts_watermark_check(ctx);
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ctx->space_waiting, __ATOMIC_RELAXED) == 0)
+		return;
+
+	pthread_mutex_lock(&ctx->waitlock);
+	pthread_cond_broadcast(&ctx->spacecond);
+	pthread_mutex_unlock(&ctx->waitlock);
+}
+
+/* Producer side: whether a descriptor, and len bytes in ring if there is one, fit */
+static int es2ts_data_fits(struct es2ts_ring_s *ring, struct es2ts_ring_s *descring, int len)
+{
+	if (es2ts_ring_avail(descring) < sizeof(struct es2ts_desc_s))
+		return 0;
+
+	return !ring || es2ts_ring_avail(ring) >= (unsigned int)len;
+}
+
+/* Producer side: sleep until the worker makes room, the enqueue timeout
+ * passes or the context stops. ES2TS_ERROR unless there's room now.
+ */
+static int es2ts_data_space_wait(struct es2ts_context_s *ctx, struct es2ts_ring_s *ring,
+	struct es2ts_ring_s *descring, int len, struct timespec *deadline)
+{
+	struct es2ts_context_s *owner = ctx->parent ? ctx->parent : ctx;
+	int timeout = ctx->enqueue_timeout;
+
+	/* Too big to ever fit, or nobody draining the queue */
+	if (timeout == 0 || (ring && (unsigned int)len > ring->size) || !owner->threadRunning)
+		return ES2TS_ERROR;
+
+	if (timeout > 0 && deadline->tv_sec == 0 && deadline->tv_nsec == 0) {
+		clock_gettime(CLOCK_MONOTONIC, deadline);
+		deadline->tv_sec += timeout / 1000;
+		deadline->tv_nsec += (timeout % 1000) * 1000000L;
+		if (deadline->tv_nsec >= 1000000000L) {
+			deadline->tv_sec++;
+			deadline->tv_nsec -= 1000000000L;
+		}
+	}
+
+	ES2TS_TRACE(TRACE_SPACE_BEGIN, ctx, len, 0);
+	pthread_mutex_lock(&ctx->waitlock);
+	__atomic_add_fetch(&ctx->space_waiting, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	while (!es2ts_data_fits(ring, descring, len) && owner->threadRunning) {
+		if (timeout < 0)
+			pthread_cond_wait(&ctx->spacecond, &ctx->waitlock);
+		else if (pthread_cond_timedwait(&ctx->spacecond, &ctx->waitlock, deadline) == ETIMEDOUT)
 			break;
+	}
+	__atomic_sub_fetch(&ctx->space_waiting, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&ctx->waitlock);
+
+	int ret = es2ts_data_fits(ring, descring, len) ? ES2TS_OK : ES2TS_ERROR;
+	ES2TS_TRACE(TRACE_SPACE_END, ctx, ret, 0);
+
+	return ret;
+}
+
+/* Nobody drains the queues once the context stops, fail any enqueue still waiting */
+static void es2ts_data_space_release(struct es2ts_context_s *ctx)
+{
+	for (int i = -1; i < ctx->stream_count; i++) {
+		struct es2ts_context_s *c = (i < 0) ? ctx : ctx->streams[i];
+
+		pthread_mutex_lock(&c->waitlock);
+		pthread_cond_broadcast(&c->spacecond);
+		pthread_mutex_unlock(&c->waitlock);
+	}
+}
+
+/* Copy data into a byte ring and publish its descriptor */
+static int es2ts_data_enqueue_desc(struct es2ts_context_s *ctx, struct es2ts_ring_s *ring,
+	struct es2ts_ring_s *descring, struct es2ts_desc_s *desc, unsigned char *data)
+{
+	struct timespec deadline = { 0, 0 };
+
+	/* All or nothing, a full ring leaves the caller free to retry the same data.
+	 * Check for the descriptor first, the bytes are visible once it lands.
+	 */
+	while ((es2ts_ring_avail(descring) < sizeof(*desc)) ||
+		(es2ts_ring_write(ring, data, desc->len) < 0)) {
+		if (ES2TS_FAILED(es2ts_data_space_wait(ctx, ring, descring, desc->len, &deadline))) {
+			es2ts_stats_add(&ctx->stats.bytes_dropped, desc->len);
+			ES2TS_TRACE(TRACE_ENQUEUE_FULL, ctx, desc->len, desc->seq);
+			return ES2TS_ERROR;
 		}
+	}
+	ES2TS_TRACE(TRACE_ENQUEUE, ctx, desc->len, desc->seq);
+	desc->enqueued = es2ts_stats_now();
+	stats_input(ctx, desc->len, desc->enqueued);
+	es2ts_stats_min(&ctx->stats.queue_free_min, es2ts_ring_avail(ring));
 
-		buf = xorg_list_first_entry(&ctx->listfree, struct es2ts_buffer_s, list);
-		int bufrem = buf->maxlen - buf->usedlen;
+	es2ts_ring_write(descring, (unsigned char *)desc, sizeof(*desc));
 
-		int cplen;
-		if (inputrem <= bufrem)
-			cplen = inputrem;
-		else
-			cplen = bufrem;
+	es2ts_data_wake(ctx);
+	es2ts_watermark_check(ctx);
 
-		memcpy(buf->ptr + buf->usedlen, data + idx, cplen);
-		buf->usedlen += cplen;
-		idx += cplen;
-		inputrem -= cplen;
+	return ES2TS_OK;
+}
+
+int es2ts_data_enqueue(struct es2ts_context_s *ctx, unsigned char *data, int len)
+{
+	if ((!ctx) || (!data) || (len <= 0))
+		return ES2TS_INVALID_ARG;
+
+	struct es2ts_desc_s desc = { ES2TS_DESC_COPY, len };
+
+	return es2ts_data_enqueue_desc(ctx, ctx->ring, ctx->descring, &desc, data);
+}
+
+int es2ts_frame_enqueue(struct es2ts_context_s *ctx, unsigned char *data, int len,
+	int64_t pts, int64_t dts, unsigned int flags)
+{
+	if ((!ctx) || (!data) || (len <= 0) || (pts == ES2TS_NOPTS))
+		return ES2TS_INVALID_ARG;
+
+	struct es2ts_desc_s desc = { ES2TS_DESC_COPY, len };
+	desc.frame = 1;
+	desc.frameflags = flags;
+	desc.pts = pts;
+	desc.dts = (dts == ES2TS_NOPTS) ? pts : dts;
 
-		if (buf->usedlen == buf->maxlen || inputrem == 0) {
-			xorg_list_del(&buf->list);
-			xorg_list_append(&buf->list, &ctx->listbusy);
-			if (es2ts_debug)
-				fprintf(stderr, "%s: %s(%p, %p, %d) append to busy\n", now(), __func__, ctx, data, len);
+	return es2ts_data_enqueue_desc(ctx, ctx->ring, ctx->descring, &desc, data);
+}
+
+int es2ts_data_enqueue_ref(struct es2ts_context_s *ctx, unsigned char *data, int len,
+	es2ts_release_callback release_cb, void *opaque)
+{
+	if ((!ctx) || (!data) || (len <= 0))
+		return ES2TS_INVALID_ARG;
+
+	struct es2ts_desc_s desc = { ES2TS_DESC_REF, len, data, release_cb, opaque };
+	struct timespec deadline = { 0, 0 };
+	while (es2ts_ring_avail(ctx->descring) < sizeof(desc)) {
+		if (ES2TS_FAILED(es2ts_data_space_wait(ctx, 0, ctx->descring, len, &deadline))) {
+			es2ts_stats_add(&ctx->stats.bytes_dropped, len);
+			ES2TS_TRACE(TRACE_ENQUEUE_FULL, ctx, len, 0);
+			return ES2TS_ERROR;
 		}
-		if (inputrem == 0) break;
 	}
-	pthread_mutex_unlock(&ctx->listlock);
+	desc.enqueued = es2ts_stats_now();
+	es2ts_ring_write(ctx->descring, (unsigned char *)&desc, sizeof(desc));
+	ES2TS_TRACE(TRACE_ENQUEUE, ctx, len, 0);
+	stats_input(ctx, len, desc.enqueued);
 
-	if (inputrem == 0)
-		ret = ES2TS_OK;
+	es2ts_data_wake(ctx);
+	es2ts_watermark_check(ctx);
 
-	return ret;
+	return ES2TS_OK;
+}
+
+int es2ts_enqueue_timeout_set(struct es2ts_context_s *ctx, int ms)
+{
+	if ((!ctx) || (ms < -1))
+		return ES2TS_INVALID_ARG;
+
+	ctx->enqueue_timeout = ms;
+
+	return ES2TS_OK;
+}
+
+int es2ts_watermark_register(struct es2ts_context_s *ctx, uint64_t high, uint64_t low,
+	es2ts_watermark_callback cb)
+{
+	if ((!ctx) || (cb && low >= high))
+		return ES2TS_INVALID_ARG;
+
+	/* Thresholds first, the callback publishes them */
+	__atomic_store_n(&ctx->wmcb, (es2ts_watermark_callback)0, __ATOMIC_RELEASE);
+	ctx->wmhigh = high;
+	ctx->wmlow = low;
+	__atomic_store_n(&ctx->wmlevel, ES2TS_WATERMARK_LOW, __ATOMIC_RELAXED);
+	__atomic_store_n(&ctx->wmcb, cb, __ATOMIC_RELEASE);
+
+	return ES2TS_OK;
+}
+
+int es2ts_producer_alloc(struct es2ts_context_s *ctx, struct es2ts_producer_s **r)
+{
+	if ((!ctx) || (!r))
+		return ES2TS_INVALID_ARG;
+
+	/* The worker walks the producer list without a lock */
+	struct es2ts_context_s *owner = ctx->parent ? ctx->parent : ctx;
+	if (owner->threadRunning || ctx->producer_count == ES2TS_PRODUCERS_MAX)
+		return ES2TS_ERROR;
+
+	struct es2ts_producer_s *p = calloc(1, sizeof(*p));
+	if (!p)
+		return ES2TS_NO_RESOURCE;
+
+	p->ctx = ctx;
+	if (es2ts_ring_alloc(&p->ring, PRODUCER_RING_SIZE) < 0) {
+		free(p);
+		return ES2TS_NO_RESOURCE;
+	}
+	if (es2ts_ring_alloc(&p->descring, PRODUCER_DESC_RING_SIZE) < 0) {
+		es2ts_ring_free(p->ring);
+		free(p);
+		return ES2TS_NO_RESOURCE;
+	}
+
+	ctx->producers[ctx->producer_count++] = p;
+	*r = p;
+
+	return ES2TS_OK;
+}
+
+int es2ts_producer_enqueue(struct es2ts_producer_s *p, unsigned int seq, unsigned char *data, int len)
+{
+	if ((!p) || (!data) || (len <= 0))
+		return ES2TS_INVALID_ARG;
+
+	struct es2ts_desc_s desc = { ES2TS_DESC_COPY, len };
+	desc.seq = seq;
+
+	return es2ts_data_enqueue_desc(p->ctx, p->ring, p->descring, &desc, data);
+}
+
+int es2ts_producer_frame_enqueue(struct es2ts_producer_s *p, unsigned int seq, unsigned char *data, int len,
+	int64_t pts, int64_t dts, unsigned int flags)
+{
+	if ((!p) || (!data) || (len <= 0) || (pts == ES2TS_NOPTS))
+		return ES2TS_INVALID_ARG;
+
+	struct es2ts_desc_s desc = { ES2TS_DESC_COPY, len };
+	desc.frame = 1;
+	desc.frameflags = flags;
+	desc.pts = pts;
+	desc.dts = (dts == ES2TS_NOPTS) ? pts : dts;
+	desc.seq = seq;
+
+	return es2ts_data_enqueue_desc(p->ctx, p->ring, p->descring, &desc, data);
+}
+
+int es2ts_shm_alloc(struct es2ts_context_s *ctx, unsigned int size, int *memfd, int *doorbell)
+{
+	if ((!ctx) || (!memfd) || (!doorbell) || ctx->shm || ctx->threadRunning)
+		return ES2TS_INVALID_ARG;
+
+	/* Only the top level context's doorbell is waited on */
+	if (ctx->parent)
+		return ES2TS_INVALID_ARG;
+
+	int ret = es2ts_shm_create(&ctx->shm, size);
+	if (ES2TS_FAILED(ret))
+		return ret;
+
+	*memfd = ctx->shm->memfd;
+	*doorbell = ctx->shm->doorbell;
+	return ES2TS_OK;
+}
+
+int es2ts_stream_alloc(struct es2ts_context_s *ctx, int program, int stream_type,
+	struct es2ts_context_s **r)
+{
+	if ((!ctx) || (!r) || (program <= 0) || (program > 0xffff))
+		return ES2TS_INVALID_ARG;
+	if (!(ctx->flags & ES2TS_FLAG_NATIVE_MUX) || ctx->parent)
+		return ES2TS_INVALID_ARG;
+	if ((stream_type != ES2TS_STREAM_TYPE_H264) && (stream_type != ES2TS_STREAM_TYPE_AAC) &&
+		(stream_type != ES2TS_STREAM_TYPE_AC3))
+		return ES2TS_INVALID_ARG;
+
+	/* The worker walks the stream list without a lock */
+	if (ctx->threadRunning || ctx->stream_count == ES2TS_STREAMS_MAX)
+		return ES2TS_ERROR;
+
+	struct es2ts_context_s *stream;
+	int ret = es2ts_alloc_flags(&stream, ctx->flags);
+	if (ES2TS_FAILED(ret))
+		return ret;
+
+	stream->parent = ctx;
+	stream->program = program;
+	stream->stream_type = stream_type;
+
+	ctx->streams[ctx->stream_count++] = stream;
+	*r = stream;
+
+	return ES2TS_OK;
 }
 
 void *es2ts_process(void *p)
@@ -557,13 +1484,25 @@ void *es2ts_process(void *p)
 	if (es2ts_debug)
 		fprintf(stderr, "%s: %s(%p) Thread starts\n", now(), __func__, ctx);
 
-	process_setup(ctx);
+	int native = ctx->flags & ES2TS_FLAG_NATIVE_MUX;
+	if (native) {
+		if (ES2TS_FAILED(process_setup_native(ctx)))
+			ctx->threadDone = 1;
+	} else
+		process_setup(ctx);
 
-	ctx->threadTerminate = 0;
 	ctx->threadRunning = 1;
 	int done = 0;
-	while (!ctx->threadTerminate) {
-		int ret = process_packet(ctx, &done);
+	while (!ctx->threadTerminate && !ctx->threadDone) {
+		int ret;
+		if (native)
+			ret = process_packet_native(ctx, &done);
+		else
+			ret = process_packet(ctx, &done);
+		if (ret == ES2TS_NO_RESOURCE) {
+			es2ts_data_wait(ctx);
+			continue;
+		}
 		if (ES2TS_FAILED(ret)) {
 			break;
 		}
@@ -573,23 +1512,83 @@ void *es2ts_process(void *p)
 	}
 	ctx->threadDone = 1;
 
-	process_teardown(ctx);
+	if (native)
+		process_teardown_native(ctx);
+	else
+		process_teardown(ctx);
 
 	if (es2ts_debug)
 		fprintf(stderr, "%s: %s(%p) Thread complete\n", now(), __func__, ctx);
 	return NULL;
 }
 
+/* Engine worker entry point for an attached context, never blocks */
+int es2ts_process_step(struct es2ts_context_s *ctx, int budget)
+{
+	int done = 0;
+	int ret = ES2TS_OK;
+
+	while (!ctx->threadTerminate && budget > 0) {
+		ret = process_packet_native(ctx, &done);
+		if (ES2TS_FAILED(ret))
+			break;
+		budget -= ret;
+	}
+
+	if (ret == ES2TS_NO_RESOURCE && !ctx->threadTerminate)
+		return ENGINE_STEP_IDLE;
+	if (ES2TS_SUCCESS(ret) && !ctx->threadTerminate)
+		return ENGINE_STEP_MORE;
+
+	/* Terminated or failed, tear down here and let es2ts_process_end() return */
+	process_teardown_native(ctx);
+	__atomic_store_n(&ctx->sched, ENGINE_SCHED_DONE, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&ctx->waitlock);
+	ctx->threadDone = 1;
+	pthread_cond_broadcast(&ctx->waitcond);
+	pthread_mutex_unlock(&ctx->waitlock);
+
+	return ENGINE_STEP_DONE;
+}
+
 int es2ts_process_start(struct es2ts_context_s *ctx)
 {
-	if (!ctx)
+	if ((!ctx) || (ctx->parent))
 		return ES2TS_INVALID_ARG;
 
+	/* Time to first packet counts from the first enqueue after this */
+	ctx->started = 0;
+	__atomic_store_n(&ctx->first_in, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&ctx->stats.first_packet, 0, __ATOMIC_RELAXED);
+
+	if (ctx->engine) {
+		/* No thread of our own, the engine workers run us when input arrives */
+		ctx->threadTerminate = 0;
+		ctx->threadDone = 0;
+		if (ES2TS_FAILED(process_setup_native(ctx))) {
+			process_teardown_native(ctx);
+			return ES2TS_ERROR;
+		}
+		/* The engine polls a shared memory doorbell in place of a waiting worker */
+		if (ctx->shm && ES2TS_FAILED(es2ts_engine_watch(ctx->engine, ctx, ctx->shm->doorbell))) {
+			process_teardown_native(ctx);
+			return ES2TS_ERROR;
+		}
+		ctx->sched = ENGINE_SCHED_IDLE;
+		ctx->threadRunning = 1;
+		es2ts_engine_schedule(ctx->engine, ctx);
+		return ES2TS_OK;
+	}
+
 	if (es2ts_debug)
 		fprintf(stderr, "%s: %s(%p) Creating Thread\n", now(), __func__, ctx);
 
+	ctx->threadTerminate = 0;
+	ctx->threadDone = 0;
 	if (pthread_create(&ctx->thread, NULL, &es2ts_process, ctx) != 0)
 		return ES2TS_ERROR;
+	ctx->threadRunning = 1;
 
 	if (es2ts_debug)
 		fprintf(stderr, "%s: %s(%p) Thread Creation success\n", now(), __func__, ctx);
@@ -604,11 +1603,42 @@ int es2ts_process_end(struct es2ts_context_s *ctx)
 	if (es2ts_debug)
 		fprintf(stderr, "%s: %s(%p) Thread termination requested\n", now(), __func__, ctx);
 
+	if (!ctx->threadRunning)
+		return ES2TS_OK;
+
+	if (ctx->engine) {
+		/* A worker notices the request on its next pass and tears us down */
+		pthread_mutex_lock(&ctx->waitlock);
+		ctx->threadTerminate = 1;
+		pthread_mutex_unlock(&ctx->waitlock);
+
+		es2ts_engine_schedule(ctx->engine, ctx);
+
+		pthread_mutex_lock(&ctx->waitlock);
+		while (!ctx->threadDone)
+			pthread_cond_wait(&ctx->waitcond, &ctx->waitlock);
+		pthread_mutex_unlock(&ctx->waitlock);
+
+		if (ctx->shm)
+			es2ts_engine_unwatch(ctx->engine, ctx);
+		ctx->threadRunning = 0;
+		ctx->threadTerminate = 0;
+		es2ts_data_space_release(ctx);
+		return ES2TS_OK;
+	}
+
+	/* Wake the worker if it's blocked waiting for data, then reap it */
+	pthread_mutex_lock(&ctx->waitlock);
 	ctx->threadTerminate = 1;
-	while (!ctx->threadDone)
-		usleep(100 * 1000);
+	pthread_cond_broadcast(&ctx->waitcond);
+	pthread_mutex_unlock(&ctx->waitlock);
+	if (ctx->shm)
+		es2ts_shm_doorbell_ring(ctx->shm);
+
+	pthread_join(ctx->thread, NULL);
 	ctx->threadRunning = 0;
 	ctx->threadTerminate = 0;
+	es2ts_data_space_release(ctx);
 	if (es2ts_debug)
 		fprintf(stderr, "%s: %s(%p) Thread termination complete\n", now(), __func__, ctx);
 	return ES2TS_OK;
@@ -0,0 +1,599 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "config.h"
+#include <libes2ts/es2ts.h>
+#include "nal.h"
+#include "stats.h"
+#include "tsmux.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Output goes to disk in whole chunks, a multiple of both the TS packet
+ * and the page size, from a page aligned buffer.
+ */
+#define FILE_CHUNK		(8192 * TS_PACKET_SIZE)
+#define FILE_BURST		64
+#define FILE_FRAME_DURATION	(90000 / 30)
+
+/* Parallel mode: segments per worker for load balancing, never smaller
+ * than FILE_SEGMENT_MIN, and at most FILE_WINDOW segments per worker
+ * muxed ahead of those written out.
+ */
+#define FILE_SEGMENTS_PER_THREAD	8
+#define FILE_SEGMENT_MIN	(1024 * 1024)
+#define FILE_WINDOW		2
+#define FILE_THREADS_MAX	64
+
+struct file_mux_s {
+	struct es2ts_tsmux_s *tsmux;
+	struct es2ts_tsmux_stream_s *stream;
+
+	int fd;
+	unsigned char *chunk;
+	unsigned int chunklen;
+
+	int64_t clk;
+	int started;
+	int fast_start;
+
+	uint64_t frames;
+	uint64_t bytes_out;
+};
+
+static int pwrite_all(int fd, const unsigned char *buf, size_t len, off_t offset)
+{
+	while (len) {
+		ssize_t ret = pwrite(fd, buf, len, offset);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return ES2TS_ERROR;
+		}
+		buf += ret;
+		len -= ret;
+		offset += ret;
+	}
+
+	return ES2TS_OK;
+}
+
+static int write_all(int fd, const unsigned char *buf, size_t len)
+{
+	while (len) {
+		ssize_t ret = write(fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return ES2TS_ERROR;
+		}
+		buf += ret;
+		len -= ret;
+	}
+
+	return ES2TS_OK;
+}
+
+static int file_chunk_flush(struct file_mux_s *f)
+{
+	int ret = write_all(f->fd, f->chunk, f->chunklen);
+
+	f->bytes_out += f->chunklen;
+	f->chunklen = 0;
+
+	return ret;
+}
+
+static int file_write(void *opaque, const struct iovec *iov, int iovcnt)
+{
+	struct file_mux_s *f = opaque;
+
+	for (int i = 0; i < iovcnt; i++) {
+		const unsigned char *ptr = iov[i].iov_base;
+		size_t len = iov[i].iov_len;
+
+		while (len) {
+			size_t cplen = FILE_CHUNK - f->chunklen;
+			if (cplen > len)
+				cplen = len;
+
+			memcpy(f->chunk + f->chunklen, ptr, cplen);
+			f->chunklen += cplen;
+			ptr += cplen;
+			len -= cplen;
+
+			if (f->chunklen == FILE_CHUNK && ES2TS_FAILED(file_chunk_flush(f)))
+				return ES2TS_ERROR;
+		}
+	}
+
+	return ES2TS_OK;
+}
+
+/* Stamped as the native live path does, one frame per access unit */
+static int file_au(void *opaque, unsigned char *au, int len, int keyframe)
+{
+	struct file_mux_s *f = opaque;
+
+	if (!f->started && (keyframe || !f->fast_start))
+		f->started = 1;
+	if (!f->started)
+		return ES2TS_OK;
+
+	int64_t ts = f->clk * FILE_FRAME_DURATION;
+	f->clk++;
+	f->frames++;
+
+	return es2ts_tsmux_write_au(f->tsmux, f->stream, au, len, ts, ts, keyframe);
+}
+
+/* Parallel mode. An index pass records every access unit, the list is cut
+ * into GOP aligned segments that workers mux independently, each with a
+ * muxer of its own whose clock starts at the segment's first frame. A
+ * segment opens with an IDR, which always carries PAT / PMT, so the only
+ * difference from one continuous muxer is the continuity counters. Once
+ * every earlier segment is muxed, a segment's starting counters and file
+ * offset are known. A worker then patches it and writes it at that offset
+ * straight from its buffer, no single thread sees all of the output.
+ */
+struct file_au_s {
+	size_t offset;
+	int len;
+	int keyframe;
+};
+
+struct file_index_s {
+	const unsigned char *base;
+	struct file_au_s *au;
+	size_t count;
+	size_t max;
+	int fast_start;
+};
+
+struct file_segment_s {
+	size_t first;		/* Index of the first access unit, an IDR */
+	size_t count;
+	size_t bytes;
+
+	unsigned char *ptr;	/* TS output */
+	size_t len;
+	size_t maxlen;
+
+	/* Next continuity counter of each PID once the segment is done */
+	unsigned char cc_pat;
+	unsigned char cc_pmt;
+	unsigned char cc_es;
+
+	/* Where the earlier segments leave the counters and the file */
+	unsigned char base_pat;
+	unsigned char base_pmt;
+	unsigned char base_es;
+	off_t offset;
+
+	int done;
+	int ret;
+};
+
+struct file_pool_s {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	const unsigned char *map;
+	struct file_index_s *index;
+	struct file_segment_s *seg;
+	size_t nseg;
+	size_t next;		/* Next segment to mux */
+	size_t resolved;	/* Segments with their base counters and offset */
+	size_t claimed;		/* Resolved segments a worker is writing */
+	size_t written;		/* Segments on disk */
+	size_t window;
+	int abort;
+
+	int fd;
+	off_t offset;		/* Of the first segment */
+
+	/* Output buffers of written segments, reused rather than faulted in afresh */
+	struct file_segment_s *spare;
+	size_t nspare;
+};
+
+static int index_au(void *opaque, unsigned char *au, int len, int keyframe)
+{
+	struct file_index_s *idx = opaque;
+
+	if (idx->count == 0 && idx->fast_start && !keyframe)
+		return ES2TS_OK;
+
+	if (idx->count == idx->max) {
+		size_t max = idx->max ? idx->max * 2 : 4096;
+		struct file_au_s *p = realloc(idx->au, max * sizeof(*p));
+		if (!p)
+			return ES2TS_ERROR;
+		idx->au = p;
+		idx->max = max;
+	}
+
+	idx->au[idx->count].offset = au - idx->base;
+	idx->au[idx->count].len = len;
+	idx->au[idx->count].keyframe = keyframe;
+	idx->count++;
+
+	return ES2TS_OK;
+}
+
+/* Cut at the first IDR past the target size. A file without IDRs (or
+ * with a leading run of non IDR frames) keeps those frames in one segment.
+ */
+static int segments_build(struct file_pool_s *pool, int threads)
+{
+	struct file_index_s *idx = pool->index;
+	size_t total = 0;
+
+	for (size_t i = 0; i < idx->count; i++)
+		total += idx->au[i].len;
+
+	size_t target = total / (threads * FILE_SEGMENTS_PER_THREAD);
+	if (target < FILE_SEGMENT_MIN)
+		target = FILE_SEGMENT_MIN;
+
+	pool->seg = calloc(total / target + 2, sizeof(*pool->seg));
+	if (!pool->seg)
+		return ES2TS_ERROR;
+
+	struct file_segment_s *seg = 0;
+	for (size_t i = 0; i < idx->count; i++) {
+		if (!seg || (seg->bytes >= target && idx->au[i].keyframe)) {
+			seg = &pool->seg[pool->nseg++];
+			seg->first = i;
+		}
+		seg->count++;
+		seg->bytes += idx->au[i].len;
+	}
+
+	return ES2TS_OK;
+}
+
+static int segment_write(void *opaque, const struct iovec *iov, int iovcnt)
+{
+	struct file_segment_s *seg = opaque;
+
+	for (int i = 0; i < iovcnt; i++) {
+		if (seg->len + iov[i].iov_len > seg->maxlen) {
+			size_t maxlen = seg->maxlen * 2;
+			while (seg->len + iov[i].iov_len > maxlen)
+				maxlen *= 2;
+			unsigned char *ptr = realloc(seg->ptr, maxlen);
+			if (!ptr)
+				return ES2TS_ERROR;
+			seg->ptr = ptr;
+			seg->maxlen = maxlen;
+		}
+		memcpy(seg->ptr + seg->len, iov[i].iov_base, iov[i].iov_len);
+		seg->len += iov[i].iov_len;
+	}
+
+	return ES2TS_OK;
+}
+
+static int segment_mux(struct file_pool_s *pool, struct file_segment_s *seg)
+{
+	struct es2ts_tsmux_s *tsmux;
+	struct es2ts_tsmux_stream_s *stream;
+	int ret;
+
+	/* PES and TS headers add a few percent, leave room for them up front */
+	size_t maxlen = seg->bytes + seg->bytes / 8 + 64 * TS_PACKET_SIZE;
+	if (seg->maxlen < maxlen) {
+		free(seg->ptr);
+		seg->maxlen = maxlen;
+		seg->ptr = malloc(seg->maxlen);
+		if (!seg->ptr)
+			return ES2TS_ERROR;
+	}
+
+	if (ES2TS_FAILED(es2ts_tsmux_alloc(&tsmux, FILE_BURST, segment_write, seg)))
+		return ES2TS_ERROR;
+	ret = es2ts_tsmux_stream_add(tsmux, TS_PROGRAM_NUMBER, TS_STREAM_TYPE_H264, &stream);
+
+	for (size_t i = seg->first; ES2TS_SUCCESS(ret) && i < seg->first + seg->count; i++) {
+		struct file_au_s *au = &pool->index->au[i];
+		int64_t ts = i * FILE_FRAME_DURATION;
+		ret = es2ts_tsmux_write_au(tsmux, stream, pool->map + au->offset, au->len, ts, ts, au->keyframe);
+	}
+	if (ES2TS_SUCCESS(ret))
+		ret = es2ts_tsmux_flush(tsmux);
+
+	seg->cc_pat = tsmux->cc_pat;
+	seg->cc_pmt = stream->program->cc_pmt;
+	seg->cc_es = stream->cc;
+	es2ts_tsmux_free(tsmux);
+
+	return ret;
+}
+
+/* Under the lock: carry counters and offsets on to the segments that are now complete */
+static void segments_resolve(struct file_pool_s *pool)
+{
+	while (pool->resolved < pool->nseg) {
+		struct file_segment_s *seg = &pool->seg[pool->resolved];
+		if (!seg->done || ES2TS_FAILED(seg->ret))
+			break;
+
+		if (pool->resolved) {
+			struct file_segment_s *prev = seg - 1;
+			seg->base_pat = (prev->base_pat + prev->cc_pat) & 0x0f;
+			seg->base_pmt = (prev->base_pmt + prev->cc_pmt) & 0x0f;
+			seg->base_es = (prev->base_es + prev->cc_es) & 0x0f;
+			seg->offset = prev->offset + prev->len;
+		} else
+			seg->offset = pool->offset;
+		pool->resolved++;
+	}
+}
+
+/* Continue each PID's counter from where the previous segments left it */
+static void segment_stitch(struct file_segment_s *seg)
+{
+	for (size_t pos = 0; pos + TS_PACKET_SIZE <= seg->len; pos += TS_PACKET_SIZE) {
+		unsigned char *p = seg->ptr + pos;
+		int pid = ((p[1] & 0x1f) << 8) | p[2];
+		int base = 0;
+		if (pid == TS_PID_PAT)
+			base = seg->base_pat;
+		else if (pid == TS_PID_PMT)
+			base = seg->base_pmt;
+		else if (pid == TS_PID_ES)
+			base = seg->base_es;
+		p[3] = (p[3] & 0xf0) | ((p[3] + base) & 0x0f);
+	}
+}
+
+static void *segment_thread(void *arg)
+{
+	struct file_pool_s *pool = arg;
+	struct file_segment_s *seg;
+	int ret;
+
+	pthread_mutex_lock(&pool->lock);
+	while (!pool->abort) {
+		/* Finished segments first, oldest first, they hold the buffers */
+		if (pool->claimed < pool->resolved) {
+			seg = &pool->seg[pool->claimed++];
+			pthread_mutex_unlock(&pool->lock);
+
+			segment_stitch(seg);
+			ret = pwrite_all(pool->fd, seg->ptr, seg->len, seg->offset);
+
+			pthread_mutex_lock(&pool->lock);
+			pool->spare[pool->nspare].ptr = seg->ptr;
+			pool->spare[pool->nspare].maxlen = seg->maxlen;
+			pool->nspare++;
+			seg->ptr = 0;
+			pool->written++;
+			if (ES2TS_FAILED(ret))
+				pool->abort = 1;
+			pthread_cond_broadcast(&pool->cond);
+			continue;
+		}
+
+		if (pool->next == pool->nseg)
+			break;
+		if (pool->next >= pool->written + pool->window) {
+			pthread_cond_wait(&pool->cond, &pool->lock);
+			continue;
+		}
+
+		seg = &pool->seg[pool->next++];
+		if (pool->nspare) {
+			struct file_segment_s *spare = &pool->spare[--pool->nspare];
+			seg->ptr = spare->ptr;
+			seg->maxlen = spare->maxlen;
+		}
+		pthread_mutex_unlock(&pool->lock);
+
+		ret = segment_mux(pool, seg);
+
+		pthread_mutex_lock(&pool->lock);
+		seg->ret = ret;
+		seg->done = 1;
+		if (ES2TS_FAILED(ret))
+			pool->abort = 1;
+		segments_resolve(pool);
+		pthread_cond_broadcast(&pool->cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return 0;
+}
+
+static int file_parallel(struct file_mux_s *f, const unsigned char *map, size_t len, int threads)
+{
+	struct file_index_s index;
+	struct file_pool_s pool;
+	pthread_t tid[FILE_THREADS_MAX];
+	int started = 0;
+	int ret = ES2TS_ERROR;
+
+	memset(&index, 0, sizeof(index));
+	index.base = map;
+	index.fast_start = f->fast_start;
+
+	memset(&pool, 0, sizeof(pool));
+	pthread_mutex_init(&pool.lock, 0);
+	pthread_cond_init(&pool.cond, 0);
+	pool.map = map;
+	pool.index = &index;
+	pool.fd = f->fd;
+
+	if (ES2TS_FAILED(es2ts_nal_split(map, len, index_au, &index)) ||
+		ES2TS_FAILED(segments_build(&pool, threads)))
+		goto out;
+
+	/* A worker without a segment of its own would only sit idle */
+	if ((size_t)threads > pool.nseg)
+		threads = pool.nseg ? pool.nseg : 1;
+	pool.window = threads * FILE_WINDOW;
+	pool.spare = calloc(pool.window, sizeof(*pool.spare));
+	if (!pool.spare)
+		goto out;
+
+	/* Anything already buffered goes first, the segments follow it */
+	if (ES2TS_FAILED(file_chunk_flush(f)))
+		goto out;
+	pool.offset = f->bytes_out;
+
+	for (; started < threads; started++) {
+		if (pthread_create(&tid[started], 0, segment_thread, &pool) != 0)
+			break;
+	}
+	if (started == 0)
+		goto out;
+
+	pthread_mutex_lock(&pool.lock);
+	while (!pool.abort && pool.written < pool.nseg)
+		pthread_cond_wait(&pool.cond, &pool.lock);
+	ret = pool.abort ? ES2TS_ERROR : ES2TS_OK;
+	pthread_mutex_unlock(&pool.lock);
+
+	for (size_t i = 0; i < pool.nseg; i++)
+		f->bytes_out += pool.seg[i].len;
+	f->frames = index.count;
+
+out:
+	if (ES2TS_FAILED(ret)) {
+		pthread_mutex_lock(&pool.lock);
+		pool.abort = 1;
+		pthread_cond_broadcast(&pool.cond);
+		pthread_mutex_unlock(&pool.lock);
+	}
+	for (int i = 0; i < started; i++)
+		pthread_join(tid[i], 0);
+	for (size_t i = 0; i < pool.nseg; i++)
+		free(pool.seg[i].ptr);
+	for (size_t i = 0; i < pool.nspare; i++)
+		free(pool.spare[i].ptr);
+	free(pool.spare);
+	free(pool.seg);
+	free(index.au);
+	pthread_cond_destroy(&pool.cond);
+	pthread_mutex_destroy(&pool.lock);
+
+	return ret;
+}
+
+int es2ts_file_transmux(const char *input, const char *output,
+	const struct es2ts_file_opts_s *opts, struct es2ts_file_stats_s *stats)
+{
+	struct file_mux_s f;
+	struct stat st;
+	unsigned char *map = MAP_FAILED;
+	int fd = -1;
+	int ret = ES2TS_ERROR;
+
+	if ((!input) || (!output))
+		return ES2TS_INVALID_ARG;
+
+	int64_t start = es2ts_stats_now();
+
+	memset(&f, 0, sizeof(f));
+	f.fd = -1;
+	f.fast_start = opts && (opts->flags & ES2TS_FLAG_FAST_START);
+
+	int threads = opts ? opts->threads : 0;
+	if (threads < 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > FILE_THREADS_MAX)
+		threads = FILE_THREADS_MAX;
+
+	fd = open(input, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "unable to open %s\n", input);
+		goto out;
+	}
+
+	/* Read ahead aggressively, every page is touched exactly once in order */
+	if (st.st_size) {
+		map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+		if (map == MAP_FAILED) {
+			fprintf(stderr, "unable to map %s\n", input);
+			goto out;
+		}
+		madvise(map, st.st_size, MADV_SEQUENTIAL | MADV_WILLNEED);
+	}
+
+	f.fd = open(output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (f.fd < 0) {
+		fprintf(stderr, "unable to create %s\n", output);
+		goto out;
+	}
+
+	if (posix_memalign((void **)&f.chunk, 4096, FILE_CHUNK))
+		goto out;
+
+	if (threads > 1 && st.st_size) {
+		if (ES2TS_FAILED(file_parallel(&f, map, st.st_size, threads)))
+			goto out;
+	} else {
+		if (ES2TS_FAILED(es2ts_tsmux_alloc(&f.tsmux, FILE_BURST, file_write, &f)) ||
+			ES2TS_FAILED(es2ts_tsmux_stream_add(f.tsmux, TS_PROGRAM_NUMBER, TS_STREAM_TYPE_H264, &f.stream)))
+			goto out;
+
+		if (st.st_size && ES2TS_FAILED(es2ts_nal_split(map, st.st_size, file_au, &f)))
+			goto out;
+		if (ES2TS_FAILED(es2ts_tsmux_flush(f.tsmux)))
+			goto out;
+	}
+	if (ES2TS_FAILED(file_chunk_flush(&f)))
+		goto out;
+
+	ret = ES2TS_OK;
+	if (stats) {
+		stats->bytes_in = st.st_size;
+		stats->bytes_out = f.bytes_out;
+		stats->frames = f.frames;
+		stats->elapsed_ns = es2ts_stats_now() - start;
+	}
+
+out:
+	if (ret != ES2TS_OK && f.fd >= 0)
+		fprintf(stderr, "conversion of %s to %s failed\n", input, output);
+	es2ts_tsmux_free(f.tsmux);
+	free(f.chunk);
+	if (f.fd >= 0 && close(f.fd) < 0)
+		ret = ES2TS_ERROR;
+	if (map != MAP_FAILED)
+		munmap(map, st.st_size);
+	if (fd >= 0)
+		close(fd);
+
+	return ret;
+}
@@ -0,0 +1,248 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "config.h"
+#include <libes2ts/es2ts.h>
+#include "h264.h"
+#include "nal.h"
+#include "startcode.h"
+
+#include <string.h>
+
+/* RBSP bit reader, steps over emulation prevention bytes as it goes */
+struct bits_s {
+	const unsigned char *ptr;
+	int len;
+	int pos;		/* Next byte */
+	int zeros;		/* Consecutive zero bytes just read */
+	unsigned int cache;
+	int ncache;		/* Bits left in cache */
+	int overrun;
+};
+
+static void bits_init(struct bits_s *b, const unsigned char *ptr, int len)
+{
+	memset(b, 0, sizeof(*b));
+	b->ptr = ptr;
+	b->len = len;
+}
+
+static int bits_byte(struct bits_s *b)
+{
+	if (b->pos < b->len && b->zeros >= 2 && b->ptr[b->pos] == 0x03) {
+		b->pos++;
+		b->zeros = 0;
+	}
+	if (b->pos >= b->len) {
+		b->overrun = 1;
+		return 0;
+	}
+
+	int v = b->ptr[b->pos++];
+	b->zeros = v ? 0 : b->zeros + 1;
+	return v;
+}
+
+static unsigned int bits_u1(struct bits_s *b)
+{
+	if (b->ncache == 0) {
+		b->cache = bits_byte(b);
+		b->ncache = 8;
+	}
+	b->ncache--;
+	return (b->cache >> b->ncache) & 1;
+}
+
+static unsigned int bits_u(struct bits_s *b, int n)
+{
+	unsigned int v = 0;
+	while (n--)
+		v = (v << 1) | bits_u1(b);
+	return v;
+}
+
+static unsigned int bits_ue(struct bits_s *b)
+{
+	int lz = 0;
+	while (!bits_u1(b)) {
+		if (++lz > 31 || b->overrun) {
+			b->overrun = 1;
+			return 0;
+		}
+	}
+	return lz ? ((1u << lz) - 1) + bits_u(b, lz) : 0;
+}
+
+static int bits_se(struct bits_s *b)
+{
+	unsigned int v = bits_ue(b);
+	return (v & 1) ? (int)((v + 1) / 2) : -(int)(v / 2);
+}
+
+static void scaling_list_skip(struct bits_s *b, int size)
+{
+	int last = 8, next = 8;
+
+	for (int j = 0; j < size; j++) {
+		if (next != 0)
+			next = (last + bits_se(b) + 256) % 256;
+		last = next ? next : last;
+	}
+}
+
+const unsigned char *es2ts_h264_nal_find(const unsigned char *buf, int len, int type, int *nallen)
+{
+	const unsigned char *nal = 0;
+	const unsigned char *sc = buf;
+
+	/* A start code needs its header byte after it to count */
+	while ((sc = es2ts_startcode_find(sc, buf + len - 1))) {
+		/* The start code ends the NAL we found, trailing zero_byte and all */
+		if (nal) {
+			const unsigned char *end = (sc > buf && sc[-1] == 0) ? sc - 1 : sc;
+			*nallen = end - nal;
+			return nal;
+		}
+		if ((sc[3] & 0x1f) == type)
+			nal = sc + 3;
+		sc += 3;
+	}
+
+	if (nal)
+		*nallen = buf + len - nal;
+	return nal;
+}
+
+int es2ts_h264_sps_parse(const unsigned char *nal, int len, struct es2ts_h264_sps_s *sps)
+{
+	struct bits_s b;
+
+	if ((len < 4) || ((nal[0] & 0x1f) != NAL_TYPE_SPS))
+		return ES2TS_ERROR;
+
+	memset(sps, 0, sizeof(*sps));
+	bits_init(&b, nal + 1, len - 1);
+
+	sps->profile_idc = bits_u(&b, 8);
+	sps->constraint_flags = bits_u(&b, 8);
+	sps->level_idc = bits_u(&b, 8);
+	sps->sps_id = bits_ue(&b);
+	sps->chroma_format_idc = 1;
+	sps->bit_depth = 8;
+
+	switch (sps->profile_idc) {
+	case 100: case 110: case 122: case 244: case 44:
+	case 83: case 86: case 118: case 128: case 138: case 139: case 134: case 135:
+		sps->chroma_format_idc = bits_ue(&b);
+		if (sps->chroma_format_idc == 3)
+			bits_u1(&b);		/* separate_colour_plane_flag */
+		sps->bit_depth = bits_ue(&b) + 8;
+		bits_ue(&b);			/* bit_depth_chroma_minus8 */
+		bits_u1(&b);			/* qpprime_y_zero_transform_bypass_flag */
+		if (bits_u1(&b)) {		/* seq_scaling_matrix_present_flag */
+			int lists = (sps->chroma_format_idc != 3) ? 8 : 12;
+			for (int i = 0; i < lists; i++) {
+				if (bits_u1(&b))
+					scaling_list_skip(&b, i < 6 ? 16 : 64);
+			}
+		}
+		break;
+	}
+
+	bits_ue(&b);				/* log2_max_frame_num_minus4 */
+	int poc_type = bits_ue(&b);
+	if (poc_type == 0)
+		bits_ue(&b);			/* log2_max_pic_order_cnt_lsb_minus4 */
+	else if (poc_type == 1) {
+		bits_u1(&b);			/* delta_pic_order_always_zero_flag */
+		bits_se(&b);			/* offset_for_non_ref_pic */
+		bits_se(&b);			/* offset_for_top_to_bottom_field */
+		int cycle = bits_ue(&b);
+		if (cycle > 255)
+			return ES2TS_ERROR;
+		for (int i = 0; i < cycle; i++)
+			bits_se(&b);
+	}
+
+	bits_ue(&b);				/* max_num_ref_frames */
+	bits_u1(&b);				/* gaps_in_frame_num_value_allowed_flag */
+	int width_mbs = bits_ue(&b) + 1;
+	int height_units = bits_ue(&b) + 1;
+	sps->frame_mbs_only = bits_u1(&b);
+	if (!sps->frame_mbs_only)
+		bits_u1(&b);			/* mb_adaptive_frame_field_flag */
+	bits_u1(&b);				/* direct_8x8_inference_flag */
+
+	int crop_left = 0, crop_right = 0, crop_top = 0, crop_bottom = 0;
+	if (bits_u1(&b)) {
+		crop_left = bits_ue(&b);
+		crop_right = bits_ue(&b);
+		crop_top = bits_ue(&b);
+		crop_bottom = bits_ue(&b);
+	}
+
+	/* Crop units depend on chroma subsampling and field coding (7.4.2.1.1) */
+	int sub_w = (sps->chroma_format_idc == 1 || sps->chroma_format_idc == 2) ? 2 : 1;
+	int sub_h = (sps->chroma_format_idc == 1) ? 2 : 1;
+	int crop_x = sps->chroma_format_idc ? sub_w : 1;
+	int crop_y = (sps->chroma_format_idc ? sub_h : 1) * (2 - sps->frame_mbs_only);
+
+	sps->width = width_mbs * 16 - crop_x * (crop_left + crop_right);
+	sps->height = (2 - sps->frame_mbs_only) * height_units * 16 - crop_y * (crop_top + crop_bottom);
+
+	if (b.overrun || sps->width <= 0 || sps->height <= 0)
+		return ES2TS_ERROR;
+
+	if (bits_u1(&b)) {			/* vui_parameters_present_flag */
+		if (bits_u1(&b)) {		/* aspect_ratio_info_present_flag */
+			if (bits_u(&b, 8) == 255)
+				bits_u(&b, 32);	/* sar_width, sar_height */
+		}
+		if (bits_u1(&b))		/* overscan_info_present_flag */
+			bits_u1(&b);
+		if (bits_u1(&b)) {		/* video_signal_type_present_flag */
+			bits_u(&b, 4);
+			if (bits_u1(&b))	/* colour_description_present_flag */
+				bits_u(&b, 24);
+		}
+		if (bits_u1(&b)) {		/* chroma_loc_info_present_flag */
+			bits_ue(&b);
+			bits_ue(&b);
+		}
+		if (bits_u1(&b)) {		/* timing_info_present_flag */
+			unsigned int tick = bits_u(&b, 32);
+			unsigned int scale = bits_u(&b, 32);
+			/* Two ticks per frame for progressive content. A truncated VUI
+			 * only costs us the frame rate.
+			 */
+			if (tick && scale && tick < 0x40000000 && !b.overrun) {
+				sps->fps_num = scale;
+				sps->fps_den = tick * 2;
+			}
+		}
+	}
+
+	return ES2TS_OK;
+}
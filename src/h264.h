@@ -0,0 +1,59 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef ES2TS_H264_H
+#define ES2TS_H264_H
+
+/* Just enough H264 bitstream parsing to describe a stream from its first
+ * sequence parameter set, without waiting for libavformat to probe it.
+ */
+
+/* The fields of a sequence parameter set (H.264 7.3.2.1) we act on */
+struct es2ts_h264_sps_s {
+	int profile_idc;
+	int constraint_flags;
+	int level_idc;
+	int sps_id;
+	int chroma_format_idc;
+	int bit_depth;		/* Luma */
+	int width;		/* Displayed size, after cropping */
+	int height;
+	int frame_mbs_only;
+	int fps_num;		/* From the VUI timing info, 0 when absent */
+	int fps_den;
+};
+
+/* Find the next NAL of the given type in an Annex-B buffer. Returns a pointer
+ * to its header byte and sets *nallen to the bytes up to the next start code,
+ * or NULL if there's no such NAL.
+ */
+const unsigned char *es2ts_h264_nal_find(const unsigned char *buf, int len, int type, int *nallen);
+
+/* Parse an SPS NAL, starting at its header byte. Returns ES2TS_OK or ES2TS_ERROR
+ * for truncated or unsupported data.
+ */
+int es2ts_h264_sps_parse(const unsigned char *nal, int len, struct es2ts_h264_sps_s *sps);
+
+#endif
@@ -0,0 +1,279 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "h264gen.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct bits_s {
+	unsigned char *ptr;
+	int len;	/* Whole bytes written */
+	int bit;	/* Bits used in ptr[len] */
+};
+
+struct h264gen_s {
+	struct h264gen_params_s p;
+	int mbs;
+	int frame;
+	int idr_id;
+	int p_size;		/* Average P frame size, bytes */
+	unsigned int rand;
+
+	unsigned char *rbsp;	/* Unescaped payload scratch */
+	unsigned char *ptr;	/* Access unit */
+	int maxlen;
+	int len;
+};
+
+static void put_bits(struct bits_s *b, int n, unsigned int v)
+{
+	while (n--) {
+		if (b->bit == 0)
+			b->ptr[b->len] = 0;
+		if ((v >> n) & 1)
+			b->ptr[b->len] |= 0x80 >> b->bit;
+		if (++b->bit == 8) {
+			b->bit = 0;
+			b->len++;
+		}
+	}
+}
+
+static void put_ue(struct bits_s *b, unsigned int v)
+{
+	int n = 0;
+	v++;
+	while ((v >> n) > 1)
+		n++;
+	put_bits(b, n, 0);
+	put_bits(b, n + 1, v);
+}
+
+static void put_se(struct bits_s *b, int v)
+{
+	put_ue(b, v > 0 ? 2 * v - 1 : -2 * v);
+}
+
+static void put_align_zero(struct bits_s *b)
+{
+	if (b->bit)
+		put_bits(b, 8 - b->bit, 0);
+}
+
+static void put_trailing(struct bits_s *b)
+{
+	put_bits(b, 1, 1);
+	put_align_zero(b);
+}
+
+/* Append a NAL with start code, inserting emulation prevention bytes */
+static void emit_nal(struct h264gen_s *g, int ref_idc, int type, const unsigned char *rbsp, int len)
+{
+	unsigned char *p = g->ptr + g->len;
+	int zeros = 0;
+
+	*p++ = 0x00;
+	*p++ = 0x00;
+	*p++ = 0x00;
+	*p++ = 0x01;
+	*p++ = (ref_idc << 5) | type;
+
+	for (int i = 0; i < len; i++) {
+		if (zeros >= 2 && rbsp[i] <= 3) {
+			*p++ = 0x03;
+			zeros = 0;
+		}
+		zeros = rbsp[i] ? 0 : zeros + 1;
+		*p++ = rbsp[i];
+	}
+
+	g->len = p - g->ptr;
+}
+
+static unsigned int next_rand(struct h264gen_s *g)
+{
+	g->rand = g->rand * 1103515245 + 12345;
+	return g->rand >> 8;
+}
+
+static void emit_sps_pps(struct h264gen_s *g)
+{
+	struct bits_s b = { g->rbsp, 0, 0 };
+
+	put_bits(&b, 8, 66);		/* profile_idc, baseline */
+	put_bits(&b, 8, 0xc0);		/* constraint_set0/1 */
+	put_bits(&b, 8, 40);		/* level_idc */
+	put_ue(&b, 0);			/* seq_parameter_set_id */
+	put_ue(&b, 4);			/* log2_max_frame_num_minus4 */
+	put_ue(&b, 2);			/* pic_order_cnt_type, output order = decode order */
+	put_ue(&b, 1);			/* max_num_ref_frames */
+	put_bits(&b, 1, 0);		/* gaps_in_frame_num_value_allowed_flag */
+	put_ue(&b, g->p.width / 16 - 1);
+	put_ue(&b, g->p.height / 16 - 1);
+	put_bits(&b, 1, 1);		/* frame_mbs_only_flag */
+	put_bits(&b, 1, 1);		/* direct_8x8_inference_flag */
+	put_bits(&b, 1, 0);		/* frame_cropping_flag */
+	put_bits(&b, 1, 0);		/* vui_parameters_present_flag */
+	put_trailing(&b);
+	emit_nal(g, 3, 7, g->rbsp, b.len);
+
+	b.len = 0;
+	put_ue(&b, 0);			/* pic_parameter_set_id */
+	put_ue(&b, 0);			/* seq_parameter_set_id */
+	put_bits(&b, 1, 0);		/* entropy_coding_mode_flag, CAVLC */
+	put_bits(&b, 1, 0);		/* bottom_field_pic_order_in_frame_present_flag */
+	put_ue(&b, 0);			/* num_slice_groups_minus1 */
+	put_ue(&b, 0);			/* num_ref_idx_l0_default_active_minus1 */
+	put_ue(&b, 0);			/* num_ref_idx_l1_default_active_minus1 */
+	put_bits(&b, 1, 0);		/* weighted_pred_flag */
+	put_bits(&b, 2, 0);		/* weighted_bipred_idc */
+	put_se(&b, 0);			/* pic_init_qp_minus26 */
+	put_se(&b, 0);			/* pic_init_qs_minus26 */
+	put_se(&b, 0);			/* chroma_qp_index_offset */
+	put_bits(&b, 1, 1);		/* deblocking_filter_control_present_flag */
+	put_bits(&b, 1, 0);		/* constrained_intra_pred_flag */
+	put_bits(&b, 1, 0);		/* redundant_pic_cnt_present_flag */
+	put_trailing(&b);
+	emit_nal(g, 3, 8, g->rbsp, b.len);
+}
+
+static void emit_slice(struct h264gen_s *g, int idr)
+{
+	struct bits_s b = { g->rbsp, 0, 0 };
+
+	put_ue(&b, 0);				/* first_mb_in_slice */
+	put_ue(&b, idr ? 7 : 5);		/* slice_type, I or P, all slices */
+	put_ue(&b, 0);				/* pic_parameter_set_id */
+	put_bits(&b, 8, g->frame % g->p.gop);	/* frame_num */
+	if (idr)
+		put_ue(&b, g->idr_id++ & 1);	/* idr_pic_id */
+	else {
+		put_bits(&b, 1, 0);		/* num_ref_idx_active_override_flag */
+		put_bits(&b, 1, 0);		/* ref_pic_list_modification_flag_l0 */
+	}
+	if (idr) {
+		put_bits(&b, 1, 0);		/* no_output_of_prior_pics_flag */
+		put_bits(&b, 1, 0);		/* long_term_reference_flag */
+	} else
+		put_bits(&b, 1, 0);		/* adaptive_ref_pic_marking_mode_flag */
+	put_se(&b, 0);				/* slice_qp_delta */
+	put_ue(&b, 1);				/* disable_deblocking_filter_idc */
+
+	if (idr) {
+		for (int mb = 0; mb < g->mbs; mb++) {
+			put_ue(&b, 25);		/* mb_type I_PCM */
+			put_align_zero(&b);
+			for (int i = 0; i < 384; i++)
+				b.ptr[b.len++] = 16 + next_rand(g) % 220;
+		}
+	} else
+		put_ue(&b, g->mbs);		/* mb_skip_run */
+	put_trailing(&b);
+
+	emit_nal(g, idr ? 3 : 2, idr ? 5 : 1, g->rbsp, b.len);
+}
+
+/* Filler data NAL, grows the access unit to roughly size bytes */
+static void emit_filler(struct h264gen_s *g, int size)
+{
+	int len = size - g->len - 6;
+	if (len <= 0)
+		return;
+
+	memset(g->rbsp, 0xff, len);
+	g->rbsp[len] = 0x80;
+	emit_nal(g, 0, 12, g->rbsp, len + 1);
+}
+
+int h264gen_alloc(struct h264gen_s **r, const struct h264gen_params_s *params)
+{
+	if ((params->width % 16) || (params->height % 16) || (params->width <= 0) || (params->height <= 0) ||
+		(params->fps <= 0) || (params->gop <= 0) || (params->bitrate <= 0))
+		return -1;
+
+	struct h264gen_s *g = calloc(1, sizeof(*g));
+	if (!g)
+		return -1;
+
+	g->p = *params;
+	g->mbs = (params->width / 16) * (params->height / 16);
+	g->rand = params->seed;
+
+	int idr_size = g->mbs * 386 + 64;
+	long long gop_bytes = (long long)params->bitrate / 8 * params->gop / params->fps;
+	g->p_size = params->gop > 1 ? (gop_bytes - idr_size) / (params->gop - 1) : 0;
+	if (g->p_size < 64)
+		g->p_size = 64;
+
+	/* Worst case frame plus emulation prevention and headers */
+	g->maxlen = (idr_size > g->p_size * 2 ? idr_size : g->p_size * 2) * 3 / 2 + 1024;
+	g->rbsp = malloc(g->maxlen);
+	g->ptr = malloc(g->maxlen);
+	if ((!g->rbsp) || (!g->ptr)) {
+		h264gen_free(g);
+		return -1;
+	}
+
+	*r = g;
+	return 0;
+}
+
+void h264gen_free(struct h264gen_s *g)
+{
+	if (!g)
+		return;
+
+	free(g->rbsp);
+	free(g->ptr);
+	free(g);
+}
+
+int h264gen_frame(struct h264gen_s *g, unsigned char **buf, int *key)
+{
+	int idr = (g->frame % g->p.gop) == 0;
+
+	g->len = 0;
+
+	/* Access unit delimiter, primary_pic_type 7 (any) */
+	unsigned char aud = 0xf0;
+	emit_nal(g, 0, 9, &aud, 1);
+
+	if (idr)
+		emit_sps_pps(g);
+	emit_slice(g, idr);
+
+	if (!idr) {
+		int size = g->p_size;
+		if (g->p.jitter)
+			size += (int)(next_rand(g) % (2 * size * g->p.jitter / 100 + 1)) - size * g->p.jitter / 100;
+		emit_filler(g, size);
+	}
+
+	g->frame++;
+	*buf = g->ptr;
+	*key = idr;
+	return g->len;
+}
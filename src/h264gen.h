@@ -0,0 +1,57 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef H264GEN_H
+#define H264GEN_H
+
+/* Synthetic but decodable H264 Annex-B stream for benchmarks.
+ * Baseline profile, CAVLC. IDR frames are all I_PCM macroblocks, P frames
+ * skip every macroblock. Filler data NALs pad frames out to the target
+ * bitrate, P frame sizes vary by +/- jitter percent.
+ */
+
+#include <stdint.h>
+
+struct h264gen_params_s {
+	int width;		/* Pixels, multiple of 16 */
+	int height;
+	int fps;
+	int gop;		/* Frames per IDR */
+	int bitrate;		/* bits/s, IDR size is fixed by resolution, P frames take the rest */
+	int jitter;		/* Percent */
+	unsigned int seed;
+};
+
+struct h264gen_s;
+
+int h264gen_alloc(struct h264gen_s **gen, const struct h264gen_params_s *params);
+void h264gen_free(struct h264gen_s *gen);
+
+/* Produce the next access unit. The buffer is valid until the next call.
+ * Returns its length, *key is set for IDR frames.
+ */
+int h264gen_frame(struct h264gen_s *gen, unsigned char **buf, int *key);
+
+#endif
@@ -29,7 +29,9 @@
 /* A library to convert H264 NAL bytes streams into a MPEG2TS formatted stream */
 
 #include <stdio.h>
+#include <stdint.h>
 #include <pthread.h>
+#include <sys/uio.h>
 #include "xorg-list.h"
 #include <libavformat/avformat.h>
 #include <libavutil/avutil.h>
@@ -43,34 +45,173 @@
 #define ES2TS_INVALID_ARG	-2
 #define ES2TS_NO_RESOURCE	-3
 
+/* es2ts_frame_enqueue() flags and timestamps */
+#define ES2TS_FRAME_KEY		(1 << 0)	/* IDR, a random access point */
+#define ES2TS_NOPTS		((int64_t)UINT64_C(0x8000000000000000))
+
+/* es2ts_producer_alloc() limit per context */
+#define ES2TS_PRODUCERS_MAX	16
+
+/* es2ts_stream_alloc() */
+#define ES2TS_STREAMS_MAX	16
+#define ES2TS_STREAM_TYPE_H264	0x1b	/* Annex-B */
+#define ES2TS_STREAM_TYPE_AAC	0x0f	/* ADTS */
+#define ES2TS_STREAM_TYPE_AC3	0x81
+
+/* Context creation flags, see es2ts_alloc_flags() */
+#define ES2TS_FLAG_NATIVE_MUX	(1 << 0)	/* Built-in H264 to TS packetizer instead of libavformat */
+#define ES2TS_FLAG_FAST_START	(1 << 1)	/* Start output at the first SPS / IDR, no stream probing */
+#define ES2TS_FLAG_LOW_LATENCY	(1 << 2)	/* Every access unit goes downstream whole as soon as it's
+						 * muxed, partial output bursts included. Best with
+						 * es2ts_frame_enqueue(), in a byte stream an access
+						 * unit only ends once the next one starts */
+
 /* Buffer / timing model is as follows:
  * 1. Upstream mechanism (the thing that generates H264 nals)
  *    generates buffers of nals. The upstream application pushes
  *    those buffers into this library via es2ts_data_enqueue().
- * 2. This library puts those buffers into a pending list.
- * 3. A library thread pulls buffers off the pending list
- *    converts the data from NALS to TS using libavformat.
+ * 2. This library copies those buffers into a lock-free ring,
+ *    or with es2ts_data_enqueue_ref(), queues a reference to them.
+ *    The ring is single producer, the enqueue functions must only
+ *    be called from one thread at a time.
+ * 3. A library thread pulls bytes out of the ring and
+ *    converts the data from NALS to TS using libavformat,
+ *    or with ES2TS_FLAG_NATIVE_MUX, the built-in packetizer.
  * 4. TS buffers are pushed downstream via a callback that the
  *    downstream application has registered.
  */
 
-extern int es2ts_debug;		/* If set to 1, additional debug information */
+extern int es2ts_debug;		/* If set to 1, thread lifecycle debug on stderr */
 
+struct es2ts_audio_s;
 struct es2ts_context_s;
+struct es2ts_engine_s;
+struct es2ts_nal_s;
+struct es2ts_producer_s;
+struct es2ts_ring_s;
+struct es2ts_shm_s;
+struct es2ts_shm_producer_s;
+struct es2ts_sink_s;
+struct es2ts_tsmux_s;
+struct es2ts_tsmux_stream_s;
 
 typedef int (*es2ts_callback)(struct es2ts_context_s *ctx, unsigned char *buf, int len);
 
+/* Vectored alternative, each iovec is a run of whole 188 byte TS packets,
+ * at most one output burst long. Hands over everything produced for an
+ * access unit in one call, suited to writev() / sendmmsg().
+ */
+typedef int (*es2ts_callback_v)(struct es2ts_context_s *ctx, const struct iovec *iov, int iovcnt);
+
+/* Called from the library thread once a buffer queued with es2ts_data_enqueue_ref()
+ * has been fully consumed, the caller owns ptr again.
+ */
+typedef void (*es2ts_release_callback)(struct es2ts_context_s *ctx, unsigned char *ptr, int len, void *opaque);
+
+/* Queued input crossed the high watermark (level ES2TS_WATERMARK_HIGH), or fell
+ * back to the low one after that. queued is the input pending, in bytes.
+ */
+#define ES2TS_WATERMARK_LOW	0
+#define ES2TS_WATERMARK_HIGH	1
+
+typedef void (*es2ts_watermark_callback)(struct es2ts_context_s *ctx, int level, uint64_t queued);
+
+/* Internal: one entry in the descriptor ring, describes the next run of input bytes */
+#define ES2TS_DESC_COPY		0	/* len bytes are waiting in the byte ring */
+#define ES2TS_DESC_REF		1	/* len bytes at ptr, owned by the caller until release */
+#define ES2TS_DESC_SHM		2	/* len bytes in the shared memory ring */
+
+struct es2ts_desc_s {
+	int type;
+	int len;
+	unsigned char *ptr;
+	es2ts_release_callback release;
+	void *opaque;
+
+	/* Set by es2ts_frame_enqueue(), these len bytes are exactly one access unit */
+	int frame;
+	unsigned int frameflags;
+	int64_t pts;
+	int64_t dts;
+
+	unsigned int seq;	/* es2ts_producer_enqueue() merge order */
+	int64_t enqueued;	/* CLOCK_MONOTONIC ns, for the queue latency histogram */
+};
+
+/* Internal: timestamps of frames handed to libavformat, in read order */
+#define ES2TS_TIMING_MAX	1024
+
+struct es2ts_timing_s {
+	int64_t pts;
+	int64_t dts;
+	unsigned int flags;
+};
+
+/* Latency histogram, nanoseconds. Log-linear like HdrHistogram: exact below 8ns,
+ * then 8 buckets per power of two (12.5% resolution) up to about 18 minutes.
+ */
+#define ES2TS_HIST_BUCKETS	304
+
+struct es2ts_histogram_s {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint64_t bucket[ES2TS_HIST_BUCKETS];
+};
+
+/* Snapshot returned by es2ts_get_stats(). Counters only ever increase.
+ * Stage timings are exclusive: demux excludes time blocked waiting for input
+ * and the mux work it triggers, mux excludes the downstream callback.
+ */
+struct es2ts_stats_s {
+	uint64_t bytes_in;		/* Accepted by the enqueue functions */
+	uint64_t bytes_consumed;	/* Taken off the input queues by the worker */
+	uint64_t bytes_out;		/* TS bytes handed to the callback */
+	uint64_t bytes_dropped;		/* Refused by the enqueue functions, queue full */
+	uint64_t queue_bytes;		/* Input pending right now */
+	uint64_t queue_free_min;	/* Low-water mark of free input ring space */
+	uint64_t first_packet;		/* ns from the first byte enqueued to the first TS byte
+					 * out since es2ts_process_start(), 0 until then */
+
+	struct es2ts_histogram_s queue;	/* Enqueue to first byte dequeued */
+	struct es2ts_histogram_s demux;	/* av_read_frame() or the NAL splitter */
+	struct es2ts_histogram_s mux;	/* av_interleaved_write_frame() or the native packetizer */
+	struct es2ts_histogram_s callback;
+};
+
 struct es2ts_context_s {
+	unsigned int flags;
+
 	pthread_t thread;
 	int threadRunning;
 	int threadTerminate;
 	int threadDone;
+	int threadFlushing;		/* Teardown, output still delivered after threadTerminate */
+
+	struct es2ts_ring_s *ring;	/* Upstream to worker bytes, lock-free SPSC */
+	struct es2ts_ring_s *descring;	/* Ordered es2ts_desc_s entries for ring and referenced bytes */
+	struct es2ts_desc_s desc;	/* Descriptor the worker is currently consuming */
+	int descrem;			/* Bytes of desc not yet consumed */
+
+	/* Worker sleeps here while the ring is empty, enqueue wakes it */
+	pthread_mutex_t waitlock;
+	pthread_cond_t waitcond;
+	int waiting;
 
-	pthread_mutex_t listlock;
-	struct xorg_list listfree;
-	struct xorg_list listbusy;
+	/* Backpressure, es2ts_enqueue_timeout_set() and es2ts_watermark_register() */
+	int enqueue_timeout;		/* ms, 0 fails at once, -1 waits for good */
+	pthread_cond_t spacecond;	/* Enqueue sleeps here while the queue is full, under waitlock */
+	int space_waiting;		/* Enqueuing threads asleep */
+	es2ts_watermark_callback wmcb;
+	uint64_t wmhigh;
+	uint64_t wmlow;
+	int wmlevel;			/* ES2TS_WATERMARK_* last signalled */
 
 	es2ts_callback cb;
+	es2ts_callback_v cbv;
+	int burst;			/* TS packets per output buffer */
+	struct es2ts_sink_s *sink;	/* es2ts_sink_attach() */
 
 	AVFormatContext *ictx;
 	AVFormatContext *octx;
@@ -82,23 +223,203 @@ struct es2ts_context_s {
 	AVOutputFormat *fmt;
 	AVStream *video_st;
 	int64_t clk;
+	struct es2ts_timing_s *timing;	/* ES2TS_TIMING_MAX entries */
+	unsigned int timing_head;
+	unsigned int timing_tail;
+
+	/* Per thread submission queues, merged in sequence order by the worker */
+	struct es2ts_producer_s *producers[ES2TS_PRODUCERS_MAX];
+	int producer_count;
+	unsigned int seq_next;		/* Sequence number the worker consumes next */
+	struct es2ts_ring_s *descsrc;	/* Byte ring behind desc when it's ES2TS_DESC_COPY */
+
+	/* es2ts_shm_alloc(), input from another process */
+	struct es2ts_shm_s *shm;
+
+	/* es2ts_get_stats(), updated with relaxed atomics as the context runs */
+	struct es2ts_stats_s stats;
+	int64_t first_in;		/* CLOCK_MONOTONIC ns of the first byte enqueued */
+
+	/* Shared worker pool, see es2ts_engine_attach() */
+	struct es2ts_engine_s *engine;
+	int engine_worker;		/* Home run queue */
+	int sched;			/* ENGINE_SCHED_* */
+	struct xorg_list runlist;
+
+	/* ES2TS_FLAG_FAST_START */
+	int started;			/* Output began at a random access point */
+	AVRational frame_rate;		/* libavformat path, from the first SPS */
+	int64_t frames;
+
+	/* ES2TS_FLAG_NATIVE_MUX */
+	struct es2ts_nal_s *nal;
+	struct es2ts_audio_s *audio;	/* In place of nal for an audio stream */
+	struct es2ts_tsmux_s *tsmux;	/* Shared with the streams of an MPTS */
+	struct es2ts_tsmux_stream_s *tsstream;
+	int64_t dts_last;		/* Of the last access unit muxed, for interleaving */
+
+	/* MPTS, es2ts_stream_alloc(). A stream is a child context that only
+	 * queues input, its parent's worker muxes it into the parent's output.
+	 */
+	struct es2ts_context_s *parent;
+	struct es2ts_context_s *streams[ES2TS_STREAMS_MAX];
+	int stream_count;
+	int program;			/* Stream: MPEG-2 program_number */
+	int stream_type;		/* Stream: ES2TS_STREAM_TYPE_* */
 };
 
 /* Allocate a process context, or free it */
 int es2ts_alloc(struct es2ts_context_s **ctx);
+int es2ts_alloc_flags(struct es2ts_context_s **ctx, unsigned int flags);
 int es2ts_free(struct es2ts_context_s *ctx);
 
 /* Downstream process can register for payload */
 int es2ts_callback_register(struct es2ts_context_s *ctx, es2ts_callback cb);
+int es2ts_callback_register_v(struct es2ts_context_s *ctx, es2ts_callback_v cbv);
 int es2ts_callback_unregister(struct es2ts_context_s *ctx);
 
-/* Upstream application pushed data into the library */
+/* TS packets per output buffer / iovec, 7 by default. Set before es2ts_process_start() */
+int es2ts_output_burst_set(struct es2ts_context_s *ctx, int packets);
+
+/* Upstream application pushed data into the library.
+ * Either all of data is queued, or none of it and ES2TS_ERROR is returned.
+ * By default a full queue fails at once, see es2ts_enqueue_timeout_set().
+ */
 int es2ts_data_enqueue(struct es2ts_context_s *ctx, unsigned char *data, int len);
 
+/* Upstream application pushes one complete access unit along with its
+ * timestamps (90KHz, dts may be ES2TS_NOPTS when equal to pts) and
+ * ES2TS_FRAME_* flags. These are carried through to the PES headers
+ * instead of the library's fixed 30fps clock. Ordered with respect to
+ * es2ts_data_enqueue() and es2ts_data_enqueue_ref().
+ */
+int es2ts_frame_enqueue(struct es2ts_context_s *ctx, unsigned char *data, int len,
+	int64_t pts, int64_t dts, unsigned int flags);
+
+/* Zero copy variant, data is read in place by the library thread and must stay
+ * valid until release_cb(ctx, data, len, opaque) is called. Ordered with respect
+ * to es2ts_data_enqueue(). Any buffers still queued are released by es2ts_free().
+ */
+int es2ts_data_enqueue_ref(struct es2ts_context_s *ctx, unsigned char *data, int len,
+	es2ts_release_callback release_cb, void *opaque);
+
+/* Backpressure. With a timeout, the enqueue functions wait up to ms
+ * milliseconds (-1 for as long as it takes) for the worker to make room
+ * instead of failing on a full queue, while the context is running. 0, the
+ * default, fails at once. Either way the input is queued whole or not at all.
+ */
+int es2ts_enqueue_timeout_set(struct es2ts_context_s *ctx, int ms);
+
+/* cb(ctx, ES2TS_WATERMARK_HIGH, queued) once the input pending reaches high
+ * bytes, then cb(ctx, ES2TS_WATERMARK_LOW, queued) once it has drained to low,
+ * and so on, e.g. for an encoder to back its bitrate off before the queue
+ * overflows. High is called from the enqueuing thread, low from the worker.
+ * A NULL cb unregisters.
+ */
+int es2ts_watermark_register(struct es2ts_context_s *ctx, uint64_t high, uint64_t low,
+	es2ts_watermark_callback cb);
+
+/* Multiple producers, e.g. the threads of a slice or frame parallel encoder.
+ * Each thread allocates its own producer before es2ts_process_start() and
+ * enqueues to it without contending with the others. Every chunk carries a
+ * sequence number, counting up from 0 across all producers of the context with
+ * no gaps, and increasing within each producer. The worker merges the queues
+ * back into sequence order, holding off until a missing number arrives.
+ * Don't mix with the es2ts_data_enqueue() family on the same context.
+ * Producers are freed along with the context.
+ */
+int es2ts_producer_alloc(struct es2ts_context_s *ctx, struct es2ts_producer_s **producer);
+int es2ts_producer_enqueue(struct es2ts_producer_s *producer, unsigned int seq,
+	unsigned char *data, int len);
+int es2ts_producer_frame_enqueue(struct es2ts_producer_s *producer, unsigned int seq,
+	unsigned char *data, int len, int64_t pts, int64_t dts, unsigned int flags);
+
+/* Shared memory input for a producer in another process, typically a
+ * sandboxed encoder. The library creates a memfd backed byte ring of size
+ * bytes (rounded up to a power of two) and an eventfd doorbell, and hands
+ * back both descriptors. They belong to ctx and close in es2ts_free(),
+ * pass them on with SCM_RIGHTS or across fork(). The worker consumes the
+ * bytes straight out of the mapping, alongside any es2ts_data_enqueue()
+ * input. Call before es2ts_process_start(), on a top level context: the
+ * streams of an MPTS context (es2ts_stream_alloc()) are refused.
+ */
+int es2ts_shm_alloc(struct es2ts_context_s *ctx, unsigned int size, int *memfd, int *doorbell);
+
+/* Producer side, in the process holding both descriptors. Writes are all
+ * or nothing: the number of bytes written, or ES2TS_NO_RESOURCE while the
+ * ring is too full, retry once the consumer has caught up. The doorbell
+ * is only rung when the consumer is idle.
+ */
+int es2ts_shm_producer_open(struct es2ts_shm_producer_s **producer, int memfd, int doorbell);
+int es2ts_shm_producer_write(struct es2ts_shm_producer_s *producer, const unsigned char *data, int len);
+void es2ts_shm_producer_close(struct es2ts_shm_producer_s *producer);
+
+/* Multi-program transport stream. Adds an elementary stream of
+ * ES2TS_STREAM_TYPE_* to program number program of a native mux context,
+ * before es2ts_process_start(). The returned stream is itself a context,
+ * feed it with es2ts_data_enqueue(), es2ts_frame_enqueue(),
+ * es2ts_data_enqueue_ref() or its own producers, but never start it or
+ * register callbacks on it. Every stream is muxed into the one output of
+ * ctx, with a shared PAT and a PMT and PCR per program, interleaved by
+ * timestamp. Audio is a byte stream of ADTS or AC-3 frames, stamped from the
+ * sample counts unless es2ts_frame_enqueue() supplies timestamps. A program's
+ * PCR rides on its first video stream. Streams are freed along with ctx.
+ */
+int es2ts_stream_alloc(struct es2ts_context_s *ctx, int program, int stream_type,
+	struct es2ts_context_s **stream);
+
 /* Start and stop the library thread from processing data */
 int es2ts_process_start(struct es2ts_context_s *ctx);
 int es2ts_process_end(struct es2ts_context_s *ctx);
 
+/* Optional shared worker pool. Rather than one thread per context, a fixed
+ * number of workers multiplex every attached context. Attach after
+ * es2ts_alloc_flags(ES2TS_FLAG_NATIVE_MUX) and before es2ts_process_start().
+ * All attached contexts must be ended before the engine is freed.
+ */
+int es2ts_engine_alloc(struct es2ts_engine_s **engine, int nthreads);
+int es2ts_engine_free(struct es2ts_engine_s *engine);
+int es2ts_engine_attach(struct es2ts_engine_s *engine, struct es2ts_context_s *ctx);
+
+/* Copy out the context statistics, safe to call from any thread at any time */
+int es2ts_get_stats(struct es2ts_context_s *ctx, struct es2ts_stats_s *stats);
+
+/* Latency below which pct percent (0 - 100) of the histogram samples fall, in ns */
+uint64_t es2ts_histogram_percentile(const struct es2ts_histogram_s *h, double pct);
+
+/* Binary event trace of the enqueue, dequeue, demux, mux and callback paths,
+ * kept per thread in a fixed size ring that overwrites its oldest entries.
+ * Off by default and toggled at any time. A dump writes every thread's
+ * records to filename, decode it with the tracedecode tool into a text
+ * timeline or Chrome trace JSON. es2ts_trace_dump_on_signal() installs a
+ * handler that dumps whenever signum arrives, e.g. SIGUSR1.
+ */
+void es2ts_trace_enable(int enable);
+int es2ts_trace_dump(const char *filename);
+int es2ts_trace_dump_on_signal(int signum, const char *filename);
+
+/* Offline conversion of a whole file, no worker thread, queues or pacing.
+ * The input is mapped rather than read, access units are muxed straight
+ * out of the mapping and the output is written in large aligned chunks.
+ * With threads above one, GOP aligned segments are muxed in parallel and
+ * stitched, the output is the same as a single threaded run.
+ * opts and stats may be NULL.
+ */
+struct es2ts_file_opts_s {
+	unsigned int flags;	/* ES2TS_FLAG_FAST_START */
+	int threads;		/* 0 or 1 on the calling thread, -1 for one per CPU, at most 64 */
+};
+
+struct es2ts_file_stats_s {
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t frames;
+	int64_t elapsed_ns;
+};
+
+int es2ts_file_transmux(const char *input, const char *output,
+	const struct es2ts_file_opts_s *opts, struct es2ts_file_stats_s *stats);
+
 /* Get version information of libes2ts in runtime */
 const char *es2ts_get_version(void);
 
@@ -0,0 +1,153 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef ES2TS_SINK_H
+#define ES2TS_SINK_H
+
+/* Library provided output sinks. A sink attached to a context consumes
+ * its transport stream in place of an application callback.
+ */
+
+#include <libes2ts/es2ts.h>
+
+struct es2ts_sink_s {
+	/* Runs of whole TS packets, called from the library thread */
+	int (*write)(struct es2ts_sink_s *sink, const struct iovec *iov, int iovcnt);
+	void (*close)(struct es2ts_sink_s *sink);
+};
+
+/* Route the output of ctx into sink, replacing any registered callback.
+ * One sink per context, the sink must outlive es2ts_process_end().
+ */
+int es2ts_sink_attach(struct es2ts_context_s *ctx, struct es2ts_sink_s *sink);
+void es2ts_sink_close(struct es2ts_sink_s *sink);
+
+/* UDP output, 7 TS packets per datagram. Datagrams are sent in batches
+ * with a single sendmsg() using UDP generic segmentation offload when the
+ * kernel supports it, otherwise with sendmmsg().
+ */
+#define ES2TS_SINK_UDP_RTP	(1 << 0)	/* RTP encapsulation, RFC 2250 payload type 33 */
+#define ES2TS_SINK_UDP_NOGSO	(1 << 1)	/* Never use UDP_SEGMENT */
+
+struct es2ts_sink_udp_opts_s {
+	unsigned int flags;	/* ES2TS_SINK_UDP_* */
+	int ttl;		/* Multicast TTL / unicast hop limit, 0 for the system default */
+	const char *ifname;	/* Outgoing interface, or NULL */
+};
+
+/* host may be IPv4 or IPv6, unicast or multicast. opts may be NULL. */
+int es2ts_sink_udp_open(struct es2ts_sink_s **sink, const char *host, int port,
+	const struct es2ts_sink_udp_opts_s *opts);
+
+/* Constant bitrate. Wraps out, a thread of its own releases the stream to it
+ * at bitrate bits/s on a timerfd schedule, filling gaps with null packets
+ * (PID 0x1FFF) and restamping every PCR to its packet's position in the
+ * output. The mux thread only queues, output beyond the queue is dropped
+ * and counted. Closing the CBR sink leaves out open.
+ */
+struct es2ts_sink_cbr_opts_s {
+	int burst;		/* Packets per write to out, default 7 (one UDP datagram), at most 64 */
+	unsigned int buffer;	/* Queue bytes, default one second at bitrate */
+	int priority;		/* SCHED_FIFO priority of the pacer, 0 to inherit */
+};
+
+struct es2ts_sink_cbr_stats_s {
+	uint64_t packets;	/* Sent, nulls included */
+	uint64_t nulls;
+	uint64_t dropped;	/* Packets lost to a full queue */
+	uint64_t write_errors;
+	uint64_t late_max_ns;	/* Worst pacer wakeup behind schedule */
+	uint64_t queue_bytes;
+};
+
+/* opts may be NULL. */
+int es2ts_sink_cbr_open(struct es2ts_sink_s **sink, struct es2ts_sink_s *out, uint64_t bitrate,
+	const struct es2ts_sink_cbr_opts_s *opts);
+int es2ts_sink_cbr_get_stats(struct es2ts_sink_s *sink, struct es2ts_sink_cbr_stats_s *stats);
+
+/* HLS in memory. The stream is cut into MPEG-TS segments at the first
+ * random access point (IDR) past the target duration, each opening with
+ * PAT / PMT, and held in a bounded ring with a live playlist alongside.
+ * Readers on any thread, typically an HTTP server, fetch the playlist and
+ * take references on segments by the URI the playlist gives them.
+ */
+struct es2ts_sink_hls_opts_s {
+	int target_ms;		/* Segment duration, default 6000 */
+	int segments;		/* Listed in the playlist, default 5, two more stay readable */
+	const char *prefix;	/* Segment URI is <prefix><sequence>.ts, default "segment" */
+};
+
+struct es2ts_hls_segment_s {
+	const unsigned char *ptr;
+	size_t len;
+	uint64_t sequence;
+	double duration;	/* Seconds */
+};
+
+/* opts may be NULL. */
+int es2ts_sink_hls_open(struct es2ts_sink_s **sink, const struct es2ts_sink_hls_opts_s *opts);
+
+/* Copy the playlist into buf, NUL terminated when it fits. Returns its
+ * length, larger than len - 1 if it didn't fit, or ES2TS_NO_RESOURCE until
+ * the first segment completes.
+ */
+int es2ts_sink_hls_playlist(struct es2ts_sink_s *sink, char *buf, size_t len);
+
+/* Look up a segment by URI and take a reference, it stays valid until
+ * es2ts_sink_hls_segment_put() even once evicted or the sink is closed.
+ * ES2TS_NO_RESOURCE when no longer (or not yet) held.
+ */
+int es2ts_sink_hls_segment_get(struct es2ts_sink_s *sink, const char *uri,
+	struct es2ts_hls_segment_s **segment);
+void es2ts_sink_hls_segment_put(struct es2ts_hls_segment_s *segment);
+
+/* Recording to a file. Output is gathered into large aligned buffers that
+ * go to disk through io_uring with registered buffers, or a writer thread
+ * of the sink's own where io_uring is missing or disallowed. The mux
+ * thread never waits on the disk: with every buffer still in flight,
+ * output is dropped and counted.
+ */
+#define ES2TS_SINK_FILE_DIRECT	(1 << 0)	/* O_DIRECT, bypass the page cache */
+#define ES2TS_SINK_FILE_NOURING	(1 << 1)	/* Always use the writer thread */
+
+struct es2ts_sink_file_opts_s {
+	unsigned int flags;		/* ES2TS_SINK_FILE_* */
+	unsigned int buffer_size;	/* Bytes, multiple of 4KB, default 1MB */
+	int buffers;			/* Default 16 */
+};
+
+struct es2ts_sink_file_stats_s {
+	uint64_t bytes;		/* On disk */
+	uint64_t dropped;	/* Bytes lost to a disk that fell behind */
+	uint64_t errors;	/* Failed writes */
+	int uring;		/* 1 with io_uring, 0 with the writer thread */
+};
+
+/* opts may be NULL. */
+int es2ts_sink_file_open(struct es2ts_sink_s **sink, const char *path,
+	const struct es2ts_sink_file_opts_s *opts);
+int es2ts_sink_file_get_stats(struct es2ts_sink_s *sink, struct es2ts_sink_file_stats_s *stats);
+
+#endif
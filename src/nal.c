@@ -0,0 +1,213 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "config.h"
+#include <libes2ts/es2ts.h>
+#include "nal.h"
+#include "startcode.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define NAL_INITIAL_SIZE (256 * 1024)
+
+int es2ts_nal_alloc(struct es2ts_nal_s **r)
+{
+	struct es2ts_nal_s *p = calloc(1, sizeof(*p));
+	if (!p)
+		return ES2TS_ERROR;
+
+	p->ptr = malloc(NAL_INITIAL_SIZE);
+	if (!p->ptr) {
+		free(p);
+		return ES2TS_ERROR;
+	}
+	p->maxlen = NAL_INITIAL_SIZE;
+
+	*r = p;
+	return ES2TS_OK;
+}
+
+void es2ts_nal_free(struct es2ts_nal_s *p)
+{
+	if (!p)
+		return;
+
+	free(p->ptr);
+	memset(p, 0, sizeof(*p));
+	free(p);
+}
+
+unsigned char *es2ts_nal_reserve(struct es2ts_nal_s *p, int len)
+{
+	if (p->maxlen - p->usedlen < (unsigned int)len) {
+		/* A single access unit outgrew the buffer, large IDR frames do this. */
+		unsigned int maxlen = p->maxlen;
+		while (maxlen - p->usedlen < (unsigned int)len)
+			maxlen *= 2;
+
+		unsigned char *ptr = realloc(p->ptr, maxlen);
+		if (!ptr)
+			return 0;
+		p->ptr = ptr;
+		p->maxlen = maxlen;
+	}
+
+	return p->ptr + p->usedlen;
+}
+
+static void au_reset(struct es2ts_nal_s *p)
+{
+	p->au_has_vcl = 0;
+	p->au_keyframe = 0;
+}
+
+/* Does a NAL of this type, seen after a slice, open the next access unit? (H.264 7.4.1.2.3) */
+static int au_boundary(struct es2ts_nal_s *p, const unsigned char *hdr)
+{
+	int type = hdr[0] & 0x1f;
+
+	if (!p->au_has_vcl)
+		return 0;
+
+	switch (type) {
+	case NAL_TYPE_SLICE:
+	case NAL_TYPE_IDR:
+		/* first_mb_in_slice is ue(v), a leading 1 bit means zero: a new picture. */
+		return (hdr[1] & 0x80) ? 1 : 0;
+	case NAL_TYPE_SEI:
+	case NAL_TYPE_SPS:
+	case NAL_TYPE_PPS:
+	case NAL_TYPE_AUD:
+	case 14: case 15: case 16: case 17: case 18:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+int es2ts_nal_commit(struct es2ts_nal_s *p, int len, es2ts_nal_au_cb cb, void *opaque)
+{
+	int ret;
+
+	p->usedlen += len;
+
+	/* We need the start code plus two header bytes before a NAL can be classified,
+	 * anything shorter is left for the next call.
+	 */
+	unsigned int i = p->scanptr;
+	while (i + 5 <= p->usedlen) {
+		unsigned char *b = p->ptr;
+
+		const unsigned char *found = es2ts_startcode_find(b + i, b + p->usedlen - 2);
+		if (!found) {
+			i = p->usedlen - 4;
+			break;
+		}
+		i = found - b;
+
+		/* Include the optional leading zero_byte of a four byte start code */
+		unsigned int sc = (i > 0 && b[i - 1] == 0) ? i - 1 : i;
+		unsigned char *hdr = b + i + 3;
+
+		if (sc > 0 && au_boundary(p, hdr)) {
+			ret = cb(opaque, b, sc, p->au_keyframe);
+			if (ES2TS_FAILED(ret))
+				return ret;
+
+			memmove(b, b + sc, p->usedlen - sc);
+			p->usedlen -= sc;
+			i -= sc;
+			hdr -= sc;
+			au_reset(p);
+		}
+
+		int type = hdr[0] & 0x1f;
+		if (type == NAL_TYPE_SLICE || type == NAL_TYPE_IDR)
+			p->au_has_vcl = 1;
+		if (type == NAL_TYPE_IDR)
+			p->au_keyframe = 1;
+
+		i += 4;
+	}
+	p->scanptr = i;
+
+	return ES2TS_OK;
+}
+
+int es2ts_nal_flush(struct es2ts_nal_s *p, es2ts_nal_au_cb cb, void *opaque)
+{
+	int ret = ES2TS_OK;
+
+	if (p->usedlen)
+		ret = cb(opaque, p->ptr, p->usedlen, p->au_keyframe);
+
+	p->usedlen = 0;
+	p->scanptr = 0;
+	au_reset(p);
+
+	return ret;
+}
+
+int es2ts_nal_split(const unsigned char *buf, size_t len, es2ts_nal_au_cb cb, void *opaque)
+{
+	struct es2ts_nal_s p;
+	const unsigned char *end = buf + len;
+	const unsigned char *au = buf;
+	const unsigned char *i = buf;
+	int ret;
+
+	memset(&p, 0, sizeof(p));
+
+	while (i + 5 <= end) {
+		i = es2ts_startcode_find(i, end - 2);
+		if (!i)
+			break;
+
+		const unsigned char *sc = (i > au && i[-1] == 0) ? i - 1 : i;
+		const unsigned char *hdr = i + 3;
+
+		if (sc > au && au_boundary(&p, hdr)) {
+			ret = cb(opaque, (unsigned char *)au, sc - au, p.au_keyframe);
+			if (ES2TS_FAILED(ret))
+				return ret;
+			au = sc;
+			au_reset(&p);
+		}
+
+		int type = hdr[0] & 0x1f;
+		if (type == NAL_TYPE_SLICE || type == NAL_TYPE_IDR)
+			p.au_has_vcl = 1;
+		if (type == NAL_TYPE_IDR)
+			p.au_keyframe = 1;
+
+		i += 4;
+	}
+
+	if (end > au)
+		return cb(opaque, (unsigned char *)au, end - au, p.au_keyframe);
+
+	return ES2TS_OK;
+}
@@ -0,0 +1,73 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef ES2TS_NAL_H
+#define ES2TS_NAL_H
+
+/* Split an Annex-B H264 byte stream into complete access units.
+ * Used by the native muxer, which has no libavformat parser to lean on.
+ */
+
+#define NAL_TYPE_SLICE		1
+#define NAL_TYPE_IDR		5
+#define NAL_TYPE_SEI		6
+#define NAL_TYPE_SPS		7
+#define NAL_TYPE_PPS		8
+#define NAL_TYPE_AUD		9
+
+struct es2ts_nal_s {
+	unsigned char *ptr;	/* Pending bitstream, always begins with an access unit */
+	unsigned int maxlen;
+	unsigned int usedlen;
+	unsigned int scanptr;	/* Next offset to search for a start code */
+
+	int au_has_vcl;		/* Current access unit contains a slice */
+	int au_keyframe;	/* Current access unit contains an IDR slice */
+};
+
+/* Called once per complete access unit. Return ES2TS_OK or an error to abort. */
+typedef int (*es2ts_nal_au_cb)(void *opaque, unsigned char *au, int len, int keyframe);
+
+int es2ts_nal_alloc(struct es2ts_nal_s **p);
+void es2ts_nal_free(struct es2ts_nal_s *p);
+
+/* Return a pointer to at least len bytes of writable space at the end of the
+ * pending bitstream. The caller fills it and hands it back via es2ts_nal_commit().
+ * Avoids staging the input in a second buffer.
+ */
+unsigned char *es2ts_nal_reserve(struct es2ts_nal_s *p, int len);
+
+/* Account for len newly written bytes, deliver every access unit that is now complete. */
+int es2ts_nal_commit(struct es2ts_nal_s *p, int len, es2ts_nal_au_cb cb, void *opaque);
+
+/* Deliver whatever is pending as a final access unit. */
+int es2ts_nal_flush(struct es2ts_nal_s *p, es2ts_nal_au_cb cb, void *opaque);
+
+/* Split a complete in-memory bitstream in place, access units point into buf.
+ * Same boundaries as reserve / commit / flush, without the copies.
+ */
+int es2ts_nal_split(const unsigned char *buf, size_t len, es2ts_nal_au_cb cb, void *opaque);
+
+#endif
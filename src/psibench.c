@@ -0,0 +1,139 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* PSI microbenchmark: CRC-32/MPEG-2 bit at a time against slicing-by-8 at
+ * section sizes, then the mux's PAT / PMT emission with the cached packets
+ * against rebuilding (and CRCing) them for every repetition. The muxed
+ * access units are a single byte so PSI dominates, as it does on a low
+ * bitrate channel.
+ *
+ * psibench [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <libes2ts/es2ts.h>
+#include "crc32.h"
+#include "tsmux.h"
+
+static int iterations = 1000000;
+
+static double now_secs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int discard(void *opaque, const struct iovec *iov, int iovcnt)
+{
+	unsigned long *packets = opaque;
+
+	for (int i = 0; i < iovcnt; i++)
+		*packets += iov[i].iov_len / TS_PACKET_SIZE;
+
+	return ES2TS_OK;
+}
+
+static void bench_crc(void)
+{
+	static const int sizes[] = { 12, 26, 183, 4096 };
+	unsigned char buf[4096];
+
+	srand(1);
+	for (unsigned int i = 0; i < sizeof(buf); i++)
+		buf[i] = rand();
+
+	for (unsigned int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		int len = sizes[s];
+		int n = iterations * 16 / len;
+		volatile uint32_t sink = 0;
+
+		double start = now_secs();
+		for (int i = 0; i < n; i++)
+			sink ^= es2ts_crc32_mpeg_bitwise(buf, len);
+		double bitwise = (now_secs() - start) / n;
+
+		start = now_secs();
+		for (int i = 0; i < n; i++)
+			sink ^= es2ts_crc32_mpeg(buf, len);
+		double slice8 = (now_secs() - start) / n;
+
+		printf("crc %4d bytes  bitwise %8.1f ns  slice8 %7.1f ns  %5.1fx%s\n", len,
+			bitwise * 1e9, slice8 * 1e9, bitwise / slice8,
+			es2ts_crc32_mpeg(buf, len) == es2ts_crc32_mpeg_bitwise(buf, len) ? "" : "  MISMATCH");
+	}
+}
+
+/* Every access unit a video keyframe, each one brings PAT and PMT forward */
+static double bench_psi(int rebuild, unsigned long *packets)
+{
+	struct es2ts_tsmux_s *mux;
+	struct es2ts_tsmux_stream_s *video, *audio;
+	unsigned char au = 0x09;
+
+	*packets = 0;
+	if (ES2TS_FAILED(es2ts_tsmux_alloc(&mux, 7, discard, packets)) ||
+		ES2TS_FAILED(es2ts_tsmux_stream_add(mux, 1, TS_STREAM_TYPE_H264, &video)) ||
+		ES2TS_FAILED(es2ts_tsmux_stream_add(mux, 1, TS_STREAM_TYPE_AC3, &audio)))
+		exit(1);
+
+	double start = now_secs();
+	for (int i = 0; i < iterations; i++) {
+		/* What every repetition cost before the packets were cached */
+		if (rebuild)
+			mux->psi_valid = 0;
+		es2ts_tsmux_write_au(mux, video, &au, 1, i * 3000, i * 3000, 1);
+	}
+	es2ts_tsmux_flush(mux);
+	double elapsed = now_secs() - start;
+
+	es2ts_tsmux_free(mux);
+	return elapsed / iterations;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long cached_packets, rebuilt_packets;
+
+	if (argc > 1)
+		iterations = atoi(argv[1]);
+	if (iterations <= 0) {
+		fprintf(stderr, "usage: psibench [iterations]\n");
+		return 1;
+	}
+
+	bench_crc();
+
+	double rebuilt = bench_psi(1, &rebuilt_packets);
+	double cached = bench_psi(0, &cached_packets);
+	printf("psi + 1 byte AU  rebuilt %6.1f ns  cached %6.1f ns  %5.1fx%s\n",
+		rebuilt * 1e9, cached * 1e9, rebuilt / cached,
+		cached_packets == rebuilt_packets ? "" : "  MISMATCH");
+
+	return 0;
+}
@@ -0,0 +1,127 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "ring.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define load_acquire(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+int es2ts_ring_alloc(struct es2ts_ring_s **r, unsigned int size)
+{
+	struct es2ts_ring_s *ring;
+	unsigned int pow2 = 1;
+
+	if ((size == 0) || (size > 0x80000000))
+		return -1;
+	while (pow2 < size)
+		pow2 <<= 1;
+
+	if (posix_memalign((void **)&ring, ES2TS_CACHELINE, sizeof(*ring)))
+		return -1;
+	memset(ring, 0, sizeof(*ring));
+
+	if (posix_memalign((void **)&ring->ptr, ES2TS_CACHELINE, pow2)) {
+		free(ring);
+		return -1;
+	}
+	ring->size = pow2;
+	ring->mask = pow2 - 1;
+
+	*r = ring;
+	return 0;
+}
+
+void es2ts_ring_free(struct es2ts_ring_s *ring)
+{
+	if (!ring)
+		return;
+
+	free(ring->ptr);
+	memset(ring, 0, sizeof(*ring));
+	free(ring);
+}
+
+int es2ts_ring_write(struct es2ts_ring_s *ring, const unsigned char *data, unsigned int len)
+{
+	unsigned int head = ring->head;
+
+	if (ring->size - (head - ring->tail_cache) < len) {
+		ring->tail_cache = load_acquire(&ring->tail);
+		if (ring->size - (head - ring->tail_cache) < len)
+			return -1;
+	}
+
+	unsigned int idx = head & ring->mask;
+	unsigned int cplen = ring->size - idx;
+	if (cplen > len)
+		cplen = len;
+
+	memcpy(ring->ptr + idx, data, cplen);
+	memcpy(ring->ptr, data + cplen, len - cplen);
+
+	store_release(&ring->head, head + len);
+
+	return 0;
+}
+
+unsigned int es2ts_ring_read(struct es2ts_ring_s *ring, unsigned char *data, unsigned int len)
+{
+	unsigned int tail = ring->tail;
+
+	if (ring->head_cache - tail < len)
+		ring->head_cache = load_acquire(&ring->head);
+
+	unsigned int avail = ring->head_cache - tail;
+	if (avail == 0)
+		return 0;
+	if (len > avail)
+		len = avail;
+
+	unsigned int idx = tail & ring->mask;
+	unsigned int cplen = ring->size - idx;
+	if (cplen > len)
+		cplen = len;
+
+	memcpy(data, ring->ptr + idx, cplen);
+	memcpy(data + cplen, ring->ptr, len - cplen);
+
+	store_release(&ring->tail, tail + len);
+
+	return len;
+}
+
+unsigned int es2ts_ring_used(struct es2ts_ring_s *ring)
+{
+	return load_acquire(&ring->head) - load_acquire(&ring->tail);
+}
+
+unsigned int es2ts_ring_avail(struct es2ts_ring_s *ring)
+{
+	ring->tail_cache = load_acquire(&ring->tail);
+	return ring->size - (ring->head - ring->tail_cache);
+}
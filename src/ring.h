@@ -0,0 +1,68 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef ES2TS_RING_H
+#define ES2TS_RING_H
+
+/* Single producer / single consumer lock-free byte ring.
+ * One thread writes, one thread reads, neither ever takes a lock.
+ * head and tail are free running counters on their own cache lines,
+ * each side keeps a private copy of the other's counter and only
+ * reloads it when the ring looks full (producer) or empty (consumer).
+ */
+
+#define ES2TS_CACHELINE 64
+
+struct es2ts_ring_s {
+	unsigned char *ptr;
+	unsigned int size;	/* Power of two */
+	unsigned int mask;
+
+	/* Producer owned */
+	unsigned int head __attribute__((aligned(ES2TS_CACHELINE)));
+	unsigned int tail_cache;
+
+	/* Consumer owned */
+	unsigned int tail __attribute__((aligned(ES2TS_CACHELINE)));
+	unsigned int head_cache;
+} __attribute__((aligned(ES2TS_CACHELINE)));
+
+/* size is rounded up to the next power of two */
+int es2ts_ring_alloc(struct es2ts_ring_s **ring, unsigned int size);
+void es2ts_ring_free(struct es2ts_ring_s *ring);
+
+/* Producer: all or nothing, returns 0 or -1 when len bytes don't fit */
+int es2ts_ring_write(struct es2ts_ring_s *ring, const unsigned char *data, unsigned int len);
+
+/* Consumer: copy out up to len bytes, returns the number of bytes read */
+unsigned int es2ts_ring_read(struct es2ts_ring_s *ring, unsigned char *data, unsigned int len);
+
+/* Bytes pending, safe to call from either side */
+unsigned int es2ts_ring_used(struct es2ts_ring_s *ring);
+
+/* Producer: bytes that can be written right now */
+unsigned int es2ts_ring_avail(struct es2ts_ring_s *ring);
+
+#endif
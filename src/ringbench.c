@@ -0,0 +1,222 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* Contention microbenchmark: the lock-free SPSC ring against the mutex
+ * protected listfree/listbusy buffer pool it replaced. One producer thread
+ * enqueues NAL sized chunks while one consumer thread drains them, the way
+ * an encoder thread and the library worker share a context.
+ *
+ * ringbench [chunk bytes] [total MB] [read bytes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "libes2ts/xorg-list.h"
+#include "ring.h"
+
+#define MAX_BUFFERS	256
+#define MAX_BUFFER_SIZE 32768
+
+static unsigned int chunk = 1400;
+static unsigned int readlen = 7 * 188;
+static unsigned long long total = 1024ULL * 1024 * 1024;
+
+/* The previous mutex + list transport, reduced to its hot path */
+struct list_buffer_s {
+	struct xorg_list list;
+	unsigned char *ptr;
+	unsigned int maxlen;
+	unsigned int usedlen;
+	unsigned int readptr;
+};
+
+struct list_queue_s {
+	pthread_mutex_t listlock;
+	struct xorg_list listfree;
+	struct xorg_list listbusy;
+};
+
+static void list_init(struct list_queue_s *q)
+{
+	pthread_mutex_init(&q->listlock, NULL);
+	xorg_list_init(&q->listfree);
+	xorg_list_init(&q->listbusy);
+	for (int i = 0; i < MAX_BUFFERS; i++) {
+		struct list_buffer_s *buf = calloc(1, sizeof(*buf));
+		buf->ptr = calloc(1, MAX_BUFFER_SIZE);
+		buf->maxlen = MAX_BUFFER_SIZE;
+		xorg_list_add(&buf->list, &q->listfree);
+	}
+}
+
+static int list_write(struct list_queue_s *q, const unsigned char *data, unsigned int len)
+{
+	int ret = 0;
+	unsigned int idx = 0;
+
+	pthread_mutex_lock(&q->listlock);
+	while (idx < len) {
+		if (xorg_list_is_empty(&q->listfree)) {
+			ret = -1;
+			break;
+		}
+		struct list_buffer_s *buf = xorg_list_first_entry(&q->listfree, struct list_buffer_s, list);
+		unsigned int cplen = buf->maxlen - buf->usedlen;
+		if (cplen > len - idx)
+			cplen = len - idx;
+		memcpy(buf->ptr + buf->usedlen, data + idx, cplen);
+		buf->usedlen += cplen;
+		idx += cplen;
+		if (buf->usedlen == buf->maxlen || idx == len) {
+			xorg_list_del(&buf->list);
+			xorg_list_append(&buf->list, &q->listbusy);
+		}
+	}
+	pthread_mutex_unlock(&q->listlock);
+
+	return ret;
+}
+
+static unsigned int list_read(struct list_queue_s *q, unsigned char *data, unsigned int len)
+{
+	unsigned int idx = 0;
+
+	pthread_mutex_lock(&q->listlock);
+	while (idx < len && !xorg_list_is_empty(&q->listbusy)) {
+		struct list_buffer_s *buf = xorg_list_first_entry(&q->listbusy, struct list_buffer_s, list);
+		unsigned int cplen = buf->usedlen - buf->readptr;
+		if (cplen > len - idx)
+			cplen = len - idx;
+		memcpy(data + idx, buf->ptr + buf->readptr, cplen);
+		buf->readptr += cplen;
+		idx += cplen;
+		if (buf->readptr == buf->usedlen) {
+			xorg_list_del(&buf->list);
+			memset(buf->ptr, 0, buf->maxlen);
+			buf->usedlen = 0;
+			buf->readptr = 0;
+			xorg_list_append(&buf->list, &q->listfree);
+		}
+	}
+	pthread_mutex_unlock(&q->listlock);
+
+	return idx;
+}
+
+struct bench_s {
+	const char *name;
+	int (*write)(void *q, const unsigned char *data, unsigned int len);
+	unsigned int (*read)(void *q, unsigned char *data, unsigned int len);
+	void *q;
+	unsigned long long full;
+	unsigned long long empty;
+};
+
+static int bench_list_write(void *q, const unsigned char *d, unsigned int l) { return list_write(q, d, l); }
+static unsigned int bench_list_read(void *q, unsigned char *d, unsigned int l) { return list_read(q, d, l); }
+static int bench_ring_write(void *q, const unsigned char *d, unsigned int l) { return es2ts_ring_write(q, d, l); }
+static unsigned int bench_ring_read(void *q, unsigned char *d, unsigned int l) { return es2ts_ring_read(q, d, l); }
+
+static void *producer(void *p)
+{
+	struct bench_s *b = p;
+	unsigned char *data = malloc(chunk);
+	memset(data, 0xa5, chunk);
+
+	for (unsigned long long sent = 0; sent < total; sent += chunk) {
+		while (b->write(b->q, data, chunk) < 0) {
+			b->full++;
+			sched_yield();
+		}
+	}
+
+	free(data);
+	return NULL;
+}
+
+static double now_secs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(struct bench_s *b)
+{
+	pthread_t thread;
+	unsigned char *data = malloc(readlen);
+	unsigned long long expected = (total + chunk - 1) / chunk * chunk;
+	unsigned long long received = 0;
+
+	double start = now_secs();
+	pthread_create(&thread, NULL, producer, b);
+	while (received < expected) {
+		unsigned int n = b->read(b->q, data, readlen);
+		if (n == 0)
+			b->empty++;
+		received += n;
+	}
+	pthread_join(thread, NULL);
+	double elapsed = now_secs() - start;
+
+	printf("%-6s chunk %6u read %6u: %8.1f MB/s %10.0f chunks/s  full %llu empty %llu\n",
+		b->name, chunk, readlen,
+		received / elapsed / 1e6, received / chunk / elapsed,
+		b->full, b->empty);
+
+	free(data);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1)
+		chunk = atoi(argv[1]);
+	if (argc > 2)
+		total = atoll(argv[2]) * 1024 * 1024;
+	if (argc > 3)
+		readlen = atoi(argv[3]);
+	if (chunk == 0 || readlen == 0) {
+		fprintf(stderr, "usage: %s [chunk bytes] [total MB] [read bytes]\n", argv[0]);
+		return 1;
+	}
+
+	struct list_queue_s lq;
+	list_init(&lq);
+	struct bench_s list = { "list", bench_list_write, bench_list_read, &lq, 0, 0 };
+	run(&list);
+
+	struct es2ts_ring_s *ring;
+	if (es2ts_ring_alloc(&ring, MAX_BUFFERS * MAX_BUFFER_SIZE) < 0)
+		return 1;
+	struct bench_s rb = { "ring", bench_ring_write, bench_ring_read, ring, 0, 0 };
+	run(&rb);
+	es2ts_ring_free(ring);
+
+	return 0;
+}
@@ -0,0 +1,135 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* Start code scanner microbenchmark: the scalar reference against the SSE2
+ * and AVX2 versions, over a synthetic Annex-B buffer of random slice data
+ * with emulation prevention applied, as an encoder would emit it.
+ *
+ * scanbench [buffer MB] [NAL bytes] [passes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "startcode.h"
+
+static unsigned int buflen = 64 * 1024 * 1024;
+static unsigned int nallen = 16 * 1024;
+static int passes = 10;
+
+static double now_secs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Random NAL payloads behind four byte start codes, 00 00 0x (x <= 3) escaped */
+static void fill(unsigned char *buf, unsigned int len)
+{
+	unsigned int zeros = 0;
+
+	srand(1);
+	for (unsigned int i = 0; i < len; i++) {
+		if (i % nallen == 0 && i + 5 <= len) {
+			memcpy(buf + i, "\x00\x00\x00\x01\x41", 5);
+			i += 4;
+			zeros = 0;
+			continue;
+		}
+
+		/* Bias towards zero bytes so the scanners see near misses */
+		unsigned char b = (rand() % 8 == 0) ? 0 : rand();
+		if (zeros >= 2 && b <= 3) {
+			buf[i] = 0x03;
+			zeros = 0;
+			continue;
+		}
+		zeros = b ? 0 : zeros + 1;
+		buf[i] = b;
+	}
+}
+
+static unsigned long count(es2ts_startcode_fn fn, const unsigned char *buf, unsigned int len)
+{
+	const unsigned char *p = buf;
+	const unsigned char *end = buf + len;
+	unsigned long n = 0;
+
+	while ((p = fn(p, end))) {
+		n++;
+		p += 3;
+	}
+
+	return n;
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *names[] = { "scalar", "sse2", "avx2" };
+
+	if (argc > 1)
+		buflen = atoi(argv[1]) * 1024 * 1024;
+	if (argc > 2)
+		nallen = atoi(argv[2]);
+	if (argc > 3)
+		passes = atoi(argv[3]);
+	if (buflen == 0 || nallen < 8 || passes <= 0) {
+		fprintf(stderr, "usage: scanbench [buffer MB] [NAL bytes] [passes]\n");
+		return 1;
+	}
+
+	unsigned char *buf = malloc(buflen);
+	if (!buf)
+		return 1;
+	fill(buf, buflen);
+
+	unsigned long expected = count(es2ts_startcode_impl(STARTCODE_SCALAR), buf, buflen);
+	double base = 0;
+
+	for (int isa = STARTCODE_SCALAR; isa <= STARTCODE_AVX2; isa++) {
+		es2ts_startcode_fn fn = es2ts_startcode_impl(isa);
+		if (!fn) {
+			printf("%-6s unsupported\n", names[isa]);
+			continue;
+		}
+
+		unsigned long n = 0;
+		double start = now_secs();
+		for (int i = 0; i < passes; i++)
+			n += count(fn, buf, buflen);
+		double elapsed = now_secs() - start;
+
+		double gbs = (double)buflen * passes / elapsed / 1e9;
+		if (isa == STARTCODE_SCALAR)
+			base = gbs;
+		printf("%-6s %8.2f GB/s  %5.1fx  %lu start codes%s\n", names[isa], gbs, gbs / base,
+			n / passes, n == expected * passes ? "" : "  MISMATCH");
+	}
+
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,249 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#define _GNU_SOURCE	/* memfd_create(), F_ADD_SEALS */
+
+#include "config.h"
+#include <libes2ts/es2ts.h>
+#include "shm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+#define load_acquire(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+#define SHM_SIZE_MIN		(64 * 1024)
+#define SHM_SIZE_MAX		(1U << 30)
+
+int es2ts_shm_create(struct es2ts_shm_s **r, unsigned int size)
+{
+	unsigned int pow2 = SHM_SIZE_MIN;
+
+	if ((!r) || (size > SHM_SIZE_MAX))
+		return ES2TS_INVALID_ARG;
+	while (pow2 < size)
+		pow2 <<= 1;
+
+	struct es2ts_shm_s *shm = calloc(1, sizeof(*shm));
+	if (!shm)
+		return ES2TS_ERROR;
+	shm->memfd = -1;
+	shm->doorbell = -1;
+	shm->size = pow2;
+	shm->mask = pow2 - 1;
+
+	/* Sealed at its size, a producer can't shrink it from under our mapping */
+	size_t maplen = ES2TS_SHM_DATA + pow2;
+	shm->memfd = memfd_create("es2ts", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (shm->memfd < 0 || ftruncate(shm->memfd, maplen) < 0 ||
+		fcntl(shm->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0)
+		goto err;
+
+	shm->hdr = mmap(0, maplen, PROT_READ | PROT_WRITE, MAP_SHARED, shm->memfd, 0);
+	if (shm->hdr == MAP_FAILED) {
+		shm->hdr = 0;
+		goto err;
+	}
+	shm->data = (unsigned char *)shm->hdr + ES2TS_SHM_DATA;
+	shm->hdr->size = pow2;
+	shm->hdr->version = ES2TS_SHM_VERSION;
+	store_release(&shm->hdr->magic, ES2TS_SHM_MAGIC);
+
+	/* Never read blocking, the consumer polls it and drains what's there */
+	shm->doorbell = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (shm->doorbell < 0)
+		goto err;
+
+	*r = shm;
+	return ES2TS_OK;
+
+err:
+	fprintf(stderr, "unable to create shared input ring\n");
+	es2ts_shm_destroy(shm);
+	return ES2TS_ERROR;
+}
+
+void es2ts_shm_destroy(struct es2ts_shm_s *shm)
+{
+	if (!shm)
+		return;
+
+	if (shm->doorbell >= 0)
+		close(shm->doorbell);
+	if (shm->hdr)
+		munmap(shm->hdr, ES2TS_SHM_DATA + shm->size);
+	if (shm->memfd >= 0)
+		close(shm->memfd);
+	memset(shm, 0, sizeof(*shm));
+	free(shm);
+}
+
+void es2ts_shm_doorbell_ring(struct es2ts_shm_s *shm)
+{
+	uint64_t one = 1;
+
+	/* Only fails with the counter near overflow, when it's readable anyway */
+	if (write(shm->doorbell, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		fprintf(stderr, "unable to ring the shared input doorbell\n");
+}
+
+void es2ts_shm_doorbell_drain(struct es2ts_shm_s *shm)
+{
+	uint64_t v;
+
+	while (read(shm->doorbell, &v, sizeof(v)) < 0 && errno == EINTR)
+		;
+}
+
+void es2ts_shm_doorbell_wait(struct es2ts_shm_s *shm)
+{
+	struct pollfd pfd = { shm->doorbell, POLLIN, 0 };
+
+	if (poll(&pfd, 1, -1) > 0)
+		es2ts_shm_doorbell_drain(shm);
+}
+
+unsigned int es2ts_shm_used(struct es2ts_shm_s *shm)
+{
+	if (shm->broken)
+		return 0;
+
+	unsigned int used = load_acquire(&shm->hdr->head) - shm->tail;
+	if (used == 0) {
+		/* Same handshake as es2ts_data_wait(), waiting is visible before the recheck */
+		__atomic_store_n(&shm->hdr->waiting, 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		used = load_acquire(&shm->hdr->head) - shm->tail;
+	}
+
+	if (used > shm->size) {
+		fprintf(stderr, "shared input ring corrupt, head %u tail %u\n", shm->hdr->head, shm->tail);
+		shm->broken = 1;
+		return 0;
+	}
+
+	return used;
+}
+
+void es2ts_shm_read(struct es2ts_shm_s *shm, unsigned char *data, unsigned int len)
+{
+	unsigned int idx = shm->tail & shm->mask;
+	unsigned int cplen = shm->size - idx;
+
+	if (cplen > len)
+		cplen = len;
+	memcpy(data, shm->data + idx, cplen);
+	memcpy(data + cplen, shm->data, len - cplen);
+
+	shm->tail += len;
+	store_release(&shm->hdr->tail, shm->tail);
+}
+
+int es2ts_shm_producer_open(struct es2ts_shm_producer_s **r, int memfd, int doorbell)
+{
+	struct stat st;
+
+	if ((!r) || (memfd < 0) || (doorbell < 0))
+		return ES2TS_INVALID_ARG;
+	if (fstat(memfd, &st) < 0 || st.st_size <= ES2TS_SHM_DATA)
+		return ES2TS_INVALID_ARG;
+
+	struct es2ts_shm_producer_s *p = calloc(1, sizeof(*p));
+	if (!p)
+		return ES2TS_ERROR;
+
+	p->maplen = st.st_size;
+	p->hdr = mmap(0, p->maplen, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (p->hdr == MAP_FAILED) {
+		free(p);
+		return ES2TS_ERROR;
+	}
+
+	struct es2ts_shm_header_s *hdr = p->hdr;
+	if (load_acquire(&hdr->magic) != ES2TS_SHM_MAGIC || hdr->version != ES2TS_SHM_VERSION ||
+		hdr->size == 0 || (hdr->size & (hdr->size - 1)) || ES2TS_SHM_DATA + (size_t)hdr->size != p->maplen) {
+		munmap(p->hdr, p->maplen);
+		free(p);
+		return ES2TS_INVALID_ARG;
+	}
+
+	p->data = (unsigned char *)hdr + ES2TS_SHM_DATA;
+	p->size = hdr->size;
+	p->mask = hdr->size - 1;
+	p->head = hdr->head;
+	p->doorbell = doorbell;
+
+	*r = p;
+	return ES2TS_OK;
+}
+
+void es2ts_shm_producer_close(struct es2ts_shm_producer_s *p)
+{
+	if (!p)
+		return;
+
+	munmap(p->hdr, p->maplen);
+	memset(p, 0, sizeof(*p));
+	free(p);
+}
+
+int es2ts_shm_producer_write(struct es2ts_shm_producer_s *p, const unsigned char *data, int len)
+{
+	if ((!p) || (!data) || (len <= 0) || ((unsigned int)len > p->size))
+		return ES2TS_INVALID_ARG;
+
+	if (p->size - (p->head - load_acquire(&p->hdr->tail)) < (unsigned int)len)
+		return ES2TS_NO_RESOURCE;
+
+	unsigned int idx = p->head & p->mask;
+	unsigned int cplen = p->size - idx;
+	if (cplen > (unsigned int)len)
+		cplen = len;
+	memcpy(p->data + idx, data, cplen);
+	memcpy(p->data, data + cplen, len - cplen);
+
+	p->head += len;
+	store_release(&p->hdr->head, p->head);
+
+	/* Only a consumer that found the ring empty needs the syscall */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&p->hdr->waiting, __ATOMIC_RELAXED) &&
+		__atomic_exchange_n(&p->hdr->waiting, 0, __ATOMIC_RELAXED)) {
+		uint64_t one = 1;
+		if (write(p->doorbell, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			return ES2TS_ERROR;
+	}
+
+	return len;
+}
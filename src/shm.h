@@ -0,0 +1,99 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef ES2TS_SHM_H
+#define ES2TS_SHM_H
+
+/* Input ring in a memfd shared with a producer in another process.
+ * Single producer / single consumer like ring.h, free running head and
+ * tail in a header page ahead of the data. The consumer sets waiting when
+ * it finds the ring empty, a producer that then publishes clears it and
+ * rings the eventfd doorbell. The consumer's worker sleeps on the doorbell
+ * itself, or an engine polls it, so local wakeups ring it as well.
+ * Nothing in the mapping is trusted by the consumer beyond head, which
+ * is bounds checked on every load.
+ */
+
+#include <stdint.h>
+
+#define ES2TS_SHM_MAGIC		0x53543245	/* "E2TS" */
+#define ES2TS_SHM_VERSION	1
+#define ES2TS_SHM_DATA		4096		/* Data offset, the header has a page to itself */
+
+struct es2ts_shm_header_s {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;		/* Data bytes, power of two */
+
+	/* Producer owned */
+	uint32_t head __attribute__((aligned(64)));
+
+	/* Consumer owned, but the producer clears waiting */
+	uint32_t tail __attribute__((aligned(64)));
+	uint32_t waiting;
+};
+
+struct es2ts_shm_s {
+	struct es2ts_shm_header_s *hdr;
+	unsigned char *data;
+	unsigned int size;
+	unsigned int mask;
+	unsigned int tail;	/* Private copy, the shared one is only ever stored */
+	int broken;		/* The producer published a head out of range */
+
+	int memfd;
+	int doorbell;		/* eventfd, non-blocking */
+};
+
+struct es2ts_shm_producer_s {
+	struct es2ts_shm_header_s *hdr;
+	unsigned char *data;
+	unsigned int size;
+	unsigned int mask;
+	unsigned int head;
+	size_t maplen;
+	int doorbell;
+};
+
+/* Consumer: size is rounded up to a power of two */
+int es2ts_shm_create(struct es2ts_shm_s **shm, unsigned int size);
+void es2ts_shm_destroy(struct es2ts_shm_s *shm);
+
+/* Consumer: wake whoever sleeps on the doorbell, sleep on it, or clear it */
+void es2ts_shm_doorbell_ring(struct es2ts_shm_s *shm);
+void es2ts_shm_doorbell_wait(struct es2ts_shm_s *shm);
+void es2ts_shm_doorbell_drain(struct es2ts_shm_s *shm);
+
+/* Consumer: bytes pending. When there are none the producer is asked to
+ * ring the doorbell on its next publish.
+ */
+unsigned int es2ts_shm_used(struct es2ts_shm_s *shm);
+
+/* Consumer: copy out len bytes, no more than es2ts_shm_used() said were there */
+void es2ts_shm_read(struct es2ts_shm_s *shm, unsigned char *data, unsigned int len);
+
+/* Producer: es2ts_shm_producer_open() / _write() / _close() in es2ts.h */
+
+#endif
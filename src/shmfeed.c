@@ -0,0 +1,235 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* Two process sample of the shared memory input. The child stands in for
+ * a sandboxed encoder: it receives the ring and doorbell descriptors over
+ * a Unix socket and writes an H264 file into the ring. The parent muxes
+ * what arrives into a transport stream file, then checks it against the
+ * offline transmux of the same input.
+ *
+ * shmfeed input.h264 output.ts
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <libes2ts/es2ts.h>
+
+#define FEED_CHUNK	4096
+#define FEED_RING	(4 * 1024 * 1024)
+
+static FILE *fo;
+
+static int output(struct es2ts_context_s *ctx, unsigned char *buf, int len)
+{
+	return fwrite(buf, 1, len, fo) == (size_t)len ? ES2TS_OK : ES2TS_ERROR;
+}
+
+/* Byte compare two files, offset of the first difference or -1 when equal */
+static long long compare_files(const char *a, const char *b)
+{
+	FILE *fa = fopen(a, "rb");
+	FILE *fb = fopen(b, "rb");
+	long long pos = 0, ret = 0;
+
+	if (fa && fb) {
+		while (1) {
+			int ca = fgetc(fa);
+			int cb = fgetc(fb);
+			if (ca != cb) {
+				ret = pos;
+				break;
+			}
+			if (ca == EOF) {
+				ret = -1;
+				break;
+			}
+			pos++;
+		}
+	}
+	if (fa)
+		fclose(fa);
+	if (fb)
+		fclose(fb);
+	return ret;
+}
+
+static int send_fds(int sock, int memfd, int doorbell)
+{
+	char cbuf[CMSG_SPACE(2 * sizeof(int))];
+	char byte = 0;
+	struct iovec iov = { &byte, 1 };
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(cbuf, 0, sizeof(cbuf));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+	int fds[2] = { memfd, doorbell };
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	return sendmsg(sock, &msg, 0) == 1 ? 0 : -1;
+}
+
+static int recv_fds(int sock, int *memfd, int *doorbell)
+{
+	char cbuf[CMSG_SPACE(2 * sizeof(int))];
+	char byte;
+	struct iovec iov = { &byte, 1 };
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	if (recvmsg(sock, &msg, 0) != 1)
+		return -1;
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int)))
+		return -1;
+
+	int fds[2];
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+	*memfd = fds[0];
+	*doorbell = fds[1];
+	return 0;
+}
+
+/* The encoder process, it never sees the context, only the two descriptors */
+static int producer(int sock, const char *input)
+{
+	struct es2ts_shm_producer_s *p;
+	unsigned char buf[FEED_CHUNK];
+	unsigned long long total = 0;
+	int memfd, doorbell;
+	size_t n;
+
+	FILE *fi = fopen(input, "rb");
+	if (!fi || recv_fds(sock, &memfd, &doorbell) < 0)
+		return 1;
+	if (ES2TS_FAILED(es2ts_shm_producer_open(&p, memfd, doorbell)))
+		return 1;
+
+	while ((n = fread(buf, 1, sizeof(buf), fi)) > 0) {
+		int ret;
+		while ((ret = es2ts_shm_producer_write(p, buf, n)) == ES2TS_NO_RESOURCE)
+			usleep(1000);
+		if (ES2TS_FAILED(ret))
+			return 1;
+		total += n;
+	}
+
+	/* Tell the consumer how much to expect before it shuts down */
+	if (write(sock, &total, sizeof(total)) != sizeof(total))
+		return 1;
+
+	es2ts_shm_producer_close(p);
+	fclose(fi);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct es2ts_context_s *ctx;
+	unsigned long long total;
+	int sv[2], memfd, doorbell;
+
+	if (argc != 3) {
+		fprintf(stderr, "usage: shmfeed input.h264 output.ts\n");
+		return 1;
+	}
+
+	/* Fork before the library starts any threads */
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0)
+		return 1;
+	pid_t pid = fork();
+	if (pid < 0)
+		return 1;
+	if (pid == 0) {
+		close(sv[0]);
+		return producer(sv[1], argv[1]);
+	}
+	close(sv[1]);
+
+	fo = fopen(argv[2], "wb");
+	if (!fo)
+		return 1;
+
+	if (ES2TS_FAILED(es2ts_alloc_flags(&ctx, ES2TS_FLAG_NATIVE_MUX)) ||
+		ES2TS_FAILED(es2ts_callback_register(ctx, output)) ||
+		ES2TS_FAILED(es2ts_shm_alloc(ctx, FEED_RING, &memfd, &doorbell)) ||
+		ES2TS_FAILED(es2ts_process_start(ctx)))
+		return 1;
+
+	if (send_fds(sv[0], memfd, doorbell) < 0 || read(sv[0], &total, sizeof(total)) != sizeof(total)) {
+		fprintf(stderr, "producer failed\n");
+		return 1;
+	}
+
+	/* Drain what the producer left in the ring */
+	struct es2ts_stats_s stats;
+	do {
+		usleep(10000);
+		es2ts_get_stats(ctx, &stats);
+	} while (stats.bytes_consumed < total);
+
+	es2ts_process_end(ctx);
+	waitpid(pid, 0, 0);
+	printf("%llu bytes in, %llu bytes out\n", total, (unsigned long long)stats.bytes_out);
+
+	es2ts_callback_unregister(ctx);
+	es2ts_free(ctx);
+	fclose(fo);
+
+	/* The live path, tail flush included, must match the offline one */
+	char ref[4096];
+	snprintf(ref, sizeof(ref), "%s.ref", argv[2]);
+	if (ES2TS_FAILED(es2ts_file_transmux(argv[1], ref, 0, 0))) {
+		fprintf(stderr, "offline transmux of %s failed\n", argv[1]);
+		return 1;
+	}
+	long long diff = compare_files(argv[2], ref);
+	unlink(ref);
+	if (diff >= 0) {
+		fprintf(stderr, "output differs from the offline transmux at byte %lld\n", diff);
+		return 1;
+	}
+	printf("output matches the offline transmux\n");
+
+	return 0;
+}
@@ -0,0 +1,49 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "config.h"
+#include <libes2ts/es2ts.h>
+#include <libes2ts/sink.h>
+
+static int sink_callback(struct es2ts_context_s *ctx, const struct iovec *iov, int iovcnt)
+{
+	return ctx->sink->write(ctx->sink, iov, iovcnt);
+}
+
+int es2ts_sink_attach(struct es2ts_context_s *ctx, struct es2ts_sink_s *sink)
+{
+	if ((!ctx) || (!sink) || (!sink->write))
+		return ES2TS_INVALID_ARG;
+
+	ctx->sink = sink;
+	ctx->cb = 0;
+	return es2ts_callback_register_v(ctx, sink_callback);
+}
+
+void es2ts_sink_close(struct es2ts_sink_s *sink)
+{
+	if (sink && sink->close)
+		sink->close(sink);
+}
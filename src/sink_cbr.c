@@ -0,0 +1,340 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#define _GNU_SOURCE
+
+#include "config.h"
+#include <libes2ts/es2ts.h>
+#include <libes2ts/sink.h>
+#include "ring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/timerfd.h>
+
+#define load_relaxed(p)		__atomic_load_n(p, __ATOMIC_RELAXED)
+#define store_relaxed(p, v)	__atomic_store_n(p, v, __ATOMIC_RELAXED)
+
+#define TS_PACKET_SIZE		188
+#define TS_PACKET_BITS		(TS_PACKET_SIZE * 8)
+#define PCR_CLOCK		27000000ULL
+#define PCR_WRAP		((1ULL << 33) * 300)
+#define PCR_MAX_PIDS		16
+
+#define CBR_BURST		7	/* Packets handed to the downstream sink per write */
+#define CBR_BURST_MAX		64
+#define CBR_TICK_MIN_NS		100000
+#define CBR_TICK_MAX_NS		20000000
+
+struct pcr_pid_s {
+	int pid;
+	int64_t offset;		/* Input PCR minus output clock, 27MHz */
+};
+
+struct sink_cbr_s {
+	struct es2ts_sink_s sink;
+	struct es2ts_sink_s *out;
+
+	uint64_t rate;		/* bits/s */
+	int64_t tick_ns;
+	int burst;
+	int priority;
+
+	/* Mux thread writes, pacer reads */
+	struct es2ts_ring_s *ring;
+
+	pthread_t thread;
+	int running;
+	int tfd;
+
+	/* Pacer owned */
+	struct pcr_pid_s pcr[PCR_MAX_PIDS];
+	int pcr_count;
+	unsigned char batch[CBR_BURST_MAX * TS_PACKET_SIZE];
+
+	struct es2ts_sink_cbr_stats_s stats;
+};
+
+static int64_t clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void null_packet(unsigned char *pkt)
+{
+	pkt[0] = 0x47;
+	pkt[1] = 0x1f;
+	pkt[2] = 0xff;
+	pkt[3] = 0x10;
+	memset(pkt + 4, 0xff, TS_PACKET_SIZE - 4);
+}
+
+/* Output clock at the byte carrying the last bit of program_clock_reference_base
+ * in packet n, exact to the 27MHz tick at the configured rate.
+ */
+static uint64_t pcr_clock(struct sink_cbr_s *s, uint64_t n)
+{
+	unsigned __int128 bits = ((unsigned __int128)n * TS_PACKET_SIZE + 10) * 8;
+	return (uint64_t)(bits * PCR_CLOCK / s->rate);
+}
+
+static void pcr_restamp(struct sink_cbr_s *s, unsigned char *pkt, uint64_t n)
+{
+	/* Adaptation field present, long enough and PCR_flag set */
+	if (!(pkt[3] & 0x20) || pkt[4] < 7 || !(pkt[5] & 0x10))
+		return;
+
+	int pid = ((pkt[1] & 0x1f) << 8) | pkt[2];
+	uint64_t base = ((uint64_t)pkt[6] << 25) | (pkt[7] << 17) | (pkt[8] << 9) | (pkt[9] << 1) | (pkt[10] >> 7);
+	uint64_t in = base * 300 + (((pkt[10] & 1) << 8) | pkt[11]);
+	int64_t now = pcr_clock(s, n);
+
+	struct pcr_pid_s *p = 0;
+	for (int i = 0; i < s->pcr_count; i++) {
+		if (s->pcr[i].pid == pid) {
+			p = &s->pcr[i];
+			break;
+		}
+	}
+
+	/* Each program keeps its own time base, the first PCR (or a signalled
+	 * discontinuity) fixes its distance from the output clock.
+	 */
+	if (!p || (pkt[5] & 0x80)) {
+		if (!p) {
+			if (s->pcr_count == PCR_MAX_PIDS)
+				return;
+			p = &s->pcr[s->pcr_count++];
+			p->pid = pid;
+		}
+		p->offset = (int64_t)in - now;
+		return;
+	}
+
+	uint64_t pcr = (uint64_t)(now + p->offset) % PCR_WRAP;
+	base = pcr / 300;
+	unsigned int ext = pcr % 300;
+
+	pkt[6] = base >> 25;
+	pkt[7] = base >> 17;
+	pkt[8] = base >> 9;
+	pkt[9] = base >> 1;
+	pkt[10] = ((base & 1) << 7) | 0x7e | (ext >> 8);
+	pkt[11] = ext;
+}
+
+/* Send count packets, a whole number of bursts, one write each. Queued
+ * data goes first and null packets fill the rest.
+ */
+static void cbr_send(struct sink_cbr_s *s, uint64_t count)
+{
+	while (count) {
+		int n = s->burst;
+		int len = n * TS_PACKET_SIZE;
+		int got = es2ts_ring_read(s->ring, s->batch, len);
+		int i;
+
+		for (i = got; i < len; i += TS_PACKET_SIZE)
+			null_packet(s->batch + i);
+
+		uint64_t sent = load_relaxed(&s->stats.packets);
+		for (i = 0; i < got; i += TS_PACKET_SIZE)
+			pcr_restamp(s, s->batch + i, sent + i / TS_PACKET_SIZE);
+
+		struct iovec iov = { s->batch, len };
+		if (ES2TS_FAILED(s->out->write(s->out, &iov, 1)))
+			store_relaxed(&s->stats.write_errors, load_relaxed(&s->stats.write_errors) + 1);
+
+		store_relaxed(&s->stats.nulls, load_relaxed(&s->stats.nulls) + (len - got) / TS_PACKET_SIZE);
+		store_relaxed(&s->stats.packets, sent + n);
+		count -= n;
+	}
+}
+
+static void *cbr_thread(void *arg)
+{
+	struct sink_cbr_s *s = arg;
+	int64_t t0 = clock_ns();
+	int64_t next = t0 + s->tick_ns;
+	struct itimerspec its;
+
+	if (s->priority) {
+		struct sched_param sp = { .sched_priority = s->priority };
+		if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp))
+			fprintf(stderr, "cbr: unable to set realtime priority %d\n", s->priority);
+	}
+
+	/* Absolute ticks, wakeup latency never accumulates into the schedule */
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = next / 1000000000;
+	its.it_value.tv_nsec = next % 1000000000;
+	its.it_interval.tv_sec = s->tick_ns / 1000000000;
+	its.it_interval.tv_nsec = s->tick_ns % 1000000000;
+	if (timerfd_settime(s->tfd, TFD_TIMER_ABSTIME, &its, 0) < 0)
+		return 0;
+
+	while (load_relaxed(&s->running)) {
+		uint64_t expirations;
+		if (read(s->tfd, &expirations, sizeof(expirations)) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		/* Release every whole burst due by now, the position in the stream
+		 * comes from the clock rather than the tick count.
+		 */
+		int64_t now = clock_ns();
+		next += expirations * s->tick_ns;
+		int64_t late = now - (next - s->tick_ns);
+		if (late > (int64_t)load_relaxed(&s->stats.late_max_ns))
+			store_relaxed(&s->stats.late_max_ns, late);
+
+		unsigned __int128 bits = (unsigned __int128)(now - t0) * s->rate;
+		uint64_t due = bits / (1000000000ULL * TS_PACKET_BITS);
+		due -= due % s->burst;
+		uint64_t sent = load_relaxed(&s->stats.packets);
+		if (due > sent)
+			cbr_send(s, due - sent);
+	}
+
+	return 0;
+}
+
+static int cbr_write(struct es2ts_sink_s *sink, const struct iovec *iov, int iovcnt)
+{
+	struct sink_cbr_s *s = (struct sink_cbr_s *)sink;
+
+	/* Never wait on the pacer, a full queue means the mux runs above the rate */
+	for (int i = 0; i < iovcnt; i++) {
+		const unsigned char *ptr = iov[i].iov_base;
+		unsigned int len = iov[i].iov_len - (iov[i].iov_len % TS_PACKET_SIZE);
+
+		if (es2ts_ring_write(s->ring, ptr, len) == 0)
+			continue;
+
+		for (unsigned int pos = 0; pos < len; pos += TS_PACKET_SIZE) {
+			if (es2ts_ring_write(s->ring, ptr + pos, TS_PACKET_SIZE) < 0)
+				store_relaxed(&s->stats.dropped, load_relaxed(&s->stats.dropped) + 1);
+		}
+	}
+
+	return ES2TS_OK;
+}
+
+static void cbr_close(struct es2ts_sink_s *sink)
+{
+	struct sink_cbr_s *s = (struct sink_cbr_s *)sink;
+
+	if (load_relaxed(&s->running)) {
+		store_relaxed(&s->running, 0);
+		pthread_join(s->thread, 0);
+	}
+	if (s->tfd >= 0)
+		close(s->tfd);
+	es2ts_ring_free(s->ring);
+	memset(s, 0, sizeof(*s));
+	free(s);
+}
+
+int es2ts_sink_cbr_open(struct es2ts_sink_s **r, struct es2ts_sink_s *out, uint64_t bitrate,
+	const struct es2ts_sink_cbr_opts_s *opts)
+{
+	struct es2ts_sink_cbr_opts_s defaults;
+
+	if ((!r) || (!out) || (!out->write) || (bitrate < TS_PACKET_BITS))
+		return ES2TS_INVALID_ARG;
+
+	if (!opts) {
+		memset(&defaults, 0, sizeof(defaults));
+		opts = &defaults;
+	}
+	if (opts->burst > CBR_BURST_MAX)
+		return ES2TS_INVALID_ARG;
+
+	struct sink_cbr_s *s = calloc(1, sizeof(*s));
+	if (!s)
+		return ES2TS_ERROR;
+	s->sink.write = cbr_write;
+	s->sink.close = cbr_close;
+	s->out = out;
+	s->rate = bitrate;
+	s->priority = opts->priority;
+
+	/* One tick per burst, a datagram's worth of packets at a time */
+	s->burst = opts->burst > 0 ? opts->burst : CBR_BURST;
+	s->tick_ns = (int64_t)((unsigned __int128)s->burst * TS_PACKET_BITS * 1000000000ULL / bitrate);
+	if (s->tick_ns < CBR_TICK_MIN_NS)
+		s->tick_ns = CBR_TICK_MIN_NS;
+	if (s->tick_ns > CBR_TICK_MAX_NS)
+		s->tick_ns = CBR_TICK_MAX_NS;
+
+	/* A second of output by default */
+	uint64_t size = opts->buffer ? opts->buffer : bitrate / 8;
+	if (size < 64 * 1024)
+		size = 64 * 1024;
+	if (size > 0x40000000)
+		size = 0x40000000;
+
+	s->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (s->tfd < 0 || es2ts_ring_alloc(&s->ring, size) < 0) {
+		cbr_close(&s->sink);
+		return ES2TS_ERROR;
+	}
+
+	s->running = 1;
+	if (pthread_create(&s->thread, 0, cbr_thread, s) != 0) {
+		s->running = 0;
+		cbr_close(&s->sink);
+		return ES2TS_ERROR;
+	}
+
+	*r = &s->sink;
+	return ES2TS_OK;
+}
+
+int es2ts_sink_cbr_get_stats(struct es2ts_sink_s *sink, struct es2ts_sink_cbr_stats_s *stats)
+{
+	if ((!sink) || (!stats) || (sink->write != cbr_write))
+		return ES2TS_INVALID_ARG;
+
+	struct sink_cbr_s *s = (struct sink_cbr_s *)sink;
+	stats->packets = load_relaxed(&s->stats.packets);
+	stats->nulls = load_relaxed(&s->stats.nulls);
+	stats->dropped = load_relaxed(&s->stats.dropped);
+	stats->write_errors = load_relaxed(&s->stats.write_errors);
+	stats->late_max_ns = load_relaxed(&s->stats.late_max_ns);
+	stats->queue_bytes = es2ts_ring_used(s->ring);
+
+	return ES2TS_OK;
+}
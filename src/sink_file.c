@@ -0,0 +1,544 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#define _GNU_SOURCE	/* O_DIRECT */
+
+#include "config.h"
+#include <libes2ts/es2ts.h>
+#include <libes2ts/sink.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+
+#define load_acquire(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define load_relaxed(p)		__atomic_load_n(p, __ATOMIC_RELAXED)
+#define store_relaxed(p, v)	__atomic_store_n(p, v, __ATOMIC_RELAXED)
+
+/* Buffers, offsets and lengths all aligned for O_DIRECT */
+#define FILE_ALIGN		4096
+#define FILE_BUFFER_SIZE	(1024 * 1024)
+#define FILE_BUFFERS		16
+
+struct file_buffer_s {
+	unsigned char *ptr;
+	unsigned int len;
+	off_t offset;
+	int busy;		/* Submitted, the writer side clears it once on disk */
+};
+
+struct sink_file_s {
+	struct es2ts_sink_s sink;
+
+	int fd;
+	int direct;
+	unsigned int size;	/* Of each buffer */
+	int nbuffers;
+	unsigned char *pool;
+	struct file_buffer_s *buffers;
+
+	/* Mux thread owned */
+	int cur;		/* Buffer being filled, or -1 */
+	unsigned int fill;	/* Index of the next buffer to fill */
+	off_t offset;		/* File offset of the next buffer */
+
+	int uring;		/* io_uring, otherwise the writer thread */
+#if HAVE_LINUX_IO_URING_H
+	int ringfd;
+	void *sqring;
+	size_t sqringlen;
+	void *cqring;
+	size_t cqringlen;
+	struct io_uring_sqe *sqes;
+	size_t sqeslen;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	int inflight;
+#endif
+
+	/* Writer thread fallback, buffers go to disk in submission order */
+	pthread_t thread;
+	int running;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int submitted;
+	unsigned int written;
+	int stop;
+
+	struct es2ts_sink_file_stats_s stats;
+};
+
+static void stats_inc(uint64_t *counter, uint64_t v)
+{
+	store_relaxed(counter, load_relaxed(counter) + v);
+}
+
+static int pwrite_all(int fd, const unsigned char *buf, size_t len, off_t offset)
+{
+	while (len) {
+		ssize_t ret = pwrite(fd, buf, len, offset);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return ES2TS_ERROR;
+		}
+		buf += ret;
+		len -= ret;
+		offset += ret;
+	}
+
+	return ES2TS_OK;
+}
+
+/* A buffer finished, successfully or not, and is free for the mux again */
+static void buffer_done(struct sink_file_s *s, struct file_buffer_s *b, int ok)
+{
+	if (ok)
+		stats_inc(&s->stats.bytes, b->len);
+	else
+		stats_inc(&s->stats.errors, 1);
+	store_release(&b->busy, 0);
+}
+
+#if HAVE_LINUX_IO_URING_H
+/* Raw system calls, no liburing dependency */
+static int uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned int submit, unsigned int complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, submit, complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned int opcode, const void *arg, unsigned int nargs)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nargs);
+}
+
+static void uring_close(struct sink_file_s *s)
+{
+	if (s->sqes)
+		munmap(s->sqes, s->sqeslen);
+	if (s->cqring && s->cqring != s->sqring)
+		munmap(s->cqring, s->cqringlen);
+	if (s->sqring)
+		munmap(s->sqring, s->sqringlen);
+	if (s->ringfd >= 0)
+		close(s->ringfd);
+	s->ringfd = -1;
+	s->sqes = 0;
+	s->sqring = 0;
+	s->cqring = 0;
+	s->uring = 0;
+}
+
+static int uring_register_buffers(struct sink_file_s *s)
+{
+	struct iovec iov[s->nbuffers];
+
+	for (int i = 0; i < s->nbuffers; i++) {
+		iov[i].iov_base = s->buffers[i].ptr;
+		iov[i].iov_len = s->size;
+	}
+	if (uring_register(s->ringfd, IORING_REGISTER_BUFFERS, iov, s->nbuffers) < 0)
+		return ES2TS_ERROR;
+
+	return ES2TS_OK;
+}
+
+static int uring_open(struct sink_file_s *s)
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	s->ringfd = uring_setup(s->nbuffers, &p);
+	if (s->ringfd < 0)
+		return ES2TS_ERROR;
+
+	s->sqringlen = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	s->cqringlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (s->cqringlen > s->sqringlen)
+			s->sqringlen = s->cqringlen;
+		s->cqringlen = s->sqringlen;
+	}
+
+	s->sqring = mmap(0, s->sqringlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		s->ringfd, IORING_OFF_SQ_RING);
+	if (s->sqring == MAP_FAILED) {
+		s->sqring = 0;
+		goto err;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		s->cqring = s->sqring;
+	else {
+		s->cqring = mmap(0, s->cqringlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			s->ringfd, IORING_OFF_CQ_RING);
+		if (s->cqring == MAP_FAILED) {
+			s->cqring = 0;
+			goto err;
+		}
+	}
+	s->sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+	s->sqes = mmap(0, s->sqeslen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		s->ringfd, IORING_OFF_SQES);
+	if (s->sqes == MAP_FAILED) {
+		s->sqes = 0;
+		goto err;
+	}
+
+	unsigned char *sq = s->sqring;
+	unsigned char *cq = s->cqring;
+	s->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	s->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	s->sq_array = (unsigned int *)(sq + p.sq_off.array);
+	s->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	s->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	s->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	s->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	/* Pinned once, the kernel skips the page walk on every write */
+	if (ES2TS_FAILED(uring_register_buffers(s)))
+		goto err;
+
+	s->uring = 1;
+	return ES2TS_OK;
+
+err:
+	uring_close(s);
+	return ES2TS_ERROR;
+}
+
+/* Retire whatever has completed, never waits */
+static void uring_reap(struct sink_file_s *s)
+{
+	unsigned int head = *s->cq_head;
+	unsigned int tail = load_acquire(s->cq_tail);
+
+	while (head != tail) {
+		struct io_uring_cqe *cqe = &s->cqes[head & *s->cq_mask];
+		struct file_buffer_s *b = &s->buffers[cqe->user_data];
+
+		buffer_done(s, b, cqe->res == (int)b->len);
+		s->inflight--;
+		head++;
+	}
+	store_release(s->cq_head, head);
+}
+
+static int uring_submit(struct sink_file_s *s, int idx)
+{
+	struct file_buffer_s *b = &s->buffers[idx];
+	unsigned int tail = *s->sq_tail;
+	unsigned int slot = tail & *s->sq_mask;
+	struct io_uring_sqe *sqe = &s->sqes[slot];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_WRITE_FIXED;
+	sqe->fd = s->fd;
+	sqe->addr = (uintptr_t)b->ptr;
+	sqe->len = b->len;
+	sqe->off = b->offset;
+	sqe->buf_index = idx;
+	sqe->user_data = idx;
+	s->sq_array[slot] = slot;
+	store_release(s->sq_tail, tail + 1);
+
+	while (uring_enter(s->ringfd, 1, 0, 0) < 0) {
+		if (errno == EINTR)
+			continue;
+		return ES2TS_ERROR;
+	}
+	s->inflight++;
+
+	return ES2TS_OK;
+}
+
+/* Close time only, block until every write is on disk */
+static void uring_drain(struct sink_file_s *s)
+{
+	while (s->inflight > 0) {
+		if (uring_enter(s->ringfd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+			break;
+		uring_reap(s);
+	}
+}
+#endif
+
+static void *file_thread(void *arg)
+{
+	struct sink_file_s *s = arg;
+
+	pthread_mutex_lock(&s->lock);
+	while (1) {
+		while (s->written == s->submitted && !s->stop)
+			pthread_cond_wait(&s->cond, &s->lock);
+		if (s->written == s->submitted)
+			break;
+		struct file_buffer_s *b = &s->buffers[s->written % s->nbuffers];
+		pthread_mutex_unlock(&s->lock);
+
+		/* Only this thread ever waits on the disk */
+		int ret = pwrite_all(s->fd, b->ptr, b->len, b->offset);
+		buffer_done(s, b, ES2TS_SUCCESS(ret));
+
+		pthread_mutex_lock(&s->lock);
+		s->written++;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return 0;
+}
+
+static int file_submit(struct sink_file_s *s, int idx, unsigned int len)
+{
+	struct file_buffer_s *b = &s->buffers[idx];
+
+	b->len = len;
+	b->offset = s->offset;
+	b->busy = 1;
+	s->offset += len;
+
+#if HAVE_LINUX_IO_URING_H
+	if (s->uring) {
+		if (ES2TS_FAILED(uring_submit(s, idx))) {
+			buffer_done(s, b, 0);
+			return ES2TS_ERROR;
+		}
+		return ES2TS_OK;
+	}
+#endif
+
+	pthread_mutex_lock(&s->lock);
+	s->submitted++;
+	pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+
+	return ES2TS_OK;
+}
+
+/* Bytes that fit right now, the buffer being filled plus the free ones after it */
+static size_t file_space(struct sink_file_s *s, size_t want)
+{
+	size_t space = s->cur >= 0 ? s->size - s->buffers[s->cur].len : 0;
+
+#if HAVE_LINUX_IO_URING_H
+	if (s->uring && space < want)
+		uring_reap(s);
+#endif
+
+	for (int i = 0; i < s->nbuffers && space < want; i++) {
+		int idx = (s->fill + i) % s->nbuffers;
+		if (load_acquire(&s->buffers[idx].busy) || idx == s->cur)
+			break;
+		space += s->size;
+	}
+
+	return space;
+}
+
+static int file_write(struct es2ts_sink_s *sink, const struct iovec *iov, int iovcnt)
+{
+	struct sink_file_s *s = (struct sink_file_s *)sink;
+	int ret = ES2TS_OK;
+
+	for (int i = 0; i < iovcnt; i++) {
+		const unsigned char *ptr = iov[i].iov_base;
+		size_t len = iov[i].iov_len;
+
+		/* The disk fell behind by every buffer we have. Drop whole packet
+		 * runs rather than stall the mux thread.
+		 */
+		if (file_space(s, len) < len) {
+			stats_inc(&s->stats.dropped, len);
+			continue;
+		}
+
+		while (len) {
+			if (s->cur < 0) {
+				s->cur = s->fill;
+				s->fill = (s->fill + 1) % s->nbuffers;
+				s->buffers[s->cur].len = 0;
+			}
+
+			struct file_buffer_s *b = &s->buffers[s->cur];
+			size_t cplen = s->size - b->len;
+			if (cplen > len)
+				cplen = len;
+			memcpy(b->ptr + b->len, ptr, cplen);
+			b->len += cplen;
+			ptr += cplen;
+			len -= cplen;
+
+			if (b->len == s->size) {
+				if (ES2TS_FAILED(file_submit(s, s->cur, s->size)))
+					ret = ES2TS_ERROR;
+				s->cur = -1;
+			}
+		}
+	}
+
+	return ret;
+}
+
+static void file_close(struct es2ts_sink_s *sink)
+{
+	struct sink_file_s *s = (struct sink_file_s *)sink;
+
+	/* The tail goes out padded to the alignment, the file is cut back after */
+	off_t end = s->offset;
+	if (s->cur >= 0 && s->buffers[s->cur].len) {
+		struct file_buffer_s *b = &s->buffers[s->cur];
+		unsigned int len = b->len;
+		end += len;
+		if (s->direct) {
+			unsigned int padded = (len + FILE_ALIGN - 1) & ~(FILE_ALIGN - 1);
+			memset(b->ptr + len, 0, padded - len);
+			len = padded;
+		}
+		file_submit(s, s->cur, len);
+		s->cur = -1;
+	}
+
+#if HAVE_LINUX_IO_URING_H
+	if (s->uring) {
+		uring_drain(s);
+		uring_close(s);
+	}
+#endif
+	if (s->running) {
+		pthread_mutex_lock(&s->lock);
+		s->stop = 1;
+		pthread_cond_signal(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+		pthread_join(s->thread, 0);
+	}
+
+	if (s->fd >= 0) {
+		if (s->direct && ftruncate(s->fd, end) < 0)
+			fprintf(stderr, "unable to trim recording to %lld bytes\n", (long long)end);
+		close(s->fd);
+	}
+	pthread_cond_destroy(&s->cond);
+	pthread_mutex_destroy(&s->lock);
+	free(s->buffers);
+	free(s->pool);
+	memset(s, 0, sizeof(*s));
+	free(s);
+}
+
+int es2ts_sink_file_open(struct es2ts_sink_s **r, const char *path,
+	const struct es2ts_sink_file_opts_s *opts)
+{
+	struct es2ts_sink_file_opts_s defaults;
+
+	if ((!r) || (!path))
+		return ES2TS_INVALID_ARG;
+
+	if (!opts) {
+		memset(&defaults, 0, sizeof(defaults));
+		opts = &defaults;
+	}
+
+	struct sink_file_s *s = calloc(1, sizeof(*s));
+	if (!s)
+		return ES2TS_ERROR;
+	s->sink.write = file_write;
+	s->sink.close = file_close;
+	s->cur = -1;
+	s->fd = -1;
+#if HAVE_LINUX_IO_URING_H
+	s->ringfd = -1;
+#endif
+	pthread_mutex_init(&s->lock, 0);
+	pthread_cond_init(&s->cond, 0);
+
+	s->size = opts->buffer_size ? opts->buffer_size : FILE_BUFFER_SIZE;
+	s->size = (s->size + FILE_ALIGN - 1) & ~(FILE_ALIGN - 1);
+	s->nbuffers = opts->buffers > 1 ? opts->buffers : FILE_BUFFERS;
+	s->direct = !!(opts->flags & ES2TS_SINK_FILE_DIRECT);
+
+	int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | (s->direct ? O_DIRECT : 0);
+	s->fd = open(path, flags, 0644);
+	if (s->fd < 0) {
+		fprintf(stderr, "unable to create %s%s\n", path, s->direct ? " for direct I/O" : "");
+		goto err;
+	}
+
+	s->buffers = calloc(s->nbuffers, sizeof(*s->buffers));
+	if (!s->buffers || posix_memalign((void **)&s->pool, FILE_ALIGN, (size_t)s->size * s->nbuffers))
+		goto err;
+	for (int i = 0; i < s->nbuffers; i++)
+		s->buffers[i].ptr = s->pool + (size_t)i * s->size;
+
+#if HAVE_LINUX_IO_URING_H
+	if (!(opts->flags & ES2TS_SINK_FILE_NOURING))
+		uring_open(s);
+#endif
+	if (!s->uring) {
+		if (pthread_create(&s->thread, 0, file_thread, s) != 0)
+			goto err;
+		s->running = 1;
+	}
+	s->stats.uring = s->uring;
+
+	*r = &s->sink;
+	return ES2TS_OK;
+
+err:
+	file_close(&s->sink);
+	return ES2TS_ERROR;
+}
+
+int es2ts_sink_file_get_stats(struct es2ts_sink_s *sink, struct es2ts_sink_file_stats_s *stats)
+{
+	if ((!sink) || (!stats) || (sink->write != file_write))
+		return ES2TS_INVALID_ARG;
+
+	struct sink_file_s *s = (struct sink_file_s *)sink;
+	stats->bytes = load_relaxed(&s->stats.bytes);
+	stats->dropped = load_relaxed(&s->stats.dropped);
+	stats->errors = load_relaxed(&s->stats.errors);
+	stats->uring = s->stats.uring;
+
+	return ES2TS_OK;
+}
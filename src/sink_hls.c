@@ -0,0 +1,458 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "config.h"
+#include <libes2ts/es2ts.h>
+#include <libes2ts/sink.h>
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define TS_PACKET_SIZE		188
+#define TS_MASK_33BIT		0x1ffffffffULL
+
+#define HLS_TARGET_MS		6000
+#define HLS_SEGMENTS		5
+#define HLS_SEGMENTS_SPARE	2	/* Kept after leaving the playlist, for late readers */
+#define HLS_PREFIX		"segment"
+#define HLS_PREFIX_MAX		64
+#define HLS_INITIAL_SIZE	(1024 * 1024)
+
+struct hls_segment_s {
+	struct es2ts_hls_segment_s pub;
+	unsigned char *ptr;
+	size_t maxlen;
+	int refs;
+};
+
+struct sink_hls_s {
+	struct es2ts_sink_s sink;
+
+	int64_t target;		/* 90KHz */
+	int target_secs;	/* EXT-X-TARGETDURATION */
+	int nlisted;
+	char prefix[HLS_PREFIX_MAX];
+
+	/* Mux thread owned, the segment being built and the scan state */
+	struct hls_segment_s *cur;
+	int64_t cur_pts;	/* Of the first cut PID PES, -1 until seen */
+	long psi_pos;		/* Start of the PSI run ahead of the next video packet, or -1 */
+	int pmt_pid;
+	int cut_pid;
+	uint64_t sequence;
+
+	/* Published segments, oldest first, and the playlist built from them */
+	pthread_mutex_t lock;
+	struct hls_segment_s **ring;
+	int nring;
+	int ringmax;
+	char *playlist;
+	size_t playlistlen;
+	size_t playlistmax;
+};
+
+static void segment_put(struct hls_segment_s *seg)
+{
+	if (__atomic_sub_fetch(&seg->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(seg->ptr);
+		free(seg);
+	}
+}
+
+static struct hls_segment_s *segment_alloc(uint64_t sequence, size_t size)
+{
+	struct hls_segment_s *seg = calloc(1, sizeof(*seg));
+	if (!seg)
+		return 0;
+
+	seg->ptr = malloc(size);
+	if (!seg->ptr) {
+		free(seg);
+		return 0;
+	}
+	seg->maxlen = size;
+	seg->refs = 1;
+	seg->pub.sequence = sequence;
+
+	return seg;
+}
+
+static int segment_append(struct hls_segment_s *seg, const unsigned char *data, size_t len)
+{
+	if (seg->pub.len + len > seg->maxlen) {
+		size_t maxlen = seg->maxlen * 2;
+		while (seg->pub.len + len > maxlen)
+			maxlen *= 2;
+		unsigned char *ptr = realloc(seg->ptr, maxlen);
+		if (!ptr)
+			return ES2TS_ERROR;
+		seg->ptr = ptr;
+		seg->maxlen = maxlen;
+	}
+
+	memcpy(seg->ptr + seg->pub.len, data, len);
+	seg->pub.len += len;
+	seg->pub.ptr = seg->ptr;
+
+	return ES2TS_OK;
+}
+
+static int playlist_printf(struct sink_hls_s *s, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static int playlist_printf(struct sink_hls_s *s, const char *fmt, ...)
+{
+	va_list ap;
+
+	while (1) {
+		va_start(ap, fmt);
+		int len = vsnprintf(s->playlist + s->playlistlen, s->playlistmax - s->playlistlen, fmt, ap);
+		va_end(ap);
+		if (len < 0)
+			return ES2TS_ERROR;
+		if (s->playlistlen + len < s->playlistmax) {
+			s->playlistlen += len;
+			return ES2TS_OK;
+		}
+
+		size_t max = s->playlistmax ? s->playlistmax * 2 : 1024;
+		char *p = realloc(s->playlist, max);
+		if (!p)
+			return ES2TS_ERROR;
+		s->playlist = p;
+		s->playlistmax = max;
+	}
+}
+
+/* Live playlist of the newest nlisted segments, called with the lock held */
+static int playlist_build(struct sink_hls_s *s)
+{
+	int first = s->nring > s->nlisted ? s->nring - s->nlisted : 0;
+	int ret;
+
+	s->playlistlen = 0;
+	ret = playlist_printf(s, "#EXTM3U\n#EXT-X-VERSION:3\n#EXT-X-TARGETDURATION:%d\n#EXT-X-MEDIA-SEQUENCE:%llu\n",
+		s->target_secs, (unsigned long long)s->ring[first]->pub.sequence);
+
+	for (int i = first; i < s->nring && ES2TS_SUCCESS(ret); i++) {
+		struct hls_segment_s *seg = s->ring[i];
+		ret = playlist_printf(s, "#EXTINF:%.3f,\n%s%llu.ts\n", seg->pub.duration,
+			s->prefix, (unsigned long long)seg->pub.sequence);
+	}
+
+	return ret;
+}
+
+static int segment_publish(struct sink_hls_s *s, struct hls_segment_s *seg)
+{
+	struct hls_segment_s *evict = 0;
+	int ret;
+
+	pthread_mutex_lock(&s->lock);
+	if (s->nring == s->ringmax) {
+		evict = s->ring[0];
+		memmove(s->ring, s->ring + 1, (s->nring - 1) * sizeof(*s->ring));
+		s->nring--;
+	}
+	s->ring[s->nring++] = seg;
+	ret = playlist_build(s);
+	pthread_mutex_unlock(&s->lock);
+
+	if (evict)
+		segment_put(evict);
+
+	return ret;
+}
+
+/* Offset of the payload in a TS packet, or -1 without one */
+static int payload_offset(const unsigned char *p)
+{
+	int off = 4;
+
+	if (!(p[3] & 0x10))
+		return -1;
+	if (p[3] & 0x20)
+		off += 1 + p[4];
+
+	return off < TS_PACKET_SIZE ? off : -1;
+}
+
+/* The section a payload_unit_start packet carries, checked for table_id */
+static const unsigned char *psi_section(const unsigned char *p, int table_id)
+{
+	int off = payload_offset(p);
+
+	if (off < 0 || !(p[1] & 0x40))
+		return 0;
+	off += 1 + p[off];
+	if (off + 12 > TS_PACKET_SIZE || p[off] != table_id)
+		return 0;
+
+	return p + off;
+}
+
+static int64_t pes_pts(const unsigned char *p)
+{
+	int off = payload_offset(p);
+
+	if (off < 0 || off + 14 > TS_PACKET_SIZE)
+		return -1;
+	p += off;
+	if (p[0] != 0 || p[1] != 0 || p[2] != 1 || !(p[7] & 0x80))
+		return -1;
+
+	return ((int64_t)(p[9] & 0x0e) << 29) | (p[10] << 22) | ((p[11] & 0xfe) << 14) |
+		(p[12] << 7) | (p[13] >> 1);
+}
+
+/* Learn the first program's PMT from the PAT and its PCR PID from the PMT,
+ * segments are cut on that PID.
+ */
+static void psi_learn(struct sink_hls_s *s, const unsigned char *p, int pid)
+{
+	const unsigned char *sec;
+
+	if (pid == 0 && s->pmt_pid < 0 && (sec = psi_section(p, 0x00))) {
+		int seclen = ((sec[1] & 0x0f) << 8) | sec[2];
+		for (int i = 8; i + 4 <= 3 + seclen - 4 && sec + i + 4 <= p + TS_PACKET_SIZE; i += 4) {
+			if ((sec[i] << 8 | sec[i + 1]) != 0) {
+				s->pmt_pid = ((sec[i + 2] & 0x1f) << 8) | sec[i + 3];
+				break;
+			}
+		}
+	} else if (pid == s->pmt_pid && s->cut_pid < 0 && (sec = psi_section(p, 0x02))) {
+		s->cut_pid = ((sec[8] & 0x1f) << 8) | sec[9];
+	}
+}
+
+/* Scan the packets appended to cur from pos onward. A cut goes at the
+ * first random access point of the cut PID once the segment holds the
+ * target duration, in front of the PAT / PMT that lead it in. A stream
+ * without random access points is cut on a PES boundary at twice the target.
+ */
+static int hls_scan(struct sink_hls_s *s, size_t pos)
+{
+	while (pos + TS_PACKET_SIZE <= s->cur->pub.len) {
+		const unsigned char *p = s->cur->ptr + pos;
+		int pid = ((p[1] & 0x1f) << 8) | p[2];
+
+		if (pid == 0 || pid == s->pmt_pid) {
+			psi_learn(s, p, pid);
+			if (s->psi_pos < 0)
+				s->psi_pos = pos;
+			pos += TS_PACKET_SIZE;
+			continue;
+		}
+		long psi_pos = s->psi_pos;
+		s->psi_pos = -1;
+
+		if (pid != s->cut_pid || !(p[1] & 0x40)) {
+			pos += TS_PACKET_SIZE;
+			continue;
+		}
+
+		int64_t pts = pes_pts(p);
+		if (pts < 0) {
+			pos += TS_PACKET_SIZE;
+			continue;
+		}
+		if (s->cur_pts < 0)
+			s->cur_pts = pts;
+
+		int64_t dur = (pts - s->cur_pts) & TS_MASK_33BIT;
+		int rap = (p[3] & 0x20) && p[4] > 0 && (p[5] & 0x40);
+		if (!((rap && dur >= s->target) || dur >= 2 * s->target)) {
+			pos += TS_PACKET_SIZE;
+			continue;
+		}
+
+		/* Everything from the cut on moves to a fresh segment */
+		size_t cut = psi_pos >= 0 ? (size_t)psi_pos : pos;
+		struct hls_segment_s *seg = s->cur;
+		struct hls_segment_s *next = segment_alloc(++s->sequence, seg->maxlen);
+		if (!next)
+			return ES2TS_ERROR;
+		if (ES2TS_FAILED(segment_append(next, seg->ptr + cut, seg->pub.len - cut))) {
+			segment_put(next);
+			return ES2TS_ERROR;
+		}
+		seg->pub.len = cut;
+		seg->pub.duration = dur / 90000.0;
+
+		s->cur = next;
+		s->cur_pts = pts;
+		pos = pos - cut + TS_PACKET_SIZE;
+
+		if (ES2TS_FAILED(segment_publish(s, seg)))
+			return ES2TS_ERROR;
+	}
+
+	return ES2TS_OK;
+}
+
+static int hls_write(struct es2ts_sink_s *sink, const struct iovec *iov, int iovcnt)
+{
+	struct sink_hls_s *s = (struct sink_hls_s *)sink;
+
+	for (int i = 0; i < iovcnt; i++) {
+		size_t pos = s->cur->pub.len;
+		if (ES2TS_FAILED(segment_append(s->cur, iov[i].iov_base, iov[i].iov_len)))
+			return ES2TS_ERROR;
+		if (ES2TS_FAILED(hls_scan(s, pos)))
+			return ES2TS_ERROR;
+	}
+
+	return ES2TS_OK;
+}
+
+static void hls_close(struct es2ts_sink_s *sink)
+{
+	struct sink_hls_s *s = (struct sink_hls_s *)sink;
+
+	/* Segments still held by readers live on until their last put */
+	for (int i = 0; i < s->nring; i++)
+		segment_put(s->ring[i]);
+	if (s->cur)
+		segment_put(s->cur);
+	free(s->ring);
+	free(s->playlist);
+	pthread_mutex_destroy(&s->lock);
+	memset(s, 0, sizeof(*s));
+	free(s);
+}
+
+int es2ts_sink_hls_open(struct es2ts_sink_s **r, const struct es2ts_sink_hls_opts_s *opts)
+{
+	struct es2ts_sink_hls_opts_s defaults;
+
+	if (!r)
+		return ES2TS_INVALID_ARG;
+
+	if (!opts) {
+		memset(&defaults, 0, sizeof(defaults));
+		opts = &defaults;
+	}
+	if (opts->prefix && strlen(opts->prefix) >= HLS_PREFIX_MAX)
+		return ES2TS_INVALID_ARG;
+
+	struct sink_hls_s *s = calloc(1, sizeof(*s));
+	if (!s)
+		return ES2TS_ERROR;
+	s->sink.write = hls_write;
+	s->sink.close = hls_close;
+	pthread_mutex_init(&s->lock, 0);
+
+	int target_ms = opts->target_ms > 0 ? opts->target_ms : HLS_TARGET_MS;
+	s->target = (int64_t)target_ms * 90;
+	/* EXT-X-TARGETDURATION never changes once published, so it covers the
+	 * forced cut at twice the target. A segment runs past that by at most a
+	 * frame, inside the rounding of EXTINF to the nearest second.
+	 */
+	s->target_secs = (int)((2LL * target_ms + 999) / 1000);
+	s->nlisted = opts->segments > 0 ? opts->segments : HLS_SEGMENTS;
+	s->ringmax = s->nlisted + HLS_SEGMENTS_SPARE;
+	strcpy(s->prefix, opts->prefix ? opts->prefix : HLS_PREFIX);
+
+	s->cur_pts = -1;
+	s->psi_pos = -1;
+	s->pmt_pid = -1;
+	s->cut_pid = -1;
+
+	s->ring = calloc(s->ringmax, sizeof(*s->ring));
+	s->cur = segment_alloc(0, HLS_INITIAL_SIZE);
+	if (!s->ring || !s->cur) {
+		hls_close(&s->sink);
+		return ES2TS_ERROR;
+	}
+
+	*r = &s->sink;
+	return ES2TS_OK;
+}
+
+int es2ts_sink_hls_playlist(struct es2ts_sink_s *sink, char *buf, size_t len)
+{
+	if ((!sink) || (sink->write != hls_write) || (!buf && len))
+		return ES2TS_INVALID_ARG;
+
+	struct sink_hls_s *s = (struct sink_hls_s *)sink;
+	int ret;
+
+	pthread_mutex_lock(&s->lock);
+	ret = s->playlistlen;
+	if (s->nring == 0)
+		ret = ES2TS_NO_RESOURCE;
+	else if (len > s->playlistlen) {
+		memcpy(buf, s->playlist, s->playlistlen);
+		buf[s->playlistlen] = 0;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return ret;
+}
+
+int es2ts_sink_hls_segment_get(struct es2ts_sink_s *sink, const char *uri,
+	struct es2ts_hls_segment_s **r)
+{
+	if ((!sink) || (sink->write != hls_write) || (!uri) || (!r))
+		return ES2TS_INVALID_ARG;
+
+	struct sink_hls_s *s = (struct sink_hls_s *)sink;
+	size_t plen = strlen(s->prefix);
+	unsigned long long sequence;
+	char *end;
+
+	/* <prefix><sequence>.ts, as the playlist names it, a leading path is ignored */
+	const char *name = strrchr(uri, '/');
+	name = name ? name + 1 : uri;
+	if (strncmp(name, s->prefix, plen) != 0 || name[plen] < '0' || name[plen] > '9')
+		return ES2TS_INVALID_ARG;
+	sequence = strtoull(name + plen, &end, 10);
+	if (strcmp(end, ".ts") != 0)
+		return ES2TS_INVALID_ARG;
+
+	int ret = ES2TS_NO_RESOURCE;
+	pthread_mutex_lock(&s->lock);
+	for (int i = 0; i < s->nring; i++) {
+		struct hls_segment_s *seg = s->ring[i];
+		if (seg->pub.sequence == sequence) {
+			__atomic_add_fetch(&seg->refs, 1, __ATOMIC_RELAXED);
+			*r = &seg->pub;
+			ret = ES2TS_OK;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return ret;
+}
+
+void es2ts_sink_hls_segment_put(struct es2ts_hls_segment_s *seg)
+{
+	if (seg)
+		segment_put(container_of(seg, struct hls_segment_s, pub));
+}
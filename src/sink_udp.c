@@ -0,0 +1,363 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#define _GNU_SOURCE	/* sendmmsg() */
+
+#include "config.h"
+#include <libes2ts/es2ts.h>
+#include <libes2ts/sink.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <net/if.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT		103	/* linux/udp.h, kernel 4.18 */
+#endif
+#ifndef SOL_UDP
+#define SOL_UDP			17
+#endif
+
+#define UDP_PACKETS		7
+#define UDP_PAYLOAD		(UDP_PACKETS * 188)
+#define RTP_HEADER_SIZE		12
+#define RTP_PAYLOAD_MP2T	33
+
+/* Datagrams per send, a GSO super packet must stay below 64KB */
+#define UDP_BATCH		48
+
+struct sink_udp_s {
+	struct es2ts_sink_s sink;
+
+	int fd;
+	int rtp;
+	int gso;
+	unsigned short seq;
+	unsigned int ssrc;
+
+	/* Batch under construction, datagram i uses msgs[i] and its iov run */
+	struct mmsghdr msgs[UDP_BATCH];
+	struct iovec iov[UDP_BATCH * (UDP_PACKETS + 1)];
+	unsigned char rtphdr[UDP_BATCH][RTP_HEADER_SIZE];
+	int nmsgs;
+	int niov;
+};
+
+static unsigned int rtp_clock(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 90000ULL + ts.tv_nsec / (1000000000 / 90000);
+}
+
+/* Transient conditions drop the batch, the stream carries on */
+static int udp_error(void)
+{
+	switch (errno) {
+	case EAGAIN:
+	case ENOBUFS:
+	case ECONNREFUSED:
+	case EHOSTUNREACH:
+	case ENETUNREACH:
+		return ES2TS_OK;
+	default:
+		return ES2TS_ERROR;
+	}
+}
+
+static int udp_send_mmsg(struct sink_udp_s *s)
+{
+	int idx = 0;
+
+	while (idx < s->nmsgs) {
+		int ret = sendmmsg(s->fd, s->msgs + idx, s->nmsgs - idx, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return udp_error();
+		}
+		idx += ret;
+	}
+
+	return ES2TS_OK;
+}
+
+/* Every datagram but the last is full size, so the whole batch can go out
+ * as one GSO send that the kernel (or NIC) splits at the segment size.
+ */
+static int udp_send_gso(struct sink_udp_s *s)
+{
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = s->iov;
+	msg.msg_iovlen = s->niov;
+
+	while (sendmsg(s->fd, &msg, 0) < 0) {
+		if (errno == EINTR)
+			continue;
+		if (errno == EIO || errno == EINVAL || errno == EOPNOTSUPP) {
+			/* No checksum offload on this route, stay with sendmmsg() from now on */
+			int zero = 0;
+			setsockopt(s->fd, SOL_UDP, UDP_SEGMENT, &zero, sizeof(zero));
+			s->gso = 0;
+			return udp_send_mmsg(s);
+		}
+		return udp_error();
+	}
+
+	return ES2TS_OK;
+}
+
+static int udp_flush(struct sink_udp_s *s)
+{
+	int ret = ES2TS_OK;
+
+	if (s->nmsgs == 0)
+		return ES2TS_OK;
+
+	if (s->gso && s->nmsgs > 1)
+		ret = udp_send_gso(s);
+	else
+		ret = udp_send_mmsg(s);
+
+	s->nmsgs = 0;
+	s->niov = 0;
+
+	return ret;
+}
+
+static void udp_datagram_begin(struct sink_udp_s *s)
+{
+	struct msghdr *hdr = &s->msgs[s->nmsgs].msg_hdr;
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->msg_iov = s->iov + s->niov;
+
+	if (s->rtp) {
+		unsigned char *p = s->rtphdr[s->nmsgs];
+		unsigned int ts = rtp_clock();
+
+		p[0] = 0x80;
+		p[1] = RTP_PAYLOAD_MP2T;
+		p[2] = s->seq >> 8;
+		p[3] = s->seq;
+		p[4] = ts >> 24;
+		p[5] = ts >> 16;
+		p[6] = ts >> 8;
+		p[7] = ts;
+		p[8] = s->ssrc >> 24;
+		p[9] = s->ssrc >> 16;
+		p[10] = s->ssrc >> 8;
+		p[11] = s->ssrc;
+		s->seq++;
+
+		s->iov[s->niov].iov_base = p;
+		s->iov[s->niov].iov_len = RTP_HEADER_SIZE;
+		s->niov++;
+		hdr->msg_iovlen++;
+	}
+}
+
+static int udp_write(struct es2ts_sink_s *sink, const struct iovec *iov, int iovcnt)
+{
+	struct sink_udp_s *s = (struct sink_udp_s *)sink;
+	int dgramlen = 0;
+	int ret;
+
+	/* Slice the caller's packet runs into datagrams without copying them */
+	for (int i = 0; i < iovcnt; i++) {
+		unsigned char *ptr = iov[i].iov_base;
+		int len = iov[i].iov_len;
+
+		while (len > 0) {
+			if (dgramlen == 0)
+				udp_datagram_begin(s);
+
+			int cplen = UDP_PAYLOAD - dgramlen;
+			if (cplen > len)
+				cplen = len;
+
+			struct msghdr *hdr = &s->msgs[s->nmsgs].msg_hdr;
+			s->iov[s->niov].iov_base = ptr;
+			s->iov[s->niov].iov_len = cplen;
+			s->niov++;
+			hdr->msg_iovlen++;
+
+			ptr += cplen;
+			len -= cplen;
+			dgramlen += cplen;
+
+			if (dgramlen == UDP_PAYLOAD) {
+				dgramlen = 0;
+				if (++s->nmsgs == UDP_BATCH) {
+					ret = udp_flush(s);
+					if (ES2TS_FAILED(ret))
+						return ret;
+				}
+			}
+		}
+	}
+
+	/* A short trailing datagram, then everything goes out before the buffers are reused */
+	if (dgramlen)
+		s->nmsgs++;
+
+	return udp_flush(s);
+}
+
+static void udp_close(struct es2ts_sink_s *sink)
+{
+	struct sink_udp_s *s = (struct sink_udp_s *)sink;
+
+	if (s->fd >= 0)
+		close(s->fd);
+	memset(s, 0, sizeof(*s));
+	free(s);
+}
+
+static int udp_setup(struct sink_udp_s *s, struct addrinfo *ai, const struct es2ts_sink_udp_opts_s *opts)
+{
+	int multicast;
+	int ifindex = 0;
+
+	if (opts->ifname) {
+		ifindex = if_nametoindex(opts->ifname);
+		if (ifindex == 0) {
+			fprintf(stderr, "unknown interface %s\n", opts->ifname);
+			return ES2TS_INVALID_ARG;
+		}
+	}
+
+	if (ai->ai_family == AF_INET6) {
+		struct sockaddr_in6 *sa = (struct sockaddr_in6 *)ai->ai_addr;
+		multicast = IN6_IS_ADDR_MULTICAST(&sa->sin6_addr);
+
+		if (opts->ttl && setsockopt(s->fd, IPPROTO_IPV6,
+			multicast ? IPV6_MULTICAST_HOPS : IPV6_UNICAST_HOPS, &opts->ttl, sizeof(opts->ttl)) < 0)
+			return ES2TS_ERROR;
+		if (ifindex && multicast &&
+			setsockopt(s->fd, IPPROTO_IPV6, IPV6_MULTICAST_IF, &ifindex, sizeof(ifindex)) < 0)
+			return ES2TS_ERROR;
+	} else {
+		struct sockaddr_in *sa = (struct sockaddr_in *)ai->ai_addr;
+		multicast = IN_MULTICAST(ntohl(sa->sin_addr.s_addr));
+
+		if (opts->ttl) {
+			unsigned char mttl = opts->ttl;
+			int ret = multicast ?
+				setsockopt(s->fd, IPPROTO_IP, IP_MULTICAST_TTL, &mttl, sizeof(mttl)) :
+				setsockopt(s->fd, IPPROTO_IP, IP_TTL, &opts->ttl, sizeof(opts->ttl));
+			if (ret < 0)
+				return ES2TS_ERROR;
+		}
+		if (ifindex && multicast) {
+			struct ip_mreqn mreq;
+			memset(&mreq, 0, sizeof(mreq));
+			mreq.imr_ifindex = ifindex;
+			if (setsockopt(s->fd, IPPROTO_IP, IP_MULTICAST_IF, &mreq, sizeof(mreq)) < 0)
+				return ES2TS_ERROR;
+		}
+	}
+
+	/* Unicast traffic is pinned to the interface, needs CAP_NET_RAW */
+	if (opts->ifname && !multicast &&
+		setsockopt(s->fd, SOL_SOCKET, SO_BINDTODEVICE, opts->ifname, strlen(opts->ifname)) < 0) {
+		fprintf(stderr, "unable to bind to interface %s\n", opts->ifname);
+		return ES2TS_ERROR;
+	}
+
+	/* Connected, the kernel resolves the route once rather than per datagram */
+	if (connect(s->fd, ai->ai_addr, ai->ai_addrlen) < 0)
+		return ES2TS_ERROR;
+
+	if (!(opts->flags & ES2TS_SINK_UDP_NOGSO)) {
+		int segment = UDP_PAYLOAD + (s->rtp ? RTP_HEADER_SIZE : 0);
+		if (setsockopt(s->fd, SOL_UDP, UDP_SEGMENT, &segment, sizeof(segment)) == 0)
+			s->gso = 1;
+	}
+
+	return ES2TS_OK;
+}
+
+int es2ts_sink_udp_open(struct es2ts_sink_s **r, const char *host, int port,
+	const struct es2ts_sink_udp_opts_s *opts)
+{
+	struct es2ts_sink_udp_opts_s defaults;
+	struct addrinfo hints, *ai;
+	char service[16];
+	int ret;
+
+	if ((!r) || (!host) || (port <= 0) || (port > 65535))
+		return ES2TS_INVALID_ARG;
+
+	if (!opts) {
+		memset(&defaults, 0, sizeof(defaults));
+		opts = &defaults;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	snprintf(service, sizeof(service), "%d", port);
+	if (getaddrinfo(host, service, &hints, &ai) != 0) {
+		fprintf(stderr, "unable to resolve %s\n", host);
+		return ES2TS_INVALID_ARG;
+	}
+
+	struct sink_udp_s *s = calloc(1, sizeof(*s));
+	if (!s) {
+		freeaddrinfo(ai);
+		return ES2TS_ERROR;
+	}
+	s->sink.write = udp_write;
+	s->sink.close = udp_close;
+	s->rtp = (opts->flags & ES2TS_SINK_UDP_RTP) ? 1 : 0;
+	s->ssrc = (unsigned int)time(NULL) ^ ((unsigned int)getpid() << 16);
+	s->fd = socket(ai->ai_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (s->fd < 0) {
+		freeaddrinfo(ai);
+		free(s);
+		return ES2TS_ERROR;
+	}
+
+	ret = udp_setup(s, ai, opts);
+	freeaddrinfo(ai);
+	if (ES2TS_FAILED(ret)) {
+		udp_close(&s->sink);
+		return ret;
+	}
+
+	*r = &s->sink;
+	return ES2TS_OK;
+}
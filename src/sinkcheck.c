@@ -0,0 +1,538 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* Runs an H264 file through the library's output sinks and checks what
+ * comes out against the offline transmux of the same file. The UDP sink
+ * sends to a receiver on 127.0.0.1 in each of its modes, the CBR sink
+ * paces into memory, the HLS sink's segments are read back by URI and
+ * the file sink records to a temporary file.
+ *
+ * sinkcheck input.h264
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <libes2ts/es2ts.h>
+#include <libes2ts/sink.h>
+
+#define TS_PACKET_SIZE		188
+#define CHECK_CHUNK		4096
+#define CHECK_AHEAD		(64 * 1024)	/* Bytes allowed in flight to a receiver */
+#define CHECK_STALL_MS		2000
+#define RTP_HEADER_SIZE		12
+#define UDP_PAYLOAD		(7 * TS_PACKET_SIZE)
+#define PCR_CLOCK		27000000
+#define FRAME_RATE		30		/* es2ts_file_transmux() stamps frames at 30fps */
+#define CBR_HEADROOM		4		/* CBR rate over the stream average */
+#define CBR_BURST		7		/* The sink's default */
+#define HLS_TARGET_MS		2000
+
+static unsigned char *input;
+static size_t inputlen;
+static unsigned char *ref;
+static size_t reflen;
+static uint64_t refframes;
+
+/* What a sink delivered, possibly from another thread */
+struct capture_s {
+	unsigned char *ptr;
+	size_t len;
+	size_t max;
+	int errors;		/* Malformed datagrams and the like */
+};
+
+static int capture_append(struct capture_s *c, const unsigned char *data, size_t len)
+{
+	if (c->len + len > c->max) {
+		size_t max = c->max ? c->max * 2 : 1024 * 1024;
+		while (c->len + len > max)
+			max *= 2;
+		unsigned char *ptr = realloc(c->ptr, max);
+		if (!ptr)
+			return -1;
+		c->ptr = ptr;
+		c->max = max;
+	}
+	memcpy(c->ptr + c->len, data, len);
+	__atomic_store_n(&c->len, c->len + len, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static int load_file(const char *name, unsigned char **ptr, size_t *len)
+{
+	struct stat st;
+	int fd = open(name, O_RDONLY);
+
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "unable to open %s\n", name);
+		return -1;
+	}
+	*len = st.st_size;
+	*ptr = malloc(*len ? *len : 1);
+	if (!*ptr || read(fd, *ptr, *len) != (ssize_t)*len) {
+		fprintf(stderr, "unable to read %s\n", name);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	return 0;
+}
+
+/* The expected output, the offline transmux of the input */
+static int load_reference(const char *name)
+{
+	char path[] = "/tmp/sinkcheck.XXXXXX";
+	int fd = mkstemp(path);
+
+	if (fd < 0)
+		return -1;
+	close(fd);
+
+	struct es2ts_file_stats_s stats;
+	int ret = -1;
+	if (ES2TS_SUCCESS(es2ts_file_transmux(name, path, 0, &stats))) {
+		ret = load_file(path, &ref, &reflen);
+		refframes = stats.frames;
+	}
+	unlink(path);
+
+	return ret;
+}
+
+/* data must be the first want bytes of the reference */
+static int report(const char *name, const unsigned char *data, size_t len, size_t want, int errors)
+{
+	size_t pos = 0;
+
+	while (pos < len && pos < want && data[pos] == ref[pos])
+		pos++;
+
+	if (errors)
+		printf("%-12s FAIL, %d malformed\n", name, errors);
+	else if (pos != len || len != want)
+		printf("%-12s FAIL, %zu of %zu bytes, first difference at %zu\n", name, len, want, pos);
+	else
+		printf("%-12s ok, %zu bytes\n", name, len);
+
+	return errors || pos != len || len != want ? -1 : 0;
+}
+
+/* Run the input through a native context into sink. With progress, the
+ * output bytes delivered so far, hold the input back to stay near it:
+ * loopback UDP drops what the socket buffer can't hold, the CBR sink what
+ * its queue can't.
+ */
+static int feed(struct es2ts_sink_s *sink, const size_t *progress)
+{
+	struct es2ts_context_s *ctx;
+	struct es2ts_stats_s stats;
+
+	if (ES2TS_FAILED(es2ts_alloc_flags(&ctx, ES2TS_FLAG_NATIVE_MUX)) ||
+		ES2TS_FAILED(es2ts_sink_attach(ctx, sink)) ||
+		ES2TS_FAILED(es2ts_process_start(ctx)))
+		return -1;
+
+	for (size_t pos = 0; pos < inputlen; ) {
+		int len = inputlen - pos > CHECK_CHUNK ? CHECK_CHUNK : inputlen - pos;
+
+		/* Input still queued turns into output later, bound both. Lost
+		 * output never arrives, stop waiting on a receiver that stalled.
+		 */
+		for (int idle = 0; progress && idle < CHECK_STALL_MS; idle++) {
+			es2ts_get_stats(ctx, &stats);
+			if (stats.bytes_out <= __atomic_load_n(progress, __ATOMIC_ACQUIRE) + CHECK_AHEAD &&
+				pos <= stats.bytes_consumed + CHECK_AHEAD)
+				break;
+			usleep(1000);
+		}
+
+		if (ES2TS_FAILED(es2ts_data_enqueue(ctx, input + pos, len))) {
+			usleep(1000);
+			continue;
+		}
+		pos += len;
+	}
+
+	/* Everything consumed, then the end flushes the last access unit */
+	do {
+		usleep(10000);
+		es2ts_get_stats(ctx, &stats);
+	} while (stats.bytes_consumed < inputlen);
+
+	es2ts_process_end(ctx);
+	es2ts_free(ctx);
+
+	return 0;
+}
+
+struct receiver_s {
+	int fd;
+	int rtp;
+	struct capture_s capture;
+	int stop;
+};
+
+/* Datagrams are whole TS packets, 7 at most, behind a sequenced RTP header in RTP mode */
+static void *receiver_thread(void *arg)
+{
+	struct receiver_s *r = arg;
+	unsigned char buf[65536];
+	unsigned int seq = 0;
+	int first = 1;
+
+	while (!__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE)) {
+		ssize_t len = recv(r->fd, buf, sizeof(buf), 0);
+		if (len < 0) {
+			if (errno != EAGAIN && errno != EINTR)
+				break;
+			continue;
+		}
+
+		unsigned char *payload = buf;
+		if (r->rtp) {
+			if (len < RTP_HEADER_SIZE || buf[0] != 0x80 || (buf[1] & 0x7f) != 33 ||
+				(!first && (unsigned int)((buf[2] << 8) | buf[3]) != (seq & 0xffff)))
+				r->capture.errors++;
+			seq = ((buf[2] << 8) | buf[3]) + 1;
+			first = 0;
+			payload += RTP_HEADER_SIZE;
+			len -= RTP_HEADER_SIZE;
+		}
+		if (len <= 0 || len > UDP_PAYLOAD || len % TS_PACKET_SIZE)
+			r->capture.errors++;
+		if (len > 0 && capture_append(&r->capture, payload, len) < 0)
+			break;
+	}
+
+	return 0;
+}
+
+static int check_udp(const char *name, unsigned int flags)
+{
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	struct receiver_s r;
+	struct es2ts_sink_s *sink;
+	pthread_t thread;
+
+	memset(&r, 0, sizeof(r));
+	r.rtp = !!(flags & ES2TS_SINK_UDP_RTP);
+	r.fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+	/* Short receive timeout, the thread polls its stop flag */
+	struct timeval tv = { 0, 100000 };
+	int rcvbuf = 4 * 1024 * 1024;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (r.fd < 0 || setsockopt(r.fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0 ||
+		setsockopt(r.fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0 ||
+		bind(r.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		getsockname(r.fd, (struct sockaddr *)&addr, &addrlen) < 0) {
+		fprintf(stderr, "unable to set up the loopback receiver\n");
+		return -1;
+	}
+
+	struct es2ts_sink_udp_opts_s opts = { flags, 0, 0 };
+	if (ES2TS_FAILED(es2ts_sink_udp_open(&sink, "127.0.0.1", ntohs(addr.sin_port), &opts)) ||
+		pthread_create(&thread, 0, receiver_thread, &r) != 0) {
+		close(r.fd);
+		return -1;
+	}
+
+	int ret = feed(sink, &r.capture.len);
+	es2ts_sink_close(sink);
+
+	/* Give the last datagrams time to arrive */
+	for (int i = 0; i < 100 && __atomic_load_n(&r.capture.len, __ATOMIC_ACQUIRE) < reflen; i++)
+		usleep(10000);
+	__atomic_store_n(&r.stop, 1, __ATOMIC_RELEASE);
+	pthread_join(thread, 0);
+	close(r.fd);
+
+	if (ret == 0)
+		ret = report(name, r.capture.ptr, r.capture.len, reflen, r.capture.errors);
+	free(r.capture.ptr);
+
+	return ret;
+}
+
+/* A sink that keeps everything in memory */
+struct memsink_s {
+	struct es2ts_sink_s sink;
+	struct capture_s capture;
+	size_t payload;		/* Bytes other than null packets */
+	size_t write_size;	/* Every write must be this long, 0 for any */
+};
+
+static int memsink_write(struct es2ts_sink_s *sink, const struct iovec *iov, int iovcnt)
+{
+	struct memsink_s *m = (struct memsink_s *)sink;
+	size_t len = 0;
+
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	if (m->write_size && len != m->write_size)
+		m->capture.errors++;
+
+	for (int i = 0; i < iovcnt; i++) {
+		const unsigned char *p = iov[i].iov_base;
+		if (capture_append(&m->capture, p, iov[i].iov_len) < 0)
+			return ES2TS_ERROR;
+		for (size_t pos = 0; pos + TS_PACKET_SIZE <= iov[i].iov_len; pos += TS_PACKET_SIZE) {
+			if (((p[pos + 1] & 0x1f) << 8 | p[pos + 2]) != 0x1fff)
+				__atomic_add_fetch(&m->payload, TS_PACKET_SIZE, __ATOMIC_RELEASE);
+		}
+	}
+
+	return ES2TS_OK;
+}
+
+static int pcr_get(const unsigned char *pkt, uint64_t *pcr)
+{
+	if (!(pkt[3] & 0x20) || pkt[4] < 7 || !(pkt[5] & 0x10))
+		return 0;
+
+	uint64_t base = ((uint64_t)pkt[6] << 25) | (pkt[7] << 17) | (pkt[8] << 9) | (pkt[9] << 1) | (pkt[10] >> 7);
+	*pcr = base * 300 + (((pkt[10] & 1) << 8) | pkt[11]);
+	return 1;
+}
+
+/* Nulls dropped and PCRs masked, the rest must be the reference. Every
+ * write must be one burst and every PCR must sit exactly where its
+ * packet's position at the CBR rate puts it.
+ */
+static int check_cbr(const char *name)
+{
+	struct memsink_s mem;
+	struct es2ts_sink_s *sink;
+	struct es2ts_sink_cbr_stats_s stats;
+
+	memset(&mem, 0, sizeof(mem));
+	mem.sink.write = memsink_write;
+	mem.write_size = CBR_BURST * TS_PACKET_SIZE;
+
+	uint64_t bitrate = (uint64_t)reflen * 8 * FRAME_RATE / (refframes ? refframes : 1) * CBR_HEADROOM;
+	if (ES2TS_FAILED(es2ts_sink_cbr_open(&sink, &mem.sink, bitrate, 0)))
+		return -1;
+
+	int ret = feed(sink, &mem.payload);
+
+	/* The pacer still holds the tail */
+	do {
+		usleep(10000);
+		es2ts_sink_cbr_get_stats(sink, &stats);
+	} while (stats.queue_bytes);
+	es2ts_sink_close(sink);
+
+	struct capture_s out;
+	memset(&out, 0, sizeof(out));
+	out.errors = mem.capture.errors;	/* Writes other than one burst */
+	uint64_t last_pcr = 0, last_n = 0;
+	int have_pcr = 0;
+	for (size_t n = 0; (n + 1) * TS_PACKET_SIZE <= mem.capture.len; n++) {
+		unsigned char pkt[TS_PACKET_SIZE];
+		uint64_t pcr;
+
+		memcpy(pkt, mem.capture.ptr + n * TS_PACKET_SIZE, TS_PACKET_SIZE);
+		if (pkt[0] != 0x47)
+			out.errors++;
+		if (((pkt[1] & 0x1f) << 8 | pkt[2]) == 0x1fff)
+			continue;
+
+		if (pcr_get(pkt, &pcr)) {
+			/* Exact to the tick, give or take rounding at either end */
+			unsigned __int128 bits = (unsigned __int128)(n - last_n) * TS_PACKET_SIZE * 8;
+			int64_t want = (int64_t)(bits * PCR_CLOCK / bitrate);
+			if (have_pcr && llabs((int64_t)(pcr - last_pcr) - want) > 1)
+				out.errors++;
+			last_pcr = pcr;
+			last_n = n;
+			have_pcr = 1;
+
+			if (out.len + TS_PACKET_SIZE <= reflen)
+				memcpy(pkt + 6, ref + out.len + 6, 6);
+		}
+		if (capture_append(&out, pkt, TS_PACKET_SIZE) < 0)
+			break;
+	}
+	if (stats.dropped)
+		out.errors++;
+
+	if (ret == 0)
+		ret = report(name, out.ptr, out.len, reflen, out.errors);
+	if (ret == 0)
+		printf("%-12s %llu bit/s, %llu packets, %llu nulls\n", "", (unsigned long long)bitrate,
+			(unsigned long long)stats.packets, (unsigned long long)stats.nulls);
+	free(out.ptr);
+	free(mem.capture.ptr);
+
+	return ret;
+}
+
+/* Every segment the playlist lists, read back in order, must be the
+ * reference up to the last cut, opening with the PAT and inside twice the
+ * target and the advertised EXT-X-TARGETDURATION. The segment still being built at close is never published.
+ */
+static int check_hls(const char *name)
+{
+	struct es2ts_sink_s *sink;
+	struct es2ts_sink_hls_opts_s opts;
+	struct capture_s out;
+
+	/* Room in the playlist for the whole stream */
+	memset(&opts, 0, sizeof(opts));
+	opts.target_ms = HLS_TARGET_MS;
+	opts.segments = refframes * 1000 / FRAME_RATE / HLS_TARGET_MS + 2;
+	if (ES2TS_FAILED(es2ts_sink_hls_open(&sink, &opts)))
+		return -1;
+
+	int ret = feed(sink, 0);
+
+	int len = es2ts_sink_hls_playlist(sink, 0, 0);
+	char *playlist = len > 0 ? malloc(len + 1) : 0;
+	if (!playlist || es2ts_sink_hls_playlist(sink, playlist, len + 1) != len) {
+		printf("%-12s FAIL, no playlist\n", name);
+		es2ts_sink_close(sink);
+		free(playlist);
+		return -1;
+	}
+
+	memset(&out, 0, sizeof(out));
+	int nseg = 0, target_secs = 0;
+	for (char *line = strtok(playlist, "\n"); line; line = strtok(0, "\n")) {
+		struct es2ts_hls_segment_s *seg;
+
+		sscanf(line, "#EXT-X-TARGETDURATION:%d", &target_secs);
+		if (line[0] == '#')
+			continue;
+		if (ES2TS_FAILED(es2ts_sink_hls_segment_get(sink, line, &seg))) {
+			out.errors++;
+			continue;
+		}
+		if (seg->sequence != (uint64_t)nseg || seg->len < TS_PACKET_SIZE || seg->len % TS_PACKET_SIZE ||
+			seg->ptr[0] != 0x47 || seg->ptr[1] != 0x40 || seg->ptr[2] != 0x00 ||
+			seg->duration <= 0 || seg->duration > 2.0 * HLS_TARGET_MS / 1000 + 1.0 / FRAME_RATE ||
+			(int)(seg->duration + 0.5) > target_secs)
+			out.errors++;
+		if (capture_append(&out, seg->ptr, seg->len) < 0)
+			out.errors++;
+		es2ts_sink_hls_segment_put(seg);
+		nseg++;
+	}
+	free(playlist);
+	es2ts_sink_close(sink);
+
+	/* Only the published part of the reference, the rest opens the next segment */
+	size_t want = out.len < reflen ? out.len : reflen;
+	if (want < reflen && (want + 3 > reflen || ref[want] != 0x47 || ref[want + 1] != 0x40 || ref[want + 2] != 0x00))
+		out.errors++;
+	if (ret == 0)
+		ret = report(name, out.ptr, out.len, want, out.errors);
+	if (ret == 0)
+		printf("%-12s %d segments, %zu bytes unpublished\n", "", nseg, reflen - out.len);
+	free(out.ptr);
+
+	return ret;
+}
+
+static int check_file(const char *name, unsigned int flags)
+{
+	char path[] = "/tmp/sinkcheck.XXXXXX";
+	struct es2ts_sink_s *sink;
+	struct es2ts_sink_file_stats_s stats;
+	unsigned char *data = 0;
+	size_t len = 0;
+	int fd = mkstemp(path);
+
+	if (fd < 0)
+		return -1;
+	close(fd);
+
+	struct es2ts_sink_file_opts_s opts = { flags, 0, 0 };
+	if (ES2TS_FAILED(es2ts_sink_file_open(&sink, path, &opts))) {
+		printf("%-12s FAIL, unable to open %s\n", name, path);
+		unlink(path);
+		return -1;
+	}
+
+	int ret = feed(sink, 0);
+	es2ts_sink_file_get_stats(sink, &stats);
+	es2ts_sink_close(sink);
+
+	if (ret == 0)
+		ret = load_file(path, &data, &len);
+	unlink(path);
+
+	if (ret == 0 && (stats.dropped || stats.errors)) {
+		printf("%-12s FAIL, %llu bytes dropped, %llu failed writes\n", name,
+			(unsigned long long)stats.dropped, (unsigned long long)stats.errors);
+		ret = -1;
+	}
+	if (ret == 0)
+		ret = report(name, data, len, reflen, 0);
+	if (ret == 0)
+		printf("%-12s %s\n", "", stats.uring ? "io_uring" : "writer thread");
+	free(data);
+
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	int failed = 0;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: sinkcheck input.h264\n");
+		return 1;
+	}
+
+	if (load_file(argv[1], &input, &inputlen) < 0 || load_reference(argv[1]) < 0)
+		return 1;
+
+	failed |= check_udp("udp", 0);
+	failed |= check_udp("udp nogso", ES2TS_SINK_UDP_NOGSO);
+	failed |= check_udp("udp rtp", ES2TS_SINK_UDP_RTP);
+	failed |= check_cbr("cbr");
+	failed |= check_hls("hls");
+	failed |= check_file("file", 0);
+	failed |= check_file("file nouring", ES2TS_SINK_FILE_NOURING);
+	failed |= check_file("file direct", ES2TS_SINK_FILE_DIRECT);
+
+	free(ref);
+	free(input);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,139 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "config.h"
+#include "startcode.h"
+
+#include <stddef.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define STARTCODE_X86 1
+#endif
+
+/* The reference. A byte above 1 can't be any of the three start code
+ * bytes at this position, so it rules out the two positions before it too.
+ */
+static const unsigned char *find_scalar(const unsigned char *p, const unsigned char *end)
+{
+	while (end - p >= 3) {
+		if (p[2] > 1)
+			p += 3;
+		else if (p[0] || p[1] || p[2] != 1)
+			p++;
+		else
+			return p;
+	}
+
+	return NULL;
+}
+
+#ifdef STARTCODE_X86
+
+/* Compare 16 or 32 offsets at once against 00, 00 and 01 with three
+ * overlapping unaligned loads. Compressed video rarely matches, so the
+ * loop mostly just streams.
+ */
+__attribute__((target("sse2")))
+static const unsigned char *find_sse2(const unsigned char *p, const unsigned char *end)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i one = _mm_set1_epi8(1);
+
+	while (end - p >= 16 + 2) {
+		__m128i b0 = _mm_loadu_si128((const __m128i *)p);
+		__m128i b1 = _mm_loadu_si128((const __m128i *)(p + 1));
+		__m128i b2 = _mm_loadu_si128((const __m128i *)(p + 2));
+		__m128i m = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(b0, zero), _mm_cmpeq_epi8(b1, zero)),
+			_mm_cmpeq_epi8(b2, one));
+		unsigned int mask = _mm_movemask_epi8(m);
+		if (mask)
+			return p + __builtin_ctz(mask);
+		p += 16;
+	}
+
+	return find_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static const unsigned char *find_avx2(const unsigned char *p, const unsigned char *end)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i one = _mm256_set1_epi8(1);
+
+	while (end - p >= 32 + 2) {
+		__m256i b0 = _mm256_loadu_si256((const __m256i *)p);
+		__m256i b1 = _mm256_loadu_si256((const __m256i *)(p + 1));
+		__m256i b2 = _mm256_loadu_si256((const __m256i *)(p + 2));
+		__m256i m = _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(b0, zero), _mm256_cmpeq_epi8(b1, zero)),
+			_mm256_cmpeq_epi8(b2, one));
+		unsigned int mask = _mm256_movemask_epi8(m);
+		if (mask)
+			return p + __builtin_ctz(mask);
+		p += 32;
+	}
+
+	return find_sse2(p, end);
+}
+
+#endif
+
+es2ts_startcode_fn es2ts_startcode_impl(int isa)
+{
+	switch (isa) {
+	case STARTCODE_SCALAR:
+		return find_scalar;
+#ifdef STARTCODE_X86
+	case STARTCODE_SSE2:
+		return __builtin_cpu_supports("sse2") ? find_sse2 : NULL;
+	case STARTCODE_AVX2:
+		return __builtin_cpu_supports("avx2") ? find_avx2 : NULL;
+#endif
+	default:
+		return NULL;
+	}
+}
+
+/* The best implementation, resolved on first use. Racing threads all
+ * resolve to the same answer, so a plain store is fine.
+ */
+static const unsigned char *find_resolve(const unsigned char *p, const unsigned char *end);
+static es2ts_startcode_fn find_best = find_resolve;
+
+static const unsigned char *find_resolve(const unsigned char *p, const unsigned char *end)
+{
+	es2ts_startcode_fn fn = NULL;
+
+	for (int isa = STARTCODE_AVX2; !fn; isa--)
+		fn = es2ts_startcode_impl(isa);
+	__atomic_store_n(&find_best, fn, __ATOMIC_RELAXED);
+
+	return fn(p, end);
+}
+
+const unsigned char *es2ts_startcode_find(const unsigned char *p, const unsigned char *end)
+{
+	return __atomic_load_n(&find_best, __ATOMIC_RELAXED)(p, end);
+}
@@ -0,0 +1,50 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef ES2TS_STARTCODE_H
+#define ES2TS_STARTCODE_H
+
+/* Annex-B start code search, the inner loop of every NAL aware pass over
+ * the input. Vectorized with SSE2 or AVX2 where the CPU has them, picked
+ * at runtime, with a scalar fallback everywhere else.
+ */
+
+#define STARTCODE_SCALAR	0
+#define STARTCODE_SSE2		1
+#define STARTCODE_AVX2		2
+
+typedef const unsigned char *(*es2ts_startcode_fn)(const unsigned char *p, const unsigned char *end);
+
+/* The first 00 00 01 lying wholly inside [p, end), or NULL. A start code
+ * split across two input chunks is found once the caller has both halves
+ * in one buffer and searches again from no more than two bytes before the
+ * old end.
+ */
+const unsigned char *es2ts_startcode_find(const unsigned char *p, const unsigned char *end);
+
+/* A specific implementation, NULL when this CPU or build lacks it. For benchmarks. */
+es2ts_startcode_fn es2ts_startcode_impl(int isa);
+
+#endif
@@ -0,0 +1,162 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "config.h"
+#include <libes2ts/es2ts.h>
+#include "stats.h"
+
+#include <string.h>
+
+#define load_relaxed(p)		__atomic_load_n(p, __ATOMIC_RELAXED)
+#define store_relaxed(p, v)	__atomic_store_n(p, v, __ATOMIC_RELAXED)
+
+/* Values below 8 get a bucket each. Above that the top bit picks a group of 8
+ * buckets and the next three bits pick one within it.
+ */
+#define HIST_SUB_BITS	3
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_MAX	((UINT64_C(1) << (ES2TS_HIST_BUCKETS / HIST_SUB + 2)) - 1)
+
+static int bucket_index(uint64_t v)
+{
+	if (v < HIST_SUB)
+		return v;
+	if (v > HIST_MAX)
+		v = HIST_MAX;
+
+	int msb = 63 - __builtin_clzll(v);
+	return (msb - HIST_SUB_BITS + 1) * HIST_SUB + ((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Largest value that lands in bucket idx */
+static uint64_t bucket_upper(int idx)
+{
+	if (idx < HIST_SUB)
+		return idx;
+
+	int msb = idx / HIST_SUB + HIST_SUB_BITS - 1;
+	uint64_t sub = idx % HIST_SUB;
+	return ((HIST_SUB + sub + 1) << (msb - HIST_SUB_BITS)) - 1;
+}
+
+void es2ts_histogram_record(struct es2ts_histogram_s *h, int64_t ns)
+{
+	uint64_t v = ns < 0 ? 0 : ns;
+	int idx = bucket_index(v);
+
+	/* The worker is the only writer, plain load / store keeps readers tear free */
+	store_relaxed(&h->bucket[idx], load_relaxed(&h->bucket[idx]) + 1);
+	store_relaxed(&h->sum, load_relaxed(&h->sum) + v);
+	if (load_relaxed(&h->count) == 0 || v < load_relaxed(&h->min))
+		store_relaxed(&h->min, v);
+	if (v > load_relaxed(&h->max))
+		store_relaxed(&h->max, v);
+	store_relaxed(&h->count, load_relaxed(&h->count) + 1);
+}
+
+uint64_t es2ts_histogram_percentile(const struct es2ts_histogram_s *h, double pct)
+{
+	uint64_t total = 0;
+
+	if (!h)
+		return 0;
+
+	for (int i = 0; i < ES2TS_HIST_BUCKETS; i++)
+		total += h->bucket[i];
+	if (total == 0)
+		return 0;
+
+	uint64_t want = (uint64_t)(total * pct / 100.0 + 0.5);
+	if (want == 0)
+		want = 1;
+	if (want > total)
+		want = total;
+
+	uint64_t seen = 0;
+	for (int i = 0; i < ES2TS_HIST_BUCKETS; i++) {
+		seen += h->bucket[i];
+		if (seen >= want)
+			return bucket_upper(i) < h->max ? bucket_upper(i) : h->max;
+	}
+
+	return h->max;
+}
+
+/* Accumulate src into dst, which starts out zeroed */
+static void histogram_add(struct es2ts_histogram_s *dst, struct es2ts_histogram_s *src)
+{
+	uint64_t count = load_relaxed(&src->count);
+	uint64_t min = load_relaxed(&src->min);
+	uint64_t max = load_relaxed(&src->max);
+
+	if (count && (dst->count == 0 || min < dst->min))
+		dst->min = min;
+	if (max > dst->max)
+		dst->max = max;
+	dst->count += count;
+	dst->sum += load_relaxed(&src->sum);
+	for (int i = 0; i < ES2TS_HIST_BUCKETS; i++)
+		dst->bucket[i] += load_relaxed(&src->bucket[i]);
+}
+
+/* Fold the counters of ctx into stats */
+static void stats_add(struct es2ts_stats_s *stats, struct es2ts_stats_s *s)
+{
+	stats->bytes_consumed += load_relaxed(&s->bytes_consumed);
+	stats->bytes_in += load_relaxed(&s->bytes_in);
+	stats->bytes_out += load_relaxed(&s->bytes_out);
+	stats->bytes_dropped += load_relaxed(&s->bytes_dropped);
+
+	uint64_t free_min = load_relaxed(&s->queue_free_min);
+	if (free_min < stats->queue_free_min)
+		stats->queue_free_min = free_min;
+
+	histogram_add(&stats->queue, &s->queue);
+	histogram_add(&stats->demux, &s->demux);
+	histogram_add(&stats->mux, &s->mux);
+	histogram_add(&stats->callback, &s->callback);
+}
+
+int es2ts_get_stats(struct es2ts_context_s *ctx, struct es2ts_stats_s *stats)
+{
+	if ((!ctx) || (!stats))
+		return ES2TS_INVALID_ARG;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->queue_free_min = UINT64_MAX;	/* A ring that ran dry reports 0 */
+
+	/* An MPTS reports as a whole, its streams queue and mux, it outputs */
+	stats_add(stats, &ctx->stats);
+	for (int i = 0; i < ctx->stream_count; i++)
+		stats_add(stats, &ctx->streams[i]->stats);
+
+	/* The two counters are read racing the threads that bump them */
+	stats->queue_bytes = 0;
+	if (stats->bytes_in > stats->bytes_consumed)
+		stats->queue_bytes = stats->bytes_in - stats->bytes_consumed;
+	stats->first_packet = load_relaxed(&ctx->stats.first_packet);
+
+	return ES2TS_OK;
+}
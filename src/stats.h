@@ -0,0 +1,62 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef ES2TS_STATS_H
+#define ES2TS_STATS_H
+
+/* Internal helpers behind es2ts_get_stats(). Counters may be bumped from
+ * several producer threads and are read by anyone, so they're updated with
+ * relaxed atomics. Each histogram only has the worker writing it.
+ */
+
+#include <libes2ts/es2ts.h>
+#include <time.h>
+
+static inline int64_t es2ts_stats_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void es2ts_stats_add(uint64_t *counter, uint64_t n)
+{
+	__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+/* Lower *counter to n if n is smaller */
+static inline void es2ts_stats_min(uint64_t *counter, uint64_t n)
+{
+	uint64_t cur = __atomic_load_n(counter, __ATOMIC_RELAXED);
+	while (n < cur) {
+		if (__atomic_compare_exchange_n(counter, &cur, n, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+	}
+}
+
+/* Single writer, ns < 0 (clock stepped) counts as 0 */
+void es2ts_histogram_record(struct es2ts_histogram_s *h, int64_t ns);
+
+#endif
@@ -24,6 +24,8 @@
  */
 
 #include <stdio.h>
+#include <string.h>
+#include <signal.h>
 #include <libes2ts/es2ts.h>
 
 /* A sample application to demonstrate the libes2ts library */
@@ -53,8 +55,21 @@ int downstream_callback(struct es2ts_context_s *ctx, unsigned char *buf, int len
 int main(int argc, char *argv[])
 {
 	int ret;
+	unsigned int flags = 0;
 
-	ret = es2ts_alloc(&ctx);
+	for (int i = 1; i < argc; i++) {
+		/* Optionally bypass libavformat and use the built-in packetizer */
+		if (strcmp(argv[i], "--native") == 0)
+			flags |= ES2TS_FLAG_NATIVE_MUX;
+
+		/* Record a binary trace, kill -USR1 writes it to es2ts.trace for tracedecode */
+		if (strcmp(argv[i], "--trace") == 0) {
+			es2ts_trace_enable(1);
+			es2ts_trace_dump_on_signal(SIGUSR1, "es2ts.trace");
+		}
+	}
+
+	ret = es2ts_alloc_flags(&ctx, flags);
 	if (ES2TS_FAILED(ret))
 		return 1;
 
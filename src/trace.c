@@ -0,0 +1,222 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "config.h"
+#include <libes2ts/es2ts.h>
+#include "stats.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+/* Records per thread, a power of two. 16384 * 40 bytes, about 640KB */
+#define TRACE_RING_RECS		16384
+
+/* Records at the overwrite edge of a live ring that a dump leaves out,
+ * the writer may be filling them in while we copy.
+ */
+#define TRACE_DUMP_MARGIN	64
+
+struct trace_ring_s {
+	struct trace_ring_s *next;	/* Append only list of every ring ever made */
+	int owned;			/* A live thread writes here */
+	uint32_t tid;
+	uint64_t head;			/* Records ever written */
+	struct es2ts_trace_rec_s rec[TRACE_RING_RECS];
+};
+
+int es2ts_trace_on = 0;
+
+static struct trace_ring_s *rings;
+static __thread struct trace_ring_s *self;
+static pthread_key_t self_key;
+static pthread_once_t self_once = PTHREAD_ONCE_INIT;
+static char signal_path[PATH_MAX];
+
+/* Thread exit, the ring keeps its records until another thread adopts it */
+static void trace_release(void *p)
+{
+	struct trace_ring_s *r = p;
+	__atomic_store_n(&r->owned, 0, __ATOMIC_RELEASE);
+}
+
+static void trace_init(void)
+{
+	pthread_key_create(&self_key, trace_release);
+}
+
+/* First event on this thread, so threads that come and go don't grow the list forever */
+static struct trace_ring_s *trace_ring(void)
+{
+	struct trace_ring_s *r;
+	uint32_t tid = syscall(SYS_gettid);
+
+	pthread_once(&self_once, trace_init);
+
+	for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+		int unowned = 0;
+		if (__atomic_compare_exchange_n(&r->owned, &unowned, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+	}
+
+	if (!r) {
+		r = calloc(1, sizeof(*r));
+		if (!r)
+			return 0;
+		r->owned = 1;
+		r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&rings, &r->next, r, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+	}
+
+	r->tid = tid;
+	pthread_setspecific(self_key, r);
+	self = r;
+
+	return r;
+}
+
+void es2ts_trace_event(int event, void *ctx, int64_t a, int64_t b)
+{
+	struct trace_ring_s *r = self;
+
+	if (!r && !(r = trace_ring()))
+		return;
+
+	uint64_t head = r->head;
+	struct es2ts_trace_rec_s *rec = &r->rec[head & (TRACE_RING_RECS - 1)];
+	rec->ts = es2ts_stats_now();
+	rec->ctx = (uintptr_t)ctx;
+	rec->a = a;
+	rec->b = b;
+	rec->tid = r->tid;
+	rec->event = event;
+
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+
+	while (len) {
+		ssize_t ret = write(fd, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		p += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/* Only open, write and close, safe to call from a signal handler */
+static int trace_dump_path(const char *filename)
+{
+	struct es2ts_trace_header_s hdr = { ES2TS_TRACE_MAGIC, ES2TS_TRACE_VERSION, sizeof(struct es2ts_trace_rec_s) };
+	int ret = ES2TS_OK;
+
+	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return ES2TS_ERROR;
+
+	if (write_all(fd, &hdr, sizeof(hdr)) < 0)
+		ret = ES2TS_ERROR;
+
+	for (struct trace_ring_s *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r && ret == ES2TS_OK; r = r->next) {
+		uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		uint64_t first = 0;
+
+		if (head >= TRACE_RING_RECS) {
+			first = head - TRACE_RING_RECS;
+			if (__atomic_load_n(&r->owned, __ATOMIC_RELAXED))
+				first += TRACE_DUMP_MARGIN;
+		}
+
+		/* Oldest to newest, in at most two runs around the wrap */
+		while (first < head && ret == ES2TS_OK) {
+			unsigned int idx = first & (TRACE_RING_RECS - 1);
+			uint64_t n = TRACE_RING_RECS - idx;
+			if (n > head - first)
+				n = head - first;
+			if (write_all(fd, &r->rec[idx], n * sizeof(struct es2ts_trace_rec_s)) < 0)
+				ret = ES2TS_ERROR;
+			first += n;
+		}
+	}
+
+	close(fd);
+
+	return ret;
+}
+
+static void trace_signal(int signum)
+{
+	int saved = errno;
+
+	(void)signum;
+	trace_dump_path(signal_path);
+	errno = saved;
+}
+
+void es2ts_trace_enable(int enable)
+{
+	__atomic_store_n(&es2ts_trace_on, enable ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+int es2ts_trace_dump(const char *filename)
+{
+	if (!filename)
+		return ES2TS_INVALID_ARG;
+
+	return trace_dump_path(filename);
+}
+
+int es2ts_trace_dump_on_signal(int signum, const char *filename)
+{
+	struct sigaction sa;
+
+	if ((!filename) || (strlen(filename) >= sizeof(signal_path)))
+		return ES2TS_INVALID_ARG;
+
+	strcpy(signal_path, filename);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = trace_signal;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(signum, &sa, NULL) < 0)
+		return ES2TS_ERROR;
+
+	return ES2TS_OK;
+}
@@ -0,0 +1,93 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef ES2TS_TRACE_H
+#define ES2TS_TRACE_H
+
+/* Binary event trace. Every thread that emits an event gets its own ring of
+ * fixed size records, a flight recorder that overwrites its oldest entries.
+ * Recording is a timestamp and a handful of stores, nothing is formatted
+ * until the dump is decoded offline with tracedecode. When tracing is off
+ * each trace point costs one relaxed load and a predicted branch.
+ */
+
+#include <stdint.h>
+
+/* es2ts_trace_dump() file layout: one header, then records in no particular order */
+#define ES2TS_TRACE_MAGIC	"ES2TSTRC"
+#define ES2TS_TRACE_VERSION	1
+
+struct es2ts_trace_header_s {
+	char magic[8];
+	uint32_t version;
+	uint32_t recsize;	/* sizeof(struct es2ts_trace_rec_s) */
+};
+
+struct es2ts_trace_rec_s {
+	uint64_t ts;		/* CLOCK_MONOTONIC ns */
+	uint64_t ctx;		/* Context the event belongs to, 0 if none */
+	int64_t a;
+	int64_t b;
+	uint32_t tid;
+	uint16_t event;		/* TRACE_* */
+	uint16_t pad;
+};
+
+/* Event id, name and Chrome trace phase. B and E events of the same name
+ * bracket a stage on one thread, i is an instant.
+ */
+#define ES2TS_TRACE_EVENTS(X) \
+	X(TRACE_ENQUEUE,	"enqueue",	'i')	/* a = bytes, b = producer sequence */ \
+	X(TRACE_ENQUEUE_FULL,	"enqueue full",	'i')	/* a = bytes refused */ \
+	X(TRACE_DEQUEUE,	"dequeue",	'i')	/* a = bytes */ \
+	X(TRACE_RELEASE,	"release",	'i')	/* a = bytes handed back */ \
+	X(TRACE_WAIT_BEGIN,	"wait",		'B') \
+	X(TRACE_WAIT_END,	"wait",		'E') \
+	X(TRACE_DEMUX_BEGIN,	"demux",	'B') \
+	X(TRACE_DEMUX_END,	"demux",	'E')	/* a = bytes */ \
+	X(TRACE_MUX_BEGIN,	"mux",		'B')	/* a = bytes, b = pts */ \
+	X(TRACE_MUX_END,	"mux",		'E') \
+	X(TRACE_CALLBACK_BEGIN,	"callback",	'B')	/* a = bytes */ \
+	X(TRACE_CALLBACK_END,	"callback",	'E') \
+	X(TRACE_STEP_BEGIN,	"engine step",	'B')	/* a = worker */ \
+	X(TRACE_STEP_END,	"engine step",	'E')	/* a = ENGINE_STEP_* */ \
+	X(TRACE_SPACE_BEGIN,	"enqueue wait",	'B')	/* a = bytes */ \
+	X(TRACE_SPACE_END,	"enqueue wait",	'E')	/* a = ES2TS_OK or ES2TS_ERROR */ \
+	X(TRACE_WATERMARK,	"watermark",	'i')	/* a = ES2TS_WATERMARK_*, b = bytes queued */
+
+#define ES2TS_TRACE_ENUM(id, name, phase) id,
+enum { ES2TS_TRACE_EVENTS(ES2TS_TRACE_ENUM) TRACE_MAX };
+#undef ES2TS_TRACE_ENUM
+
+extern int es2ts_trace_on;
+
+void es2ts_trace_event(int event, void *ctx, int64_t a, int64_t b);
+
+#define ES2TS_TRACE(event, ctx, a, b) do { \
+	if (__builtin_expect(__atomic_load_n(&es2ts_trace_on, __ATOMIC_RELAXED), 0)) \
+		es2ts_trace_event(event, ctx, a, b); \
+} while (0)
+
+#endif
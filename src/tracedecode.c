@@ -0,0 +1,127 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* Decode an es2ts_trace_dump() file, as Chrome trace JSON (load it in
+ * chrome://tracing or Perfetto) or with -t as a plain text timeline.
+ *
+ * tracedecode [-t] trace-file
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include "trace.h"
+
+#define TRACE_NAME(id, name, phase) [id] = name,
+static const char *names[TRACE_MAX] = { ES2TS_TRACE_EVENTS(TRACE_NAME) };
+#undef TRACE_NAME
+
+#define TRACE_PHASE(id, name, phase) [id] = phase,
+static const char phases[TRACE_MAX] = { ES2TS_TRACE_EVENTS(TRACE_PHASE) };
+#undef TRACE_PHASE
+
+static int cmp_ts(const void *a, const void *b)
+{
+	const struct es2ts_trace_rec_s *ra = a, *rb = b;
+	if (ra->ts != rb->ts)
+		return ra->ts < rb->ts ? -1 : 1;
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int text = 0;
+	int arg = 1;
+
+	if (argc > arg && strcmp(argv[arg], "-t") == 0) {
+		text = 1;
+		arg++;
+	}
+	if (argc != arg + 1) {
+		fprintf(stderr, "usage: %s [-t] trace-file\n", argv[0]);
+		return 1;
+	}
+
+	FILE *fh = fopen(argv[arg], "rb");
+	if (!fh) {
+		fprintf(stderr, "could not open %s\n", argv[arg]);
+		return 1;
+	}
+
+	struct es2ts_trace_header_s hdr;
+	if ((fread(&hdr, sizeof(hdr), 1, fh) != 1) ||
+		(memcmp(hdr.magic, ES2TS_TRACE_MAGIC, sizeof(hdr.magic)) != 0) ||
+		(hdr.version != ES2TS_TRACE_VERSION) || (hdr.recsize != sizeof(struct es2ts_trace_rec_s))) {
+		fprintf(stderr, "%s is not a libes2ts trace, or from an incompatible version\n", argv[arg]);
+		return 1;
+	}
+
+	/* Slurp the lot, then put every thread's records on one timeline */
+	size_t count = 0, max = 65536;
+	struct es2ts_trace_rec_s *rec = malloc(max * sizeof(*rec));
+	while (rec && fread(&rec[count], sizeof(*rec), 1, fh) == 1) {
+		if (++count == max) {
+			max *= 2;
+			rec = realloc(rec, max * sizeof(*rec));
+		}
+	}
+	fclose(fh);
+	if (!rec) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	qsort(rec, count, sizeof(*rec), cmp_ts);
+
+	uint64_t base = count ? rec[0].ts : 0;
+
+	if (!text)
+		printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+
+	for (size_t i = 0; i < count; i++) {
+		struct es2ts_trace_rec_s *r = &rec[i];
+		const char *name = r->event < TRACE_MAX ? names[r->event] : "unknown";
+		char phase = r->event < TRACE_MAX ? phases[r->event] : 'i';
+		double us = (r->ts - base) / 1000.0;
+
+		if (text) {
+			printf("%14.3f us  tid %-7u ctx 0x%-12" PRIx64 " %c %-12s a %" PRId64 " b %" PRId64 "\n",
+				us, r->tid, r->ctx, phase, name, r->a, r->b);
+			continue;
+		}
+
+		printf("{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%u,%s"
+			"\"args\":{\"ctx\":\"0x%" PRIx64 "\",\"a\":%" PRId64 ",\"b\":%" PRId64 "}}%s\n",
+			name, phase, us, r->tid, phase == 'i' ? "\"s\":\"t\"," : "",
+			r->ctx, r->a, r->b, i + 1 < count ? "," : "");
+	}
+
+	if (!text)
+		printf("]}\n");
+
+	free(rec);
+	return 0;
+}
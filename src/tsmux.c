@@ -0,0 +1,456 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include "config.h"
+#include <libes2ts/es2ts.h>
+#include "tsmux.h"
+#include "crc32.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* PTS/DTS lead over the PCR, same as the libavformat mpegts default of 0.7 seconds */
+#define TSMUX_DELAY		(90000 * 7 / 10)
+
+/* Repeat PAT/PMT at least this often (90KHz), and always ahead of a keyframe */
+#define TSMUX_PSI_INTERVAL	(90000 / 10)
+
+#define TS_MASK_33BIT		((1LL << 33) - 1)
+
+/* Output buffer, enough for a typical access unit before it has to grow */
+#define TSMUX_INITIAL_SIZE	(64 * 1024)
+
+int es2ts_tsmux_alloc(struct es2ts_tsmux_s **r, int burst, es2ts_tsmux_write cb, void *opaque)
+{
+	if ((!cb) || (burst <= 0))
+		return ES2TS_INVALID_ARG;
+
+	struct es2ts_tsmux_s *mux = calloc(1, sizeof(*mux));
+	if (!mux)
+		return ES2TS_ERROR;
+
+	mux->burstlen = burst * TS_PACKET_SIZE;
+	mux->maxlen = mux->burstlen;
+	while (mux->maxlen < TSMUX_INITIAL_SIZE)
+		mux->maxlen += mux->burstlen;
+	mux->ptr = malloc(mux->maxlen);
+	mux->iovmax = mux->maxlen / mux->burstlen + 1;
+	mux->iov = malloc(mux->iovmax * sizeof(struct iovec));
+	if ((!mux->ptr) || (!mux->iov)) {
+		free(mux->ptr);
+		free(mux->iov);
+		free(mux);
+		return ES2TS_ERROR;
+	}
+	mux->cb = cb;
+	mux->opaque = opaque;
+
+	*r = mux;
+	return ES2TS_OK;
+}
+
+void es2ts_tsmux_free(struct es2ts_tsmux_s *mux)
+{
+	if (!mux)
+		return;
+
+	free(mux->ptr);
+	free(mux->iov);
+	memset(mux, 0, sizeof(*mux));
+	free(mux);
+}
+
+int es2ts_tsmux_stream_add(struct es2ts_tsmux_s *mux, int number, int stream_type,
+	struct es2ts_tsmux_stream_s **r)
+{
+	struct es2ts_tsmux_program_s *program = 0;
+
+	int stream_id;
+	switch (stream_type) {
+	case TS_STREAM_TYPE_H264:
+		stream_id = TS_STREAM_ID_VIDEO;
+		break;
+	case TS_STREAM_TYPE_AAC:
+		stream_id = TS_STREAM_ID_AUDIO;
+		break;
+	case TS_STREAM_TYPE_AC3:
+		stream_id = TS_STREAM_ID_PRIVATE1;
+		break;
+	default:
+		return ES2TS_INVALID_ARG;
+	}
+
+	if ((!mux) || (number <= 0) || (number > 0xffff))
+		return ES2TS_INVALID_ARG;
+	if (mux->nstreams == TSMUX_STREAMS_MAX)
+		return ES2TS_NO_RESOURCE;
+
+	for (int i = 0; i < mux->nprograms; i++) {
+		if (mux->programs[i].number == number)
+			program = &mux->programs[i];
+	}
+	if (!program) {
+		if (mux->nprograms == TSMUX_PROGRAMS_MAX)
+			return ES2TS_NO_RESOURCE;
+		program = &mux->programs[mux->nprograms];
+		program->number = number;
+		program->pmt_pid = TS_PID_PMT + mux->nprograms;
+		mux->nprograms++;
+	}
+
+	struct es2ts_tsmux_stream_s *stream = &mux->streams[mux->nstreams];
+	stream->program = program;
+	stream->pid = TS_PID_ES + mux->nstreams;
+	stream->stream_type = stream_type;
+	stream->stream_id = stream_id;
+	mux->nstreams++;
+
+	/* Decoders lock to the video clock, audio only programs make do */
+	if (!program->pcr || (stream_type == TS_STREAM_TYPE_H264 && program->pcr->stream_type != TS_STREAM_TYPE_H264))
+		program->pcr = stream;
+	program->streams[program->nstreams++] = stream;
+	mux->psi_valid = 0;
+
+	*r = stream;
+	return ES2TS_OK;
+}
+
+/* Hand complete bursts downstream in one call, and the partial tail too when all is set */
+static int deliver(struct es2ts_tsmux_s *mux, int all)
+{
+	unsigned int len = mux->usedlen - (all ? 0 : mux->usedlen % mux->burstlen);
+	int iovcnt = 0;
+	int ret;
+
+	if (len == 0)
+		return ES2TS_OK;
+
+	for (unsigned int idx = 0; idx < len; idx += mux->burstlen) {
+		mux->iov[iovcnt].iov_base = mux->ptr + idx;
+		mux->iov[iovcnt].iov_len = (len - idx < mux->burstlen) ? len - idx : mux->burstlen;
+		iovcnt++;
+	}
+
+	ret = mux->cb(mux->opaque, mux->iov, iovcnt);
+
+	memmove(mux->ptr, mux->ptr + len, mux->usedlen - len);
+	mux->usedlen -= len;
+
+	return ret;
+}
+
+int es2ts_tsmux_flush(struct es2ts_tsmux_s *mux)
+{
+	return deliver(mux, 1);
+}
+
+/* Next free packet slot in the output buffer */
+static unsigned char *packet_get(struct es2ts_tsmux_s *mux)
+{
+	if (mux->usedlen + TS_PACKET_SIZE > mux->maxlen) {
+		unsigned int maxlen = mux->maxlen * 2;
+		int iovmax = maxlen / mux->burstlen + 1;
+
+		unsigned char *ptr = realloc(mux->ptr, maxlen);
+		if (!ptr)
+			return 0;
+		mux->ptr = ptr;
+		mux->maxlen = maxlen;
+
+		struct iovec *iov = realloc(mux->iov, iovmax * sizeof(struct iovec));
+		if (!iov)
+			return 0;
+		mux->iov = iov;
+		mux->iovmax = iovmax;
+	}
+
+	return mux->ptr + mux->usedlen;
+}
+
+/* The slot from packet_get() is complete */
+static void packet_put(struct es2ts_tsmux_s *mux)
+{
+	mux->usedlen += TS_PACKET_SIZE;
+}
+
+/* A single packet section, ready to send bar its continuity counter */
+static int build_section(unsigned char *p, int pid, unsigned char *section, int len)
+{
+	/* Sections are kept to a single packet */
+	if (len > TS_PACKET_SIZE - 5)
+		return ES2TS_ERROR;
+
+	uint32_t crc = es2ts_crc32_mpeg(section, len - 4);
+	section[len - 4] = crc >> 24;
+	section[len - 3] = crc >> 16;
+	section[len - 2] = crc >> 8;
+	section[len - 1] = crc;
+
+	p[0] = 0x47;
+	p[1] = 0x40 | (pid >> 8);
+	p[2] = pid;
+	p[3] = 0x10;
+	p[4] = 0; /* pointer_field */
+	memcpy(p + 5, section, len);
+	memset(p + 5 + len, 0xff, TS_PACKET_SIZE - 5 - len);
+
+	return ES2TS_OK;
+}
+
+/* The PAT listing every program and the PMT of each, built once ahead of
+ * the first access unit. The layout is frozen from then on, streams are
+ * only added before es2ts_process_start(), so version_number stays 0.
+ */
+static int build_psi(struct es2ts_tsmux_s *mux)
+{
+	unsigned char pat[12 + 4 * TSMUX_PROGRAMS_MAX] = {
+		0x00, 0xb0, 0,
+		0x00, 0x01,		/* transport_stream_id */
+		0xc1, 0x00, 0x00,
+	};
+
+	int len = 8;
+	for (int i = 0; i < mux->nprograms; i++) {
+		pat[len++] = mux->programs[i].number >> 8;
+		pat[len++] = mux->programs[i].number;
+		pat[len++] = 0xe0 | (mux->programs[i].pmt_pid >> 8);
+		pat[len++] = mux->programs[i].pmt_pid;
+	}
+	pat[2] = len + 4 - 3;
+
+	int ret = build_section(mux->psi_pat, TS_PID_PAT, pat, len + 4);
+	if (ES2TS_FAILED(ret))
+		return ret;
+
+	for (int i = 0; i < mux->nprograms; i++) {
+		struct es2ts_tsmux_program_s *program = &mux->programs[i];
+		unsigned char pmt[16 + 11 * TSMUX_STREAMS_MAX] = {
+			0x02, 0xb0, 0,
+			program->number >> 8, program->number & 0xff,
+			0xc1, 0x00, 0x00,
+			0xe0 | (program->pcr->pid >> 8), program->pcr->pid & 0xff,
+			0xf0, 0x00,
+		};
+
+		len = 12;
+		for (int j = 0; j < program->nstreams; j++) {
+			struct es2ts_tsmux_stream_s *stream = program->streams[j];
+			pmt[len++] = stream->stream_type;
+			pmt[len++] = 0xe0 | (stream->pid >> 8);
+			pmt[len++] = stream->pid;
+			if (stream->stream_type == TS_STREAM_TYPE_AC3) {
+				/* ES_info, registration_descriptor 'AC-3' as libavformat writes it */
+				static const unsigned char reg[] = { 0xf0, 0x06, 0x05, 0x04, 'A', 'C', '-', '3' };
+				memcpy(pmt + len, reg, sizeof(reg));
+				len += sizeof(reg);
+			} else {
+				pmt[len++] = 0xf0;
+				pmt[len++] = 0x00;
+			}
+		}
+		pmt[2] = len + 4 - 3;
+
+		ret = build_section(program->psi_pmt, program->pmt_pid, pmt, len + 4);
+		if (ES2TS_FAILED(ret))
+			return ret;
+	}
+
+	mux->psi_valid = 1;
+	return ES2TS_OK;
+}
+
+static int write_section(struct es2ts_tsmux_s *mux, const unsigned char *section, unsigned char *cc)
+{
+	unsigned char *p = packet_get(mux);
+	if (!p)
+		return ES2TS_ERROR;
+
+	memcpy(p, section, TS_PACKET_SIZE);
+	p[3] = 0x10 | *cc;
+	*cc = (*cc + 1) & 0x0f;
+
+	packet_put(mux);
+	return ES2TS_OK;
+}
+
+/* The PAT, then the PMT of the program about to be written */
+static int write_psi(struct es2ts_tsmux_s *mux, struct es2ts_tsmux_program_s *program)
+{
+	if (!mux->psi_valid && ES2TS_FAILED(build_psi(mux)))
+		return ES2TS_ERROR;
+
+	int ret = write_section(mux, mux->psi_pat, &mux->cc_pat);
+	if (ES2TS_FAILED(ret))
+		return ret;
+
+	return write_section(mux, program->psi_pmt, &program->cc_pmt);
+}
+
+static void put_timestamp(unsigned char *p, int prefix, int64_t ts)
+{
+	p[0] = (prefix << 4) | ((ts >> 29) & 0x0e) | 1;
+	p[1] = ts >> 22;
+	p[2] = ((ts >> 14) & 0xfe) | 1;
+	p[3] = ts >> 7;
+	p[4] = ((ts << 1) & 0xfe) | 1;
+}
+
+static void put_pcr(unsigned char *p, int64_t pcr)
+{
+	int64_t base = (pcr / 300) & TS_MASK_33BIT;
+	int ext = pcr % 300;
+
+	p[0] = base >> 25;
+	p[1] = base >> 17;
+	p[2] = base >> 9;
+	p[3] = base >> 1;
+	p[4] = ((base & 1) << 7) | 0x7e | (ext >> 8);
+	p[5] = ext;
+}
+
+int es2ts_tsmux_write_au(struct es2ts_tsmux_s *mux, struct es2ts_tsmux_stream_s *stream,
+	const unsigned char *data, int len, int64_t pts, int64_t dts, int keyframe)
+{
+	unsigned char pes[19];
+	int peslen;
+	int ret;
+
+	if ((!mux) || (!stream) || (!data) || (len <= 0))
+		return ES2TS_INVALID_ARG;
+
+	struct es2ts_tsmux_program_s *program = stream->program;
+	int video = (stream->stream_type == TS_STREAM_TYPE_H264);
+	if (!program->psi_written || (keyframe && video) || dts - program->psi_last >= TSMUX_PSI_INTERVAL) {
+		ret = write_psi(mux, program);
+		if (ES2TS_FAILED(ret))
+			return ret;
+		program->psi_written = 1;
+		program->psi_last = dts;
+	}
+	int pcr_stream = (stream == program->pcr);
+
+	int64_t pcr = dts * 300;
+	pts = (pts + TSMUX_DELAY) & TS_MASK_33BIT;
+	dts = (dts + TSMUX_DELAY) & TS_MASK_33BIT;
+
+	/* PES header */
+	pes[0] = 0x00;
+	pes[1] = 0x00;
+	pes[2] = 0x01;
+	pes[3] = stream->stream_id;
+	pes[6] = 0x80;
+	if (pts != dts) {
+		pes[7] = 0xc0;
+		pes[8] = 10;
+		put_timestamp(pes + 9, 3, pts);
+		put_timestamp(pes + 14, 1, dts);
+		peslen = 19;
+	} else {
+		pes[7] = 0x80;
+		pes[8] = 5;
+		put_timestamp(pes + 9, 2, pts);
+		peslen = 14;
+	}
+
+	/* Video may signal an unbounded PES length with zero */
+	int total = len + peslen - 6;
+	if (total > 0xffff)
+		total = 0;
+	pes[4] = total >> 8;
+	pes[5] = total;
+
+	/* Split the PES header plus payload across TS packets */
+	int hdridx = 0;
+	int dataidx = 0;
+	int remaining = peslen + len;
+	int first = 1;
+	while (remaining > 0) {
+		unsigned char *p = packet_get(mux);
+		if (!p)
+			return ES2TS_ERROR;
+		int aflen = -1; /* adaptation_field_length, -1 for none */
+		int avail = TS_PACKET_SIZE - 4;
+
+		if (first && pcr_stream) {
+			aflen = 7; /* flags + PCR */
+			avail -= aflen + 1;
+		} else if (first && keyframe) {
+			aflen = 1; /* flags, random_access_indicator */
+			avail -= aflen + 1;
+		}
+		if (remaining < avail) {
+			/* Stuff the final packet via the adaptation field */
+			int stuff = avail - remaining;
+			if (aflen < 0)
+				aflen = stuff - 1;
+			else
+				aflen += stuff;
+			avail = remaining;
+		}
+
+		p[0] = 0x47;
+		p[1] = (first ? 0x40 : 0x00) | (stream->pid >> 8);
+		p[2] = stream->pid & 0xff;
+		p[3] = (aflen >= 0 ? 0x30 : 0x10) | stream->cc;
+		stream->cc = (stream->cc + 1) & 0x0f;
+
+		int idx = 4;
+		if (aflen >= 0) {
+			p[idx++] = aflen;
+			if (aflen > 0) {
+				int afstart = idx;
+				p[idx++] = first ? ((pcr_stream ? 0x10 : 0x00) | (keyframe ? 0x40 : 0x00)) : 0x00;
+				if (first && pcr_stream) {
+					put_pcr(p + idx, pcr);
+					idx += 6;
+				}
+				memset(p + idx, 0xff, aflen - (idx - afstart));
+				idx = afstart + aflen;
+			}
+		}
+
+		/* Payload, the tail of the PES header first, then AU bytes */
+		int cplen = peslen - hdridx;
+		if (cplen > avail)
+			cplen = avail;
+		if (cplen > 0) {
+			memcpy(p + idx, pes + hdridx, cplen);
+			hdridx += cplen;
+			idx += cplen;
+		}
+		if (idx < TS_PACKET_SIZE) {
+			cplen = TS_PACKET_SIZE - idx;
+			memcpy(p + idx, data + dataidx, cplen);
+			dataidx += cplen;
+		}
+
+		remaining -= avail;
+		first = 0;
+
+		packet_put(mux);
+	}
+
+	return deliver(mux, mux->flush_au);
+}
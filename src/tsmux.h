@@ -0,0 +1,128 @@
+/*
+ *  H264 Encoder - Capture YUV, compress via VA-API and stream to RTP.
+ *  Original code base was the vaapi h264encode application, with 
+ *  significant additions to support capture, transform, compress
+ *  and re-containering via libavformat.
+ *
+ *  Copyright (c) 2014-2017 Steven Toth <stoth@kernellabs.com>
+ *  Copyright (c) 2014-2017 Zodiac Inflight Innovations
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef ES2TS_TSMUX_H
+#define ES2TS_TSMUX_H
+
+/* A minimal MPEG2-TS packetizer for one or more programs of H264,
+ * ADTS AAC and AC-3.
+ * Access units in, 188 byte TS packets out, no libavformat involved.
+ * PID layout follows the libavformat mpegts defaults so downstream
+ * equipment sees the same stream regardless of which muxer is in use:
+ * PMTs from 0x1000 and elementary streams from 0x100, in the order
+ * programs and streams are added.
+ */
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define TS_PACKET_SIZE		188
+#define TS_PID_PAT		0x0000
+#define TS_PID_PMT		0x1000	/* First program */
+#define TS_PID_ES		0x0100	/* First elementary stream */
+#define TS_PROGRAM_NUMBER	1	/* Single program default */
+#define TS_STREAM_TYPE_H264	0x1b
+#define TS_STREAM_TYPE_AAC	0x0f
+#define TS_STREAM_TYPE_AC3	0x81
+#define TS_STREAM_ID_VIDEO	0xe0
+#define TS_STREAM_ID_AUDIO	0xc0
+#define TS_STREAM_ID_PRIVATE1	0xbd	/* AC-3 */
+
+#define TSMUX_PROGRAMS_MAX	16
+#define TSMUX_STREAMS_MAX	32
+
+struct es2ts_tsmux_program_s;
+
+struct es2ts_tsmux_stream_s {
+	struct es2ts_tsmux_program_s *program;
+	int pid;
+	int stream_type;
+	int stream_id;		/* PES stream_id */
+	unsigned char cc;
+};
+
+struct es2ts_tsmux_program_s {
+	int number;
+	int pmt_pid;
+	unsigned char cc_pmt;
+	struct es2ts_tsmux_stream_s *pcr;	/* Carries the PCR, the first video stream or failing that the first stream */
+	struct es2ts_tsmux_stream_s *streams[TSMUX_STREAMS_MAX];
+	int nstreams;
+
+	int psi_written;
+	int64_t psi_last;	/* DTS at which PAT/PMT were last sent */
+	unsigned char psi_pmt[TS_PACKET_SIZE];	/* Cached, continuity counter patched per send */
+};
+
+/* Downstream writer, one iovec per burst of TS packets */
+typedef int (*es2ts_tsmux_write)(void *opaque, const struct iovec *iov, int iovcnt);
+
+struct es2ts_tsmux_s {
+	es2ts_tsmux_write cb;
+	void *opaque;
+
+	/* Packets of the access unit being written, grows to fit. Complete
+	 * bursts go to cb in a single call once the access unit is done.
+	 */
+	unsigned char *ptr;
+	unsigned int maxlen;
+	unsigned int usedlen;
+	unsigned int burstlen;
+	int flush_au;		/* Deliver the partial burst at the end of every access unit too */
+
+	struct iovec *iov;
+	int iovmax;
+
+	unsigned char cc_pat;
+	unsigned char psi_pat[TS_PACKET_SIZE];
+	int psi_valid;		/* psi_pat and every psi_pmt match the stream layout */
+
+	struct es2ts_tsmux_program_s programs[TSMUX_PROGRAMS_MAX];
+	int nprograms;
+	struct es2ts_tsmux_stream_s streams[TSMUX_STREAMS_MAX];
+	int nstreams;
+};
+
+/* Timestamps are 90KHz. burst is the number of TS packets per callback. */
+int es2ts_tsmux_alloc(struct es2ts_tsmux_s **mux, int burst, es2ts_tsmux_write cb, void *opaque);
+void es2ts_tsmux_free(struct es2ts_tsmux_s *mux);
+
+/* Add an elementary stream of TS_STREAM_TYPE_* to program number program,
+ * creating the program on first use. Every stream must be added before the
+ * first access unit.
+ */
+int es2ts_tsmux_stream_add(struct es2ts_tsmux_s *mux, int program, int stream_type,
+	struct es2ts_tsmux_stream_s **stream);
+
+/* Packetize one complete access unit of stream into PES / TS. A video
+ * keyframe also brings the PAT / PMT forward.
+ */
+int es2ts_tsmux_write_au(struct es2ts_tsmux_s *mux, struct es2ts_tsmux_stream_s *stream,
+	const unsigned char *data, int len, int64_t pts, int64_t dts, int keyframe);
+
+/* Push everything downstream, including a partially filled burst */
+int es2ts_tsmux_flush(struct es2ts_tsmux_s *mux);
+
+#endif